@@ -28,14 +28,47 @@
 void (*gotoApp)( void ) = 0x0000;
 
 // global vars for flash data handling
-uint8_t flashBuffer[SPM_PAGESIZE];
+#ifdef FLASH_NO_BUFFER
+  uint8_t flashWordLow = 0xFF; // low byte of the next word for the temporary page buffer
+#elif defined(FLASH_PAGE_CACHE)
+  uint8_t flashCache[FLASH_PAGE_CACHE][SPM_PAGESIZE];
+  uint16_t flashCachePage[FLASH_PAGE_CACHE];      // flash page of each slot
+  uint16_t flashCacheDataCount[FLASH_PAGE_CACHE]; // data count of each slot, 0 if the slot is free
+  uint8_t flashCacheAge[FLASH_PAGE_CACHE];        // number of page changes since each slot was used
+  uint8_t flashCacheSlot = 0;                     // slot of the current flash page
+  uint8_t *flashBuffer = flashCache[0];
+#else
+  uint8_t flashBuffer[SPM_PAGESIZE];
+#endif
 uint16_t flashBufferPos = 0;
 uint16_t flashBufferDataCount = 0;
 uint16_t flashPage = 0;
 
+// pages announced to be written next, which are erased in the background
+#ifdef FLASH_ERASE_AHEAD
+  uint16_t eraseAheadFirst = 0; // first erased page, which is not written yet
+  uint16_t eraseAheadNext = 0;  // next page to erase
+  uint16_t eraseAheadEnd = 0;   // page behind the announced range
+#endif
+
 // CAN bus communication
 struct can_frame canMsg;
-MCP2515 mcp2515;
+CanController canController;
+
+// CAN-IDs used for the bootloader messages, which may be switched to the
+// high priority CAN-IDs within a flashing session
+#if defined(UDS)
+  #define CAN_ID_TX UDS_CAN_ID_RESPONSE
+  #define CAN_ID_RX UDS_CAN_ID_REQUEST
+#elif defined(CAN_ID_REMOTE_TO_MCU_FAST)
+  uint32_t canIdMcuToRemote = CAN_ID_MCU_TO_REMOTE;
+  uint32_t canIdRemoteToMcu = CAN_ID_REMOTE_TO_MCU;
+  #define CAN_ID_TX canIdMcuToRemote
+  #define CAN_ID_RX canIdRemoteToMcu
+#else
+  #define CAN_ID_TX CAN_ID_MCU_TO_REMOTE
+  #define CAN_ID_RX CAN_ID_REMOTE_TO_MCU
+#endif
 
 /*
  * Very early clear watchdog reset flag and turn off the watchdog.
@@ -48,14 +81,14 @@ MCP2515 mcp2515;
 void get_mcusr(void) __attribute__((naked)) __attribute__((used)) __attribute__((section(".init3")));
 void get_mcusr(void) {
 #if defined(MCUCSR)
-  #if MCUSR_TO_R2 // store MCUCSR into R2 if enabled
+  #if MCUSR_TO_R2 || defined(WARM_START) // store MCUCSR into R2 if enabled
     __asm__ __volatile__(
         "  mov r2, %[mcusr_val] ;Move Between Registers \n\t"
         ::[mcusr_val] "r"(MCUCSR));
   #endif
   MCUCSR = 0;
 #else
-  #if MCUSR_TO_R2 // store MCUSR into R2 if enabled
+  #if MCUSR_TO_R2 || defined(WARM_START) // store MCUSR into R2 if enabled
     __asm__ __volatile__(
         "  mov r2, %[mcusr_val] ;Move Between Registers \n\t"
         ::[mcusr_val] "r"(MCUSR));
@@ -71,96 +104,141 @@ void get_mcusr(void) {
 int main () {
   // Read from R2 into local mcusr variable if enabled.
   // We use a local variable here to save some space.
-  #if MCUSR_TO_R2
+  #if MCUSR_TO_R2 || defined(WARM_START)
     uint8_t mcusr = 0x00; // MCUSR from bootloader
     __asm__ __volatile__("  mov %[mcusr_val],r2 ;Move Between Registers \n\t"
                         :[mcusr_val] "=r"(mcusr));
   #endif
 
-  // call init from arduino framework to setup timers
-  init();
+  // Check for a warm start by the main application. The MCUSR is always zero
+  // then, because it is cleared before the main application is started.
+  // The handoff data is invalidated, so a following reset is a cold start.
+  #ifdef WARM_START
+    bool warm = (mcusr == 0 && warmStart.magic == WARM_START_MAGIC);
+    uint8_t warmCanSpeed = warmStart.canSpeed;
+    warmStart.magic = 0;
+  #endif
 
-  // local variables to save some flash space used by the bootloader
-  uint32_t flashAddr = 0;
-  boolean flashing = false;
+  // start timer 1 used for all timeouts
+  timerInit();
 
-  // local vars for timed actions
-  uint32_t startTime = millis();
-  uint32_t curTime;
-  uint32_t ledTime = 0;
+  // reset the trace buffer (if enabled)
+  TRACE_INIT;
+  TRACE_EVENT(TRACE_EVT_BOOT, 0);
 
-  // change interrupt vectors to bootloader section
-  uint8_t sregtemp = SREG;
-  cli();
-  uint8_t ivtemp = IV_REG;
-  IV_REG = ivtemp | (1<<IVCE);
-  IV_REG = ivtemp | (1<<IVSEL);
-  SREG = sregtemp;
+  // local variables to save some flash space used by the bootloader
+  #ifndef UDS
+    uint32_t flashAddr = 0;
+  #endif
+  bool flashing = false;
+  #ifdef EEPROM_COMMANDS
+    uint16_t eepromAddr = 0;
+  #endif
+
+  // local vars for timed actions (in timer ticks)
+  uint16_t startTime;
+  uint16_t ledTime = 0;
+  bool ledBlink = false;
+  #ifdef CAN_ID_REMOTE_TO_MCU_FAST
+    uint16_t canIdSwitchTime = 0;
+    bool canIdSwitchPending = false;
+  #endif
+  #ifdef BITRATE_SWITCH
+    CAN_SPEED currentSpeed = CAN_KBPS; // last confirmed bitrate, used as fallback
+    CAN_SPEED switchSpeed = CAN_KBPS; // bitrate of a pending switch
+    uint16_t bitrateSwitchTime = 0;
+    bool bitrateSwitchPending = false;
+  #endif
 
   // init CAN controller
-  mcp2515.init();
+  canController.init();
 
   // init LED (if defined)
   LED_INIT;
   LED_ON;
 
+  // copy the staging slot if requested by the main application or if an
+  // earlier copy was interrupted
+  #ifdef DUAL_SLOT
+    copySlot();
+  #endif
+
   // fill flash buffer with predefined data
-  memset(flashBuffer, 0xFF, SPM_PAGESIZE);
+  #if defined(FLASH_PAGE_CACHE)
+    memset(flashCache, 0xFF, sizeof(flashCache));
+  #elif !defined(FLASH_NO_BUFFER)
+    memset(flashBuffer, 0xFF, SPM_PAGESIZE);
+  #endif
 
   // reset the CAN controller, go into infinite loop with LED blinking on errors
-  if (mcp2515.reset() != MCP2515::ERROR_OK) {
+  TRACE_EVENT(TRACE_EVT_MCP_RESET, 0);
+  if (canController.reset() != CanController::ERROR_OK) {
     while (1) {
       #ifdef LED
         LED_OFF;
-        delay(50);
+        _delay_ms(50);
         LED_ON;
-        delay(50);
+        _delay_ms(50);
       #endif
     }
   }
+  TRACE_EVENT(TRACE_EVT_MCP_RESET_DONE, 0);
+
+  #ifdef WARM_START
+  if (warm) {
+    // use the bitrate passed by the main application
+    canController.setBitrate((CAN_SPEED)warmCanSpeed, MCP_CLOCK);
+    #ifdef BITRATE_SWITCH
+      currentSpeed = (CAN_SPEED)warmCanSpeed;
+    #endif
+  } else
+  #endif
+  {
+    #ifdef CAN_KBPS_DETECT
+      // try to detect the bitrate from a list of given bitrates
+      TRACE_EVENT(TRACE_EVT_DETECT, 0);
+      CAN_SPEED list[] = { CAN_KBPS_DETECT };
+      for (uint8_t i = 0; i < sizeof list; i++) {
+        LED_TOGGLE;
 
-  #ifdef CAN_KBPS_DETECT
-    // try to detect the bitrate from a list of given bitrates
-    CAN_SPEED list[] = { CAN_KBPS_DETECT };
-    for (uint8_t i = 0; i < sizeof list; i++) {
-      LED_TOGGLE;
-
-      mcp2515.setBitrate(list[i], MCP_CLOCK);
-      mcp2515.setListenOnlyMode();
-
-      // wait for a message
-      startTime = millis();
-      do {
-        if (mcp2515.readMessage(&canMsg) == MCP2515::ERROR_OK) {
-          // got a message... found a bitrate
-          goto found_bitrate;
-        }
-      } while (millis() < startTime + TIMEOUT_DETECT_CAN_KBPS);
-    }
+        canController.setBitrate(list[i], MCP_CLOCK);
+        canController.setListenOnlyMode();
+
+        // wait for a message
+        startTime = timerTicks();
+        do {
+          if (canController.readMessage(&canMsg) == CanController::ERROR_OK) {
+            // got a message... found a bitrate
+            TRACE_EVENT(TRACE_EVT_DETECT_DONE, i);
+            #ifdef BITRATE_SWITCH
+              currentSpeed = list[i];
+            #endif
+            goto found_bitrate;
+          }
+        } while (timerElapsed(startTime) < MS_TO_TICKS(TIMEOUT_DETECT_CAN_KBPS));
+      }
 
-    // fallback use a fixed bitrate if we could not detect
-    mcp2515.setBitrate(CAN_KBPS, MCP_CLOCK);
+      // fallback use a fixed bitrate if we could not detect
+      TRACE_EVENT(TRACE_EVT_DETECT_DONE, 0xFF);
+      canController.setBitrate(CAN_KBPS, MCP_CLOCK);
 
-    found_bitrate:
+      found_bitrate:
 
-    LED_ON;
+      LED_ON;
 
-  #else
-    // set fixed bitrate
-    mcp2515.setBitrate(CAN_KBPS, MCP_CLOCK);
-  #endif
+    #else
+      // set fixed bitrate
+      canController.setBitrate(CAN_KBPS, MCP_CLOCK);
+    #endif
+  }
 
-  // set mcp2515 filter to accept CAN_ID_REMOTE_TO_MCU only
-  #if CAN_EFF
-    mcp2515.setFilterMask(MCP2515::MASK0, true, CAN_EFF_MASK);
-    mcp2515.setFilter(MCP2515::RXF0, true, CAN_ID_REMOTE_TO_MCU);
-  #else
-    mcp2515.setFilterMask(MCP2515::MASK0, false, CAN_SFF_MASK);
-    mcp2515.setFilter(MCP2515::RXF0, false, CAN_ID_REMOTE_TO_MCU);
-  #endif
+  // set CAN controller filters to accept CAN_ID_RX only
+  // (CAN_ID_REMOTE_TO_MCU or the UDS request CAN-ID)
+  setCanFilters(CAN_ID_RX);
 
-  mcp2515.setNormalMode();
+  canController.setNormalMode();
 
+  #ifndef UDS
   // set own mcu ID as a variable which enables mcu ID to be read from eeprom
   uint16_t mcuId = MCU_ID;
 
@@ -173,60 +251,177 @@ int main () {
   canMsg.can_dlc = 8;
   canMsg.data[CAN_DATA_BYTE_MCU_ID_MSB]   = MCU_ID_MSB;
   canMsg.data[CAN_DATA_BYTE_MCU_ID_LSB]   = MCU_ID_LSB;
-  canMsg.data[CAN_DATA_BYTE_CMD]          = CMD_BOOTLOADER_START;
-  canMsg.data[CAN_DATA_BYTE_LEN_AND_ADDR] = 0x00;
-  canMsg.data[4] = SIGNATURE_0;
-  canMsg.data[5] = SIGNATURE_1;
-  canMsg.data[6] = SIGNATURE_2;
-  canMsg.data[7] = BOOTLOADER_CMD_VERSION;
-  mcp2515.sendMessage(&canMsg);
+  #ifdef WARM_START
+  if (warm) {
+    // the flash application is already waiting... enter flashing mode
+    // immediately and send flash ready instead
+    TRACE_EVENT(TRACE_EVT_WARM_START, warmCanSpeed);
+    flashing = true;
+    prepMsg(CMD_FLASH_READY, 0x00, flashAddr);
+  } else
+  #endif
+  {
+    canMsg.data[CAN_DATA_BYTE_CMD]          = CMD_BOOTLOADER_START;
+    #ifdef FLASH_RESUME
+      // bit 0 is set if an interrupted flashing session may be resumed
+      canMsg.data[CAN_DATA_BYTE_LEN_AND_ADDR] = (flashResumePage() > 0) ? 0x01 : 0x00;
+    #else
+      canMsg.data[CAN_DATA_BYTE_LEN_AND_ADDR] = 0x00;
+    #endif
+    canMsg.data[4] = SIGNATURE_0;
+    canMsg.data[5] = SIGNATURE_1;
+    canMsg.data[6] = SIGNATURE_2;
+    canMsg.data[7] = BOOTLOADER_CMD_VERSION;
+  }
+  canController.sendMessage(&canMsg);
+  #else
+    // UDS: the tester must still enter the programming session, but there is
+    // no timeout to start the main application after a warm start
+    #ifdef WARM_START
+      if (warm) {
+        TRACE_EVENT(TRACE_EVT_WARM_START, warmCanSpeed);
+        flashing = true;
+      }
+    #endif
+  #endif
+  TRACE_EVENT(TRACE_EVT_WAIT_INIT, 0);
 
   // reset the start time for correct waiting
-  startTime = millis();
+  startTime = timerTicks();
 
   // main loop
   while (1) {
-    curTime = millis();
-
     // start the main application if we are not in bootloading mode and run into timeout
-    if (!flashing && curTime > startTime + TIMEOUT) {
+    if (!flashing && timerElapsed(startTime) > MS_TO_TICKS(TIMEOUT)) {
       startApp();
     }
 
+    // switch back to the default CAN-IDs if a switch was not confirmed in time
+    #ifdef CAN_ID_REMOTE_TO_MCU_FAST
+      if (canIdSwitchPending && timerElapsed(canIdSwitchTime) > MS_TO_TICKS(TIMEOUT_CAN_ID_SWITCH)) {
+        switchCanIds(false);
+        canIdSwitchPending = false;
+      }
+    #endif
+
+    // switch back to the original bitrate if a switch was not confirmed in time
+    #ifdef BITRATE_SWITCH
+      if (bitrateSwitchPending && timerElapsed(bitrateSwitchTime) > MS_TO_TICKS(TIMEOUT_BITRATE_SWITCH)) {
+        canController.setBitrate(currentSpeed, MCP_CLOCK);
+        canController.setNormalMode();
+        bitrateSwitchPending = false;
+      }
+    #endif
+
     // turn led on if time to turn is set and greater than current time
-    if (ledTime != 0 && curTime >= ledTime) {
+    if (ledBlink && timerElapsed(ledTime) >= MS_TO_TICKS(100)) {
       LED_ON;
-      ledTime = 0;
+      ledBlink = false;
     }
 
     // try to get a message from the CAN controller
-    if (mcp2515.readMessage(&canMsg) == MCP2515::ERROR_OK) {
+    if (canController.readMessage(&canMsg) == CanController::ERROR_OK) {
       // got a message...
       if (canMsg.can_id ==
           #if CAN_EFF
-            (CAN_ID_REMOTE_TO_MCU | CAN_EFF_FLAG)
+            (CAN_ID_RX | CAN_EFF_FLAG)
+          #else
+            CAN_ID_RX
+          #endif
+        #ifdef UDS
+        && canMsg.can_dlc > 0) {
+        #else
+          #ifdef CAN_FD
+          && canMsg.can_dlc >= 8
           #else
-            CAN_ID_REMOTE_TO_MCU
+          && canMsg.can_dlc == 8
           #endif
-        && canMsg.can_dlc == 8
         && canMsg.data[CAN_DATA_BYTE_MCU_ID_MSB] == MCU_ID_MSB
         && canMsg.data[CAN_DATA_BYTE_MCU_ID_LSB] == MCU_ID_LSB) {
+        #endif
         // ... and the message is for this bootloader
 
-        // for all CAN messages to send in this block, can_dlc and MCU ID will
-        // be set correctly by the incoming message, so we can save flash space
-        // by not setting them again ... :-)
-
         // toggle the LED on each can message and set time to turn it on again
         // after 100ms of inactivity
         LED_TOGGLE;
-        ledTime = curTime + 100;
+        ledTime = timerTicks();
+        ledBlink = true;
+
+        // any message on the switched CAN-IDs confirms the switch
+        #ifdef CAN_ID_REMOTE_TO_MCU_FAST
+          canIdSwitchPending = false;
+        #endif
+
+        // any message at the new bitrate confirms the switch
+        #ifdef BITRATE_SWITCH
+          if (bitrateSwitchPending) {
+            currentSpeed = switchSpeed;
+            bitrateSwitchPending = false;
+          }
+        #endif
+
+        #ifdef UDS
+        // handle the ISO-TP frame
+        uint8_t res = udsReceive();
+        if (res == UDS_RESULT_PROGRAMMING) {
+          TRACE_EVENT(TRACE_EVT_FLASH_INIT, 0);
+          flashing = true;
+        } else if (res == UDS_RESULT_START_APP) {
+          // write value of local mcusr into R2
+          #if MCUSR_TO_R2
+            __asm__ __volatile__("  mov r2,%[mcusr_val] ;Move Between Registers \n\t"
+                       ::[mcusr_val] "r" (mcusr));
+          #endif
+
+          // start the main application
+          startApp();
+        }
+        #else
+
+        // for all CAN messages to send in this block, can_dlc and MCU ID will
+        // be set correctly by the incoming message, so we can save flash space
+        // by not setting them again ... :-)
 
         // set the can_id once to save flash space
         #if CAN_EFF
-          canMsg.can_id = CAN_ID_MCU_TO_REMOTE | CAN_EFF_FLAG;
+          canMsg.can_id = CAN_ID_TX | CAN_EFF_FLAG;
         #else
-          canMsg.can_id = CAN_ID_MCU_TO_REMOTE;
+          canMsg.can_id = CAN_ID_TX;
+        #endif
+
+        // CAN FD frames are only used for the flash data, all responses are
+        // classic CAN frames with 8 bytes
+        #ifdef CAN_FD
+          uint8_t rxDlc = canMsg.can_dlc;
+          canMsg.can_dlc = 8;
+        #endif
+
+        #ifdef PING_COMMAND
+        if (canMsg.data[CAN_DATA_BYTE_CMD] == CMD_PING) {
+          // answer with the receive and transmit time or the current state
+          uint16_t rxTime = timerTicks();
+          if (canMsg.data[CAN_DATA_BYTE_LEN_AND_ADDR] == PING_STATE) {
+            // the flash address of all supported MCUs fits into 24 bits, the
+            // number of bytes in the page buffer is split into the low byte in
+            // byte 4 and the upper bits in byte 3, since a full page buffer
+            // holds up to 256 bytes
+            prepMsg(CMD_PING, 0x00, ((uint32_t)(flashBufferDataCount & 0xFF) << 24) | flashAddr);
+            canMsg.data[CAN_DATA_BYTE_LEN_AND_ADDR] = PING_STATE | (flashing ? PING_FLASHING : 0)
+              | ((flashBufferDataCount >> PING_STATE_COUNT_SHIFT) & 0x7E);
+          } else {
+            canMsg.data[CAN_DATA_BYTE_LEN_AND_ADDR] = PING_TIME | (flashing ? PING_FLASHING : 0);
+            canMsg.data[4] = rxTime >> 8;
+            canMsg.data[5] = rxTime & 0xFF;
+            uint16_t txTime = timerTicks();
+            canMsg.data[6] = txTime >> 8;
+            canMsg.data[7] = txTime & 0xFF;
+          }
+          canController.sendMessage(&canMsg);
+
+          // a ping keeps the bootloader waiting for flash init
+          startTime = timerTicks();
+          continue;
+        }
         #endif
 
         if (!flashing) {
@@ -236,51 +431,56 @@ int main () {
             && canMsg.data[5] == SIGNATURE_1
             && canMsg.data[6] == SIGNATURE_2) {
             // init bootloading mode
+            TRACE_EVENT(TRACE_EVT_FLASH_INIT, 0);
 
             flashing = true;
 
             // send flash ready message
             prepMsg(CMD_FLASH_READY, 0x00, flashAddr);
-            mcp2515.sendMessage(&canMsg);
+            canController.sendMessage(&canMsg);
 
           }
 
         } else {
           // we are in flashing mode...
+
+          // finish a background erase before any command except flash data,
+          // since the other commands may read the flash or write the EEPROM
+          #ifdef FLASH_ERASE_AHEAD
+            if (canMsg.data[CAN_DATA_BYTE_CMD] != CMD_FLASH_DATA) {
+              flashEraseAheadFinish();
+            }
+          #endif
+
           if (canMsg.data[CAN_DATA_BYTE_CMD] == CMD_FLASH_ERASE) {
             // erase flash
-            flashAddr = 0;
-            do {
-              boot_page_erase(flashAddr);
-              boot_spm_busy_wait();
-              flashAddr += SPM_PAGESIZE;
-            } while (flashAddr < FLASHEND_BL);
-
-            memset(flashBuffer, 0xFF, SPM_PAGESIZE);
-            flashBufferDataCount = 0;
-            flashPage = 0;
-            flashBufferPos = 0;
+            flashErase();
             flashAddr = 0;
 
             prepMsg(CMD_FLASH_READY, 0x00, flashAddr);
-            mcp2515.sendMessage(&canMsg);
+            canController.sendMessage(&canMsg);
 
+          #ifndef COMPACT
           } else if (canMsg.data[CAN_DATA_BYTE_CMD] == CMD_FLASH_READ) {
             // read flash memory at given address
             uint32_t readFlashAddr = (uint32_t)canMsg.data[7] + ((uint32_t)canMsg.data[6] << 8) + ((uint32_t)canMsg.data[5] << 16) + ((uint32_t)canMsg.data[4] << 24);
 
-            if (readFlashAddr > FLASHEND_BL) {
+            if (readFlashAddr > FLASHEND_APP) {
               // flash read after flash end
-              prepMsg(CMD_FLASH_READ_ADDRESS_ERROR, 0x00, FLASHEND_BL);
-              mcp2515.sendMessage(&canMsg);
+              prepMsg(CMD_FLASH_READ_ADDRESS_ERROR, 0x00, FLASHEND_APP);
+              canController.sendMessage(&canMsg);
               continue;
             }
 
             uint8_t len = 0;
             for (uint8_t i = 0; i < 4; i++) {
-              if (readFlashAddr + i <= FLASHEND_BL) {
+              if (readFlashAddr + i <= FLASHEND_APP) {
                 // in flash area
-                canMsg.data[4 + i] = pgm_read_byte_near(readFlashAddr + i);
+                #ifdef DUAL_SLOT
+                  canMsg.data[4 + i] = flash_read_byte(FLASH_ADDR_OFFSET + readFlashAddr + i);
+                #else
+                  canMsg.data[4 + i] = pgm_read_byte_near(readFlashAddr + i);
+                #endif
                 len++;
               } else {
                 // not in flash area
@@ -290,34 +490,91 @@ int main () {
 
             canMsg.data[CAN_DATA_BYTE_CMD]          = CMD_FLASH_READ_DATA;
             canMsg.data[CAN_DATA_BYTE_LEN_AND_ADDR] = (len << 5) | (readFlashAddr & 0b00011111);  // number of data bytes read and address part
-            mcp2515.sendMessage(&canMsg);
+            canController.sendMessage(&canMsg);
+          #endif
 
           } else if (canMsg.data[CAN_DATA_BYTE_CMD] == CMD_FLASH_SET_ADDRESS) {
             // set the start address for flashing
             uint32_t newFlashAddr = (uint32_t)canMsg.data[7] + ((uint32_t)canMsg.data[6] << 8) + ((uint32_t)canMsg.data[5] << 16) + ((uint32_t)canMsg.data[4] << 24);
-            uint16_t newFlashPage = newFlashAddr / SPM_PAGESIZE;
-            uint16_t newFlashBufferPos = newFlashAddr % SPM_PAGESIZE;
 
-            if (newFlashAddr > FLASHEND_BL) {
+            if (newFlashAddr > FLASHEND_APP) {
               // address cannot be flashed
-              prepMsg(CMD_FLASH_ADDRESS_ERROR, 0x00, FLASHEND_BL);
-              mcp2515.sendMessage(&canMsg);
+              prepMsg(CMD_FLASH_ADDRESS_ERROR, 0x00, FLASHEND_APP);
+              canController.sendMessage(&canMsg);
               continue;
             }
 
-            if (newFlashPage != flashPage && flashBufferDataCount > 0) {
-              // new flash page and data in buffer to write to last flash page...
-              // write data to flash page
-              writeFlashPage();
+            flashSetAddress(newFlashAddr);
+            flashAddr = newFlashAddr;
+
+            // send flash ready
+            prepMsg(CMD_FLASH_READY, 0x00, flashAddr);
+            canController.sendMessage(&canMsg);
+
+          #ifdef FLASH_RESUME
+          } else if (canMsg.data[CAN_DATA_BYTE_CMD] == CMD_FLASH_RESUME) {
+            // continue an interrupted session behind the last written page
+            uint16_t resumePage = flashResumePage();
+
+            // CRC of the flash content before the resume address, so the flash
+            // application can verify it against its own data
+            uint32_t resumeAddr = (uint32_t)resumePage * SPM_PAGESIZE;
+            uint16_t crc = 0;
+            for (uint32_t addr = 0; addr < resumeAddr; addr++) {
+              crc = _crc_xmodem_update(crc, flash_read_byte(FLASH_ADDR_OFFSET + addr));
             }
 
-            flashAddr = newFlashAddr;
-            flashPage = newFlashPage;
-            flashBufferPos = newFlashBufferPos;
+            flashSetAddress(resumeAddr);
+            flashAddr = resumeAddr;
+
+            canMsg.data[CAN_DATA_BYTE_CMD]          = CMD_FLASH_RESUME;
+            canMsg.data[CAN_DATA_BYTE_LEN_AND_ADDR] = __builtin_ctz(SPM_PAGESIZE); // page size as power of two
+            canMsg.data[4] = resumePage >> 8;
+            canMsg.data[5] = resumePage & 0xFF;
+            canMsg.data[6] = crc >> 8;
+            canMsg.data[7] = crc & 0xFF;
+            canController.sendMessage(&canMsg);
+          #endif
+
+          #ifdef FLASH_PAGE_MAP
+          } else if (canMsg.data[CAN_DATA_BYTE_CMD] == CMD_FLASH_PAGE_MAP) {
+            // occupancy bitmap of 32 flash pages, byte 3 is the index of the
+            // first page divided by 32
+            uint16_t mapPage = (uint16_t)canMsg.data[CAN_DATA_BYTE_LEN_AND_ADDR] * 32;
+
+            if (mapPage >= FLASH_APP_PAGES) {
+              // pages are not in the application flash
+              prepMsg(CMD_FLASH_ADDRESS_ERROR, 0x00, FLASHEND_APP);
+              canController.sendMessage(&canMsg);
+              continue;
+            }
+
+            flashErasePageMap(mapPage, &canMsg.data[4]);
+
+            // send flash ready
+            prepMsg(CMD_FLASH_READY, 0x00, flashAddr);
+            canController.sendMessage(&canMsg);
+          #endif
+
+          #ifdef FLASH_ERASE_AHEAD
+          } else if (canMsg.data[CAN_DATA_BYTE_CMD] == CMD_FLASH_RANGE) {
+            // range of the flash data to write next, starting at the current
+            // flash address up to the given last address
+            uint32_t lastFlashAddr = (uint32_t)canMsg.data[7] + ((uint32_t)canMsg.data[6] << 8) + ((uint32_t)canMsg.data[5] << 16) + ((uint32_t)canMsg.data[4] << 24);
+
+            if (lastFlashAddr > FLASHEND_APP || lastFlashAddr < flashAddr) {
+              // range cannot be flashed
+              prepMsg(CMD_FLASH_ADDRESS_ERROR, 0x00, FLASHEND_APP);
+              canController.sendMessage(&canMsg);
+              continue;
+            }
+
+            flashAnnounceRange(flashAddr, lastFlashAddr);
 
             // send flash ready
             prepMsg(CMD_FLASH_READY, 0x00, flashAddr);
-            mcp2515.sendMessage(&canMsg);
+            canController.sendMessage(&canMsg);
+          #endif
 
           } else if (canMsg.data[CAN_DATA_BYTE_CMD] == CMD_FLASH_DATA) {
             // data for flashing
@@ -326,31 +583,69 @@ int main () {
             if ((flashAddr & 0b00011111) != (canMsg.data[CAN_DATA_BYTE_LEN_AND_ADDR] & 0b00011111)) {
               // send flash data error with the exprected flash address
               prepMsg(CMD_FLASH_DATA_ERROR, 0x00, flashAddr);
-              mcp2515.sendMessage(&canMsg);
+              canController.sendMessage(&canMsg);
               continue;
             }
 
             // data length can be up to 4 bytes
+            // or up to 60 bytes given by the length of a CAN FD frame, where
+            // the length part gives the number of padding bytes at the end
             uint8_t len = (canMsg.data[CAN_DATA_BYTE_LEN_AND_ADDR] >> 5);
-            if ((flashAddr + len - 1) > FLASHEND_BL) {
+            #ifdef CAN_FD
+              if (rxDlc > 8) {
+                len = rxDlc - 4 - len;
+              }
+            #endif
+            if ((flashAddr + len - 1) > FLASHEND_APP) {
               // address cannot be flashed
-              prepMsg(CMD_FLASH_ADDRESS_ERROR, 0x00, FLASHEND_BL);
-              mcp2515.sendMessage(&canMsg);
+              prepMsg(CMD_FLASH_ADDRESS_ERROR, 0x00, FLASHEND_APP);
+              canController.sendMessage(&canMsg);
               continue;
             }
             for (uint8_t i = 0; i < len; i++) {
-              flashBuffer[flashBufferPos++] = canMsg.data[4 + i];
-              flashBufferDataCount++;
+              flashWriteByte(canMsg.data[4 + i]);
               flashAddr++;
-              if (flashBufferPos >= SPM_PAGESIZE) {
-                // flash page is full... write it!
-                writeFlashPage();
-              }
             }
 
             // send flash ready
-            prepMsg(CMD_FLASH_READY, len, flashAddr);
-            mcp2515.sendMessage(&canMsg);
+            // (the length of CAN FD data does not fit into the 3 length bits)
+            #ifdef CAN_FD
+              prepMsg(CMD_FLASH_READY, (len > 7) ? 0 : len, flashAddr);
+            #else
+              prepMsg(CMD_FLASH_READY, len, flashAddr);
+            #endif
+            canController.sendMessage(&canMsg);
+
+          #ifdef FLASH_DELTA
+          } else if (canMsg.data[CAN_DATA_BYTE_CMD] == CMD_FLASH_COPY) {
+            // copy data from the current flash content (delta update)
+
+            // check address part (lower 5 bits)
+            if ((flashAddr & 0b00011111) != (canMsg.data[CAN_DATA_BYTE_LEN_AND_ADDR] & 0b00011111)) {
+              // send flash data error with the expected flash address
+              prepMsg(CMD_FLASH_DATA_ERROR, 0x00, flashAddr);
+              canController.sendMessage(&canMsg);
+              continue;
+            }
+
+            // source address (24 bit) and number of bytes to copy (up to 255)
+            uint32_t srcAddr = (uint32_t)canMsg.data[6] + ((uint32_t)canMsg.data[5] << 8) + ((uint32_t)canMsg.data[4] << 16);
+            uint8_t len = canMsg.data[7];
+            if ((flashAddr + len - 1) > FLASHEND_APP || (srcAddr + len - 1) > FLASHEND_BL) {
+              // address cannot be flashed or read
+              prepMsg(CMD_FLASH_ADDRESS_ERROR, 0x00, FLASHEND_APP);
+              canController.sendMessage(&canMsg);
+              continue;
+            }
+            for (uint8_t i = 0; i < len; i++) {
+              flashWriteByte(flash_read_byte(srcAddr++));
+              flashAddr++;
+            }
+
+            // send flash ready
+            prepMsg(CMD_FLASH_READY, 0x00, flashAddr);
+            canController.sendMessage(&canMsg);
+          #endif
 
           } else if (canMsg.data[CAN_DATA_BYTE_CMD] == CMD_FLASH_DONE) {
             // flashing done...
@@ -358,10 +653,42 @@ int main () {
               // still data in flash buffer... write last page
               writeFlashPage();
             }
+            #ifdef FLASH_PAGE_CACHE
+              flashCacheFlush();
+            #endif
+
+            // the new application is only copied from the staging slot if the
+            // number of pages and the CRC in the data bytes match
+            #ifdef DUAL_SLOT
+              if (!slotRequestCopy((canMsg.data[4] << 8) | canMsg.data[5], (canMsg.data[6] << 8) | canMsg.data[7])) {
+                prepMsg(CMD_FLASH_DATA_ERROR, 0x00, flashAddr);
+                canController.sendMessage(&canMsg);
+                continue;
+              }
+            #endif
+
+            // the session is complete and cannot be resumed anymore
+            #ifdef FLASH_RESUME
+              flashResumeClear();
+            #endif
 
             // send start app
+            #ifdef CAN_ID_REMOTE_TO_MCU_FAST
+              // the session ends, so start app is always send using the
+              // default CAN-ID
+              #if CAN_EFF
+                canMsg.can_id = CAN_ID_MCU_TO_REMOTE | CAN_EFF_FLAG;
+              #else
+                canMsg.can_id = CAN_ID_MCU_TO_REMOTE;
+              #endif
+            #endif
             prepMsg(CMD_START_APP, 0x00, 0x00000000);
-            mcp2515.sendMessage(&canMsg);
+            canController.sendMessage(&canMsg);
+
+            // copy the new application from the staging slot
+            #ifdef DUAL_SLOT
+              copySlot();
+            #endif
 
             // write value of local mcusr into R2
             #if MCUSR_TO_R2
@@ -372,21 +699,56 @@ int main () {
             // start the main application
             startApp();
 
+          #ifndef COMPACT
           } else if (canMsg.data[CAN_DATA_BYTE_CMD] == CMD_FLASH_DONE_VERIFY) {
             // flashing done and verify requested...
             if (flashBufferDataCount > 0) {
               // still data in flash buffer... write last page
               writeFlashPage();
             }
+            #ifdef FLASH_PAGE_CACHE
+              flashCacheFlush();
+            #endif
+
+            // the session is complete and cannot be resumed anymore
+            #ifdef FLASH_RESUME
+              flashResumeClear();
+            #endif
+
+            // the staging slot will be copied if the app is started after verify,
+            // but only if the number of pages and the CRC in the data bytes match
+            #ifdef DUAL_SLOT
+              if (!slotRequestCopy((canMsg.data[4] << 8) | canMsg.data[5], (canMsg.data[6] << 8) | canMsg.data[7])) {
+                prepMsg(CMD_FLASH_DATA_ERROR, 0x00, flashAddr);
+                canController.sendMessage(&canMsg);
+                continue;
+              }
+            #endif
 
             // send flash done verify back
             prepMsg(CMD_FLASH_DONE_VERIFY, 0x00, 0x00000000);
-            mcp2515.sendMessage(&canMsg);
+            canController.sendMessage(&canMsg);
+          #endif
 
           } else if (canMsg.data[CAN_DATA_BYTE_CMD] == CMD_START_APP) {
             // just start the main application now
+            #ifdef CAN_ID_REMOTE_TO_MCU_FAST
+              // the session ends, so start app is always send using the
+              // default CAN-ID
+              #if CAN_EFF
+                canMsg.can_id = CAN_ID_MCU_TO_REMOTE | CAN_EFF_FLAG;
+              #else
+                canMsg.can_id = CAN_ID_MCU_TO_REMOTE;
+              #endif
+            #endif
             prepMsg(CMD_START_APP, 0x00, 0x00000000);
-            mcp2515.sendMessage(&canMsg);
+            canController.sendMessage(&canMsg);
+
+            // copy the new application from the staging slot if requested by
+            // flash done verify
+            #ifdef DUAL_SLOT
+              copySlot();
+            #endif
 
             // write value of local mcusr into R2
             #if MCUSR_TO_R2
@@ -396,13 +758,209 @@ int main () {
 
             // start the main application
             startApp();
+
+          #ifdef CAN_ID_REMOTE_TO_MCU_FAST
+          } else if (canMsg.data[CAN_DATA_BYTE_CMD] == CMD_SWITCH_CAN_ID) {
+            // switch to the high priority (1) or default (0) CAN-IDs
+            bool fast = canMsg.data[7];
+
+            // confirm using the current CAN-IDs
+            prepMsg(CMD_SWITCH_CAN_ID, 0x00, fast);
+            canController.sendMessage(&canMsg);
+
+            if (fast != (canIdRemoteToMcu == CAN_ID_REMOTE_TO_MCU_FAST)) {
+              // the remote has to send a message using the new CAN-IDs in time
+              switchCanIds(fast);
+              canIdSwitchTime = timerTicks();
+              canIdSwitchPending = true;
+            }
+          #endif
+
+          #ifdef BITRATE_SWITCH
+          } else if (canMsg.data[CAN_DATA_BYTE_CMD] == CMD_SWITCH_BITRATE) {
+            // switch to the bitrate given in data byte 7 (CAN_SPEED)
+            uint8_t newSpeed = canMsg.data[7];
+
+            // check if the bitrate is supported using the configured clock
+            // before confirming it, the controller stays at the current bitrate
+            if (newSpeed > CAN_1000KBPS
+              || !CanController::isBitrateSupported((CAN_SPEED)newSpeed, MCP_CLOCK)) {
+              // unknown or unsupported bitrate... reject
+              prepMsg(CMD_SWITCH_BITRATE, 0x00, 0xFF);
+              canController.sendMessage(&canMsg);
+              continue;
+            }
+
+            // confirm using the current bitrate
+            prepMsg(CMD_SWITCH_BITRATE, 0x00, newSpeed);
+            canController.sendMessage(&canMsg);
+
+            // the remote has to send a message using the new bitrate in time
+            canController.setBitrate((CAN_SPEED)newSpeed, MCP_CLOCK);
+            canController.setNormalMode();
+            switchSpeed = (CAN_SPEED)newSpeed;
+            bitrateSwitchTime = timerTicks();
+            bitrateSwitchPending = true;
+          #endif
+
+          #ifdef EEPROM_COMMANDS
+          } else if (canMsg.data[CAN_DATA_BYTE_CMD] == CMD_EEPROM_SET_ADDRESS) {
+            // set the start address for writing to the eeprom
+            uint32_t newEepromAddr = (uint32_t)canMsg.data[7] + ((uint32_t)canMsg.data[6] << 8) + ((uint32_t)canMsg.data[5] << 16) + ((uint32_t)canMsg.data[4] << 24);
+
+            if (newEepromAddr > E2END) {
+              // address not in eeprom
+              prepMsg(CMD_EEPROM_ADDRESS_ERROR, 0x00, E2END);
+              canController.sendMessage(&canMsg);
+              continue;
+            }
+
+            eepromAddr = newEepromAddr;
+
+            // send eeprom ready
+            prepMsg(CMD_EEPROM_READY, 0x00, eepromAddr);
+            canController.sendMessage(&canMsg);
+
+          } else if (canMsg.data[CAN_DATA_BYTE_CMD] == CMD_EEPROM_DATA) {
+            // data for the eeprom
+
+            // check address part (lower 5 bits)
+            if ((eepromAddr & 0b00011111) != (canMsg.data[CAN_DATA_BYTE_LEN_AND_ADDR] & 0b00011111)) {
+              // send eeprom data error with the expected eeprom address
+              prepMsg(CMD_EEPROM_DATA_ERROR, 0x00, eepromAddr);
+              canController.sendMessage(&canMsg);
+              continue;
+            }
+
+            // data length can be up to 4 bytes
+            // or up to 60 bytes given by the length of a CAN FD frame, where
+            // the length part gives the number of padding bytes at the end
+            uint8_t len = (canMsg.data[CAN_DATA_BYTE_LEN_AND_ADDR] >> 5);
+            #ifdef CAN_FD
+              if (rxDlc > 8) {
+                len = rxDlc - 4 - len;
+              } else
+            #endif
+            if (len > 4) {
+              // more data bytes than the message contains
+              prepMsg(CMD_EEPROM_DATA_ERROR, 0x00, eepromAddr);
+              canController.sendMessage(&canMsg);
+              continue;
+            }
+            if ((eepromAddr + len - 1) > E2END) {
+              // address not in eeprom
+              prepMsg(CMD_EEPROM_ADDRESS_ERROR, 0x00, E2END);
+              canController.sendMessage(&canMsg);
+              continue;
+            }
+
+            // write all bytes of the message at once, unchanged bytes will be skipped
+            eeprom_update_block(&canMsg.data[4], (void*)eepromAddr, len);
+            eepromAddr += len;
+
+            // send eeprom ready
+            // (the length of CAN FD data does not fit into the 3 length bits)
+            #ifdef CAN_FD
+              prepMsg(CMD_EEPROM_READY, (len > 7) ? 0 : len, eepromAddr);
+            #else
+              prepMsg(CMD_EEPROM_READY, len, eepromAddr);
+            #endif
+            canController.sendMessage(&canMsg);
+
+          } else if (canMsg.data[CAN_DATA_BYTE_CMD] == CMD_EEPROM_READ) {
+            // read eeprom at given address
+            uint32_t readEepromAddr = (uint32_t)canMsg.data[7] + ((uint32_t)canMsg.data[6] << 8) + ((uint32_t)canMsg.data[5] << 16) + ((uint32_t)canMsg.data[4] << 24);
+
+            if (readEepromAddr > E2END) {
+              // eeprom read after eeprom end
+              prepMsg(CMD_EEPROM_READ_ADDRESS_ERROR, 0x00, E2END);
+              canController.sendMessage(&canMsg);
+              continue;
+            }
+
+            uint8_t len = 0;
+            for (uint8_t i = 0; i < 4; i++) {
+              if (readEepromAddr + i <= E2END) {
+                // in eeprom area
+                canMsg.data[4 + i] = eeprom_read_byte((uint8_t*)(uint16_t)(readEepromAddr + i));
+                len++;
+              } else {
+                // not in eeprom area
+                canMsg.data[4 + i] = 0x00;
+              }
+            }
+
+            canMsg.data[CAN_DATA_BYTE_CMD]          = CMD_EEPROM_READ_DATA;
+            canMsg.data[CAN_DATA_BYTE_LEN_AND_ADDR] = (len << 5) | (readEepromAddr & 0b00011111);  // number of data bytes read and address part
+            canController.sendMessage(&canMsg);
+          #endif
+
+          #ifdef TRACE
+          } else if (canMsg.data[CAN_DATA_BYTE_CMD] == CMD_TRACE_READ) {
+            // read one event from the trace buffer, index 0 is the oldest event
+            uint8_t idx = canMsg.data[7];
+            uint8_t num = (traceBuffer.count < TRACE_SIZE) ? traceBuffer.count : TRACE_SIZE;
+            if (idx < num) {
+              struct trace_entry *entry = &traceBuffer.entries[(traceBuffer.pos - num + idx) & (TRACE_SIZE - 1)];
+              canMsg.data[4] = entry->event;
+              canMsg.data[5] = entry->arg;
+              canMsg.data[6] = (entry->ticks >> 8) & 0xFF;
+              canMsg.data[7] = entry->ticks & 0xFF;
+            } else {
+              // no event at this index
+              canMsg.data[4] = 0x00;
+              canMsg.data[5] = 0x00;
+              canMsg.data[6] = 0x00;
+              canMsg.data[7] = 0x00;
+            }
+
+            canMsg.data[CAN_DATA_BYTE_CMD]          = CMD_TRACE_READ_DATA;
+            canMsg.data[CAN_DATA_BYTE_LEN_AND_ADDR] = num; // number of events in the trace buffer
+            canController.sendMessage(&canMsg);
+          #endif
           }
         }
+        #endif
 
       }
     }
+    #ifdef FLASH_ERASE_AHEAD
+      else if (flashing) {
+        // no message received... use the time to erase the next page
+        flashEraseAhead();
+      }
+    #endif
+  }
+}
+
+/**
+ * Set the masks and filters of the CAN controller to accept only messages with
+ * the given CAN-ID.
+ * This way no other messages on a busy bus will reach the receive buffers.
+ * The CAN controller will be in configuration mode afterwards.
+ */
+void setCanFilters (uint32_t canId) {
+  canController.setFilters(CAN_EFF, canId);
+}
+
+#ifdef CAN_ID_REMOTE_TO_MCU_FAST
+/**
+ * Switch the CAN-IDs used for the bootloader messages and reprogram the
+ * filters of the CAN controller.
+ * @param fast Use the high priority CAN-IDs if true or the default CAN-IDs.
+ */
+void switchCanIds (bool fast) {
+  if (fast) {
+    canIdMcuToRemote = CAN_ID_MCU_TO_REMOTE_FAST;
+    canIdRemoteToMcu = CAN_ID_REMOTE_TO_MCU_FAST;
+  } else {
+    canIdMcuToRemote = CAN_ID_MCU_TO_REMOTE;
+    canIdRemoteToMcu = CAN_ID_REMOTE_TO_MCU;
   }
+  setCanFilters(canIdRemoteToMcu);
+  canController.setNormalMode();
 }
+#endif
 
 /**
  * Prepare data to send a CAN message with command, length and flash address.
@@ -417,26 +975,504 @@ void prepMsg (uint8_t cmd, uint8_t len, uint32_t flashAddr) {
   canMsg.data[7] = flashAddr & 0xFF;
 }
 
+/**
+ * Erase the whole application flash (or the staging slot if DUAL_SLOT is used)
+ * and reset the flash buffer to the first page.
+ */
+void flashErase () {
+  // finish and forget a background erase
+  #ifdef FLASH_ERASE_AHEAD
+    flashEraseAheadFinish();
+    eraseAheadFirst = 0;
+    eraseAheadNext = 0;
+    eraseAheadEnd = 0;
+  #endif
+
+  TRACE_EVENT(TRACE_EVT_ERASE, 0);
+  uint32_t addr = FLASH_ADDR_OFFSET;
+  do {
+    boot_page_erase(addr);
+    boot_spm_busy_wait();
+    addr += SPM_PAGESIZE;
+  } while (addr < FLASH_ADDR_OFFSET + FLASHEND_APP);
+  TRACE_EVENT(TRACE_EVT_ERASE_DONE, 0);
+
+  // reenable the RWW section for reading, this also clears the
+  // temporary page buffer
+  boot_rww_enable();
+
+  #if defined(FLASH_PAGE_CACHE)
+    // forget all cached pages
+    memset(flashCache, 0xFF, sizeof(flashCache));
+    memset(flashCacheDataCount, 0, sizeof(flashCacheDataCount));
+  #elif defined(FLASH_NO_BUFFER)
+    flashWordLow = 0xFF;
+  #else
+    memset(flashBuffer, 0xFF, SPM_PAGESIZE);
+  #endif
+  flashBufferDataCount = 0;
+  flashPage = 0;
+  flashBufferPos = 0;
+
+  // a new session starts
+  #ifdef FLASH_RESUME
+    flashResumeClear();
+  #endif
+  #ifdef DUAL_SLOT
+    eeprom_update_byte(DUAL_SLOT_REQUEST_FLAG, 0xFF);
+  #endif
+}
+
+#ifdef FLASH_PAGE_MAP
+/**
+ * Erase all pages which are marked as blank in a page occupancy bitmap and
+ * are not blank already. Pages marked as used are left untouched, since they
+ * will be erased when they are written.
+ * @param page First page of the bitmap.
+ * @param map  Bitmap of 32 pages (bit 0 of the first byte is the first page),
+ *             a cleared bit marks a blank page.
+ */
+void flashErasePageMap (uint16_t page, const uint8_t *map) {
+  for (uint8_t i = 0; i < 32 && page < FLASH_APP_PAGES; i++, page++) {
+    if (map[i >> 3] & (1 << (i & 7))) {
+      // page will be written
+      continue;
+    }
+
+    uint32_t addr = FLASH_ADDR_OFFSET + (uint32_t)page * SPM_PAGESIZE;
+    for (uint16_t j = 0; j < SPM_PAGESIZE; j += 2) {
+      if (flash_read_word(addr + j) != 0xFFFF) {
+        // page is not blank... erase it
+        TRACE_EVENT(TRACE_EVT_PAGE_ERASE, page & 0xFF);
+        eeprom_busy_wait();
+        boot_page_erase(addr);
+        boot_spm_busy_wait();
+        boot_rww_enable();
+        break;
+      }
+    }
+  }
+}
+#endif
+
+/**
+ * Set the flash address for the next data to write.
+ * If the address is in another flash page, the data of the current page will
+ * be written first.
+ */
+void flashSetAddress (uint32_t addr) {
+  uint16_t newFlashPage = addr / SPM_PAGESIZE;
+
+  #ifdef FLASH_PAGE_CACHE
+    if (newFlashPage != flashPage) {
+      // new flash page... keep the data of the last flash page in the cache
+      flashCacheSelect(newFlashPage);
+    }
+  #else
+    if (newFlashPage != flashPage) {
+      if (flashBufferDataCount > 0) {
+        // new flash page and data in buffer to write to last flash page...
+        // write data to flash page
+        writeFlashPage();
+      }
+      #ifdef FLASH_NO_BUFFER
+        flashWordLow = 0xFF;
+      #endif
+    }
+    #ifdef FLASH_NO_BUFFER
+      else if ((addr % SPM_PAGESIZE) >> 1 != flashBufferPos >> 1) {
+        // same flash page, but another word... fill a possibly started word
+        // before moving, a started word is kept if the address stays in it
+        flushFlashWord();
+      }
+    #endif
+  #endif
+
+  flashPage = newFlashPage;
+  flashBufferPos = addr % SPM_PAGESIZE;
+}
+
+#ifdef FLASH_ERASE_AHEAD
+/**
+ * Announce the range of the flash data to be written next.
+ * The pages of this range will be erased in the background while waiting for
+ * messages, so only the write remains when a page is full.
+ * @param first First flash address of the range.
+ * @param last  Last flash address of the range.
+ */
+void flashAnnounceRange (uint32_t first, uint32_t last) {
+  flashEraseAheadFinish();
+  eraseAheadFirst = FLASH_PAGE_OFFSET + first / SPM_PAGESIZE;
+  eraseAheadNext = eraseAheadFirst;
+  eraseAheadEnd = FLASH_PAGE_OFFSET + last / SPM_PAGESIZE + 1;
+}
+
+/**
+ * Erase the next announced page in the background.
+ * The SPM control register is only polled, so this never blocks while a
+ * previous erase is still running.
+ */
+void flashEraseAhead () {
+  if (boot_spm_busy()) {
+    // still erasing
+    return;
+  }
+
+  if (boot_rww_busy()) {
+    // erase done... reenable the RWW section for reading
+    boot_rww_enable();
+    return;
+  }
+
+  if (eraseAheadNext < eraseAheadEnd && eeprom_is_ready()) {
+    TRACE_EVENT(TRACE_EVT_ERASE_AHEAD, eraseAheadNext & 0xFF);
+    boot_page_erase((uint32_t)eraseAheadNext * SPM_PAGESIZE);
+    eraseAheadNext++;
+  }
+}
+
+/**
+ * Wait for a running background erase and reenable the RWW section, so the
+ * flash can be read again.
+ */
+void flashEraseAheadFinish () {
+  boot_spm_busy_wait();
+  boot_rww_enable();
+}
+#endif
+
+#ifdef FLASH_PAGE_MERGE
+/**
+ * Load the current content of the flash page into the page buffer, so bytes
+ * not sent by the flash application are kept when the page is written.
+ */
+void flashLoadPage () {
+  uint32_t addr = (uint32_t)(FLASH_PAGE_OFFSET + flashPage) * SPM_PAGESIZE;
+  for (uint16_t i = 0; i < SPM_PAGESIZE; i++) {
+    flashBuffer[i] = flash_read_byte(addr + i);
+  }
+}
+#endif
+
+/**
+ * Add one byte to the current flash page at the current buffer position.
+ * If the flash page is full, it will be written.
+ * Using FLASH_NO_BUFFER, the bytes are directly filled into the temporary
+ * page buffer of the MCU word by word.
+ */
+void flashWriteByte (uint8_t data) {
+  #ifdef FLASH_PAGE_MERGE
+    if (flashBufferDataCount == 0) {
+      // first data for this page... merge with the current content
+      flashLoadPage();
+    }
+  #endif
+
+  #ifdef FLASH_NO_BUFFER
+    if (flashBufferPos & 1) {
+      boot_page_fill_word(flashBufferPos - 1, flashWordLow | (data << 8));
+      flashWordLow = 0xFF;
+    } else {
+      flashWordLow = data;
+    }
+    flashBufferPos++;
+  #else
+    flashBuffer[flashBufferPos++] = data;
+  #endif
+  flashBufferDataCount++;
+
+  if (flashBufferPos >= SPM_PAGESIZE) {
+    #ifdef FLASH_PAGE_CACHE
+      if (flashBufferDataCount < SPM_PAGESIZE) {
+        // end of the page reached, but parts of it are still missing...
+        // keep it in the cache and continue with the next page
+        flashSetAddress((uint32_t)(flashPage + 1) * SPM_PAGESIZE);
+        return;
+      }
+    #endif
+    // flash page is full... write it!
+    writeFlashPage();
+  }
+}
+
+#ifdef FLASH_PAGE_CACHE
+/**
+ * Switch the page buffer to the given flash page.
+ * The data of the current flash page is kept in its cache slot. If the given
+ * flash page is cached, its slot will be used again. Otherwise a free slot is
+ * used or the least recently used slot is written to its flash page first.
+ * @param page The new flash page.
+ */
+void flashCacheSelect (uint16_t page) {
+  // keep the current flash page in its slot
+  flashCachePage[flashCacheSlot] = flashPage;
+  flashCacheDataCount[flashCacheSlot] = flashBufferDataCount;
+
+  uint8_t slot = 0xFF;
+  uint8_t lru = 0;
+  for (uint8_t i = 0; i < FLASH_PAGE_CACHE; i++) {
+    if (flashCacheAge[i] < 0xFF) {
+      flashCacheAge[i]++;
+    }
+    if (flashCacheDataCount[i] > 0 && flashCachePage[i] == page) {
+      // page is already cached
+      slot = i;
+    }
+    if (flashCacheDataCount[lru] > 0 && (flashCacheDataCount[i] == 0 || flashCacheAge[i] > flashCacheAge[lru])) {
+      // prefer free slots, then the least recently used one
+      lru = i;
+    }
+  }
+
+  if (slot == 0xFF) {
+    slot = lru;
+    if (flashCacheDataCount[slot] > 0) {
+      // cache is full... write the least recently used page
+      TRACE_EVENT(TRACE_EVT_PAGE_WRITE, flashCachePage[slot] & 0xFF);
+      boot_program_page(FLASH_PAGE_OFFSET + flashCachePage[slot], flashCache[slot]);
+      TRACE_EVENT(TRACE_EVT_PAGE_WRITE_DONE, flashCachePage[slot] & 0xFF);
+      memset(flashCache[slot], 0xFF, SPM_PAGESIZE);
+      flashCacheDataCount[slot] = 0;
+    }
+  }
+
+  flashCacheSlot = slot;
+  flashCacheAge[slot] = 0;
+  flashBuffer = flashCache[slot];
+  flashBufferDataCount = flashCacheDataCount[slot];
+}
+
+/**
+ * Write all cached flash pages, including the current one.
+ * The current flash page may be a cached page selected by writeFlashPage(),
+ * so it must not be skipped.
+ */
+void flashCacheFlush () {
+  // keep the current flash page in its slot
+  flashCachePage[flashCacheSlot] = flashPage;
+  flashCacheDataCount[flashCacheSlot] = flashBufferDataCount;
+  flashBufferDataCount = 0;
+
+  for (uint8_t i = 0; i < FLASH_PAGE_CACHE; i++) {
+    if (flashCacheDataCount[i] > 0) {
+      TRACE_EVENT(TRACE_EVT_PAGE_WRITE, flashCachePage[i] & 0xFF);
+      boot_program_page(FLASH_PAGE_OFFSET + flashCachePage[i], flashCache[i]);
+      TRACE_EVENT(TRACE_EVT_PAGE_WRITE_DONE, flashCachePage[i] & 0xFF);
+      memset(flashCache[i], 0xFF, SPM_PAGESIZE);
+      flashCacheDataCount[i] = 0;
+    }
+  }
+}
+#endif
+
+#ifdef FLASH_NO_BUFFER
+/**
+ * Fill a started word (only the low byte is set) into the temporary page
+ * buffer. The high byte will be set to 0xFF.
+ * The low byte of the next word is reset to 0xFF, so bytes skipped by a new
+ * flash address are not filled with stale data.
+ */
+void flushFlashWord () {
+  if (flashBufferPos & 1) {
+    boot_page_fill_word(flashBufferPos - 1, 0xFF00 | flashWordLow);
+  }
+  flashWordLow = 0xFF;
+}
+#endif
+
 /**
  * Write data from current global flash buffer to the flash page.
  * After writing the global flash buffer will be emptied, the buffer position
  * will be reset to 0 and the flash page will be increased.
  */
 void writeFlashPage () {
-  boot_program_page(flashPage, flashBuffer);
-  memset(flashBuffer, 0xFF, SPM_PAGESIZE);
+  TRACE_EVENT(TRACE_EVT_PAGE_WRITE, flashPage & 0xFF);
+  #ifdef FLASH_NO_BUFFER
+    flushFlashWord();
+    boot_program_page(FLASH_PAGE_OFFSET + flashPage, NULL);
+  #else
+    boot_program_page(FLASH_PAGE_OFFSET + flashPage, flashBuffer);
+  #endif
+  TRACE_EVENT(TRACE_EVT_PAGE_WRITE_DONE, flashPage & 0xFF);
+  #ifndef FLASH_NO_BUFFER
+    memset(flashBuffer, 0xFF, SPM_PAGESIZE);
+  #endif
   flashBufferDataCount = 0;
   flashPage++;
   flashBufferPos = 0;
+
+  // continue with the data of the next page, if already cached
+  #ifdef FLASH_PAGE_CACHE
+    flashCacheSelect(flashPage);
+  #endif
+
+  // a session interrupted from now on may be resumed behind this page
+  #ifdef FLASH_RESUME
+    uint16_t page = flashPage - 1;
+    uint8_t *resumeByte = (uint8_t*)FLASH_RESUME_EEPROM_ADDR + (page >> 3);
+    eeprom_update_byte(resumeByte, eeprom_read_byte(resumeByte) & ~(1 << (page & 7)));
+  #endif
+}
+
+#ifdef FLASH_RESUME
+/**
+ * Get the page behind the last written page of an interrupted session from
+ * the bitmap of the written pages in the EEPROM.
+ * A cleared bit marks a written page, so each EEPROM byte is only written up
+ * to eight times and reset once during a session.
+ * Returns 0 if there is nothing to resume.
+ */
+uint16_t flashResumePage () {
+  uint16_t page = FLASH_APP_PAGES;
+  while (page > 0) {
+    page--;
+    if (!(eeprom_read_byte((uint8_t*)FLASH_RESUME_EEPROM_ADDR + (page >> 3)) & (1 << (page & 7)))) {
+      return page + 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Clear the bitmap of the written pages in the EEPROM.
+ * Only the bytes with written pages are erased.
+ */
+void flashResumeClear () {
+  for (uint8_t i = 0; i < FLASH_RESUME_BYTES; i++) {
+    eeprom_update_byte((uint8_t*)FLASH_RESUME_EEPROM_ADDR + i, 0xFF);
+  }
+}
+#endif
+
+#ifdef DUAL_SLOT
+/**
+ * Check the first pages of the staging slot against the given CRC.
+ * @param pages Number of flash pages of the new application.
+ * @param crc   CRC-16/XMODEM of these pages.
+ * @return true if the pages fit into the slot and the CRC matches.
+ */
+bool slotValid (uint16_t pages, uint16_t crc) {
+  if (pages > SLOT_SIZE / SPM_PAGESIZE) {
+    return false;
+  }
+  uint16_t c = 0;
+  for (uint32_t addr = 0; addr < (uint32_t)pages * SPM_PAGESIZE; addr++) {
+    c = _crc_xmodem_update(c, flash_read_byte(FLASH_ADDR_OFFSET + addr));
+  }
+  return c == crc;
+}
+
+/**
+ * Request the copy of the staging slot in the EEPROM (see dual_slot.h) if the
+ * given number of pages and CRC match the staging slot.
+ * @return true if the copy is requested.
+ */
+bool slotRequestCopy (uint16_t pages, uint16_t crc) {
+  if (pages == 0 || !slotValid(pages, crc)) {
+    return false;
+  }
+  dualSlotRequestCopy(pages, crc);
+  return true;
+}
+
+/**
+ * Copy the application from the staging slot to the execution slot if it is
+ * requested in the EEPROM.
+ * The staging slot is verified against the CRC of the request first, so
+ * incomplete or damaged data is never copied. The request is cleared only
+ * after the copy, so an interrupted copy will be verified again and finished
+ * on the next start of the bootloader.
+ * Pages which are already equal in both slots will be skipped.
+ */
+void copySlot () {
+  if (eeprom_read_byte(DUAL_SLOT_REQUEST_FLAG) != DUAL_SLOT_COPY_REQUEST) {
+    return;
+  }
+
+  uint16_t pages = eeprom_read_word(DUAL_SLOT_REQUEST_PAGES);
+  if (slotValid(pages, eeprom_read_word(DUAL_SLOT_REQUEST_CRC))) {
+    for (uint16_t page = 0; page < pages; page++) {
+      uint32_t addr = (uint32_t)page * SPM_PAGESIZE;
+      bool equal = true;
+      for (uint16_t i = 0; i < SPM_PAGESIZE; i += 2) {
+        uint16_t w = flash_read_word(SLOT_SIZE + addr + i);
+        if (w != flash_read_word(addr + i)) {
+          equal = false;
+        }
+        #ifdef FLASH_NO_BUFFER
+          boot_page_fill_word(i, w);
+        #else
+          flashBuffer[i] = w & 0xFF;
+          flashBuffer[i + 1] = w >> 8;
+        #endif
+      }
+      if (!equal) {
+        #ifdef FLASH_NO_BUFFER
+          boot_program_page(page, NULL);
+        #else
+          boot_program_page(page, flashBuffer);
+        #endif
+      }
+      #ifdef FLASH_NO_BUFFER
+        else {
+          // clear the temporary page buffer
+          boot_rww_enable();
+        }
+      #endif
+    }
+  }
+
+  eeprom_update_byte(DUAL_SLOT_REQUEST_FLAG, 0xFF);
+}
+#endif
+
+/**
+ * Fill one word into the temporary page buffer.
+ * Only the offset within the page is used for filling, so a 16 bit offset is
+ * used for all MCUs, even if the flash is bigger than 64k.
+ * @param offset Byte offset of the word within the flash page.
+ * @param w      The little-endian word.
+ */
+void boot_page_fill_word (uint16_t offset, uint16_t w) {
+  eeprom_busy_wait();
+  __boot_page_fill_normal(offset, w);
+}
+
+/**
+ * Fill the whole temporary page buffer from a buffer.
+ * The Z pointer is incremented directly, so there is no address calculation
+ * for each word.
+ * @param buf Buffer containing the flash data for one page.
+ */
+static inline void boot_page_fill_buffer (const uint8_t *buf) {
+  uint8_t words = SPM_PAGESIZE / 2;
+  __asm__ __volatile__ (
+    "  clr r30              \n\t"
+    "  clr r31              \n\t"
+    "1:                     \n\t"
+    "  ld r0, %a[buf]+      \n\t"
+    "  ld r1, %a[buf]+      \n\t"
+    "  sts %[spmreg], %[spmen] \n\t"
+    "  spm                  \n\t"
+    "  adiw r30, 2          \n\t"
+    "  dec %[words]         \n\t"
+    "  brne 1b              \n\t"
+    "  clr r1               \n\t"
+    : [buf] "+x" (buf), [words] "+r" (words)
+    : [spmreg] "i" (_SFR_MEM_ADDR(__SPM_REG)), [spmen] "r" ((uint8_t)_BV(__SPM_ENABLE))
+    : "r0", "r30", "r31", "memory"
+  );
 }
 
 /**
  * Write data from buffer to a flash page.
+ * The temporary page buffer is filled before the page is erased, which is
+ * supported by all MCUs and allows to fill it while the data is received.
  * @param page Flash page number to write to.
- * @param buf  Buffer containing the flash data for that page.
+ * @param buf  Buffer containing the flash data for that page or NULL if the
+ *             temporary page buffer is already filled.
  */
 void boot_program_page (uint16_t page, uint8_t *buf) {
-  uint16_t i;
   uint8_t sreg;
 
   uint32_t addr = ((uint32_t)page) * SPM_PAGESIZE; // type cast of `page` to support addresses bigger than 0xFFFF
@@ -447,17 +1483,37 @@ void boot_program_page (uint16_t page, uint8_t *buf) {
 
   eeprom_busy_wait();
 
-  boot_page_erase(addr);
-  boot_spm_busy_wait(); // Wait until the memory is erased
-
-  for (i=0; i<SPM_PAGESIZE; i+=2) {
-    // Set up little-endian word
-    uint16_t w = *buf++;
-    w += (*buf++) << 8;
+  #ifdef FLASH_ERASE_AHEAD
+    // wait for a running background erase
+    boot_spm_busy_wait();
+  #endif
 
-    boot_page_fill(addr + i, w);
+  if (buf != NULL) {
+    boot_page_fill_buffer(buf);
   }
 
+  #ifdef FLASH_ERASE_AHEAD
+    if (page >= eraseAheadFirst && page < eraseAheadNext) {
+      // page is already erased in the background
+    } else {
+      boot_page_erase(addr);
+      boot_spm_busy_wait(); // Wait until the memory is erased
+
+      // don't erase this page again in the background
+      if (page >= eraseAheadNext && page < eraseAheadEnd) {
+        eraseAheadNext = page + 1;
+      }
+    }
+
+    // pages up to this one need to be erased again before writing
+    if (page >= eraseAheadFirst) {
+      eraseAheadFirst = page + 1;
+    }
+  #else
+    boot_page_erase(addr);
+    boot_spm_busy_wait(); // Wait until the memory is erased
+  #endif
+
   boot_page_write(addr); // Store buffer in flash page
   boot_spm_busy_wait(); // Wait until the memory is written
 
@@ -469,10 +1525,144 @@ void boot_program_page (uint16_t page, uint8_t *buf) {
   SREG = sreg;
 }
 
+#ifdef SPM_SERVICE
+/**
+ * SPM service for the main application.
+ * This is called by the main application through the jump in the SPM service
+ * table, so it must not use any state of the bootloader.
+ * Writing into the bootloader section is refused.
+ * @param command One of the SPM_SERVICE_* commands.
+ * @param addr    Byte address in the flash.
+ * @param data    The little-endian word to fill (SPM_SERVICE_PAGE_FILL only).
+ */
+void spmService (uint8_t command, uint32_t addr, uint16_t data) {
+  if (addr > FLASHEND_BL) return;
+
+  // Disable interrupts
+  uint8_t sreg = SREG;
+  cli();
+
+  eeprom_busy_wait();
+  boot_spm_busy_wait();
+
+  if (command == SPM_SERVICE_PAGE_FILL) {
+    boot_page_fill(addr, data);
+  } else if (command == SPM_SERVICE_PAGE_ERASE || command == SPM_SERVICE_PAGE_WRITE) {
+    if (command == SPM_SERVICE_PAGE_ERASE) {
+      boot_page_erase(addr);
+    } else {
+      boot_page_write(addr);
+    }
+    boot_spm_busy_wait();
+
+    // The main application is executed from the RWW section, so it must be
+    // reenabled before returning.
+    boot_rww_enable();
+  }
+
+  // Re-enable interrupts (if they were ever enabled)
+  SREG = sreg;
+}
+
+/**
+ * The SPM service table at the fixed address SPM_SERVICE_TABLE.
+ * The version comes first, so the jump may be relaxed to a rjmp by the linker.
+ */
+void spmServiceTable (void) __attribute__((naked)) __attribute__((used)) __attribute__((section(".spm_service")));
+void spmServiceTable (void) {
+  __asm__ __volatile__ (
+    "  .word %[version]     \n\t"
+    "  jmp %x[service]      \n\t"
+    :: [version] "i" (SPM_SERVICE_VERSION), [service] "i" (spmService)
+  );
+}
+#endif
+
+#ifdef CAN_SERVICE
+/*
+ * Services of the MCP2515 driver for the main application.
+ * These are called by the main application through the CAN service table.
+ * The driver keeps no state in the RAM, so only the local can_frame is used.
+ */
+void canDriverInit () {
+  canController.init();
+}
+
+uint8_t canDriverReset () {
+  return canController.reset();
+}
+
+uint8_t canDriverSetBitrate (uint8_t canSpeed, uint8_t canClock) {
+  return canController.setBitrate((CAN_SPEED)canSpeed, (CAN_CLOCK)canClock);
+}
+
+uint8_t canDriverSetFilterMask (uint8_t num, bool ext, uint32_t id) {
+  return canController.setFilterMask((CanController::MASK)num, ext, id);
+}
+
+uint8_t canDriverSetFilter (uint8_t num, bool ext, uint32_t id) {
+  return canController.setFilter((CanController::RXF)num, ext, id);
+}
+
+uint8_t canDriverSetNormalMode () {
+  return canController.setNormalMode();
+}
+
+uint8_t canDriverSendMessage (uint32_t id, uint8_t dlc, const uint8_t *data) {
+  if (dlc > CAN_MAX_DLEN) {
+    return CanController::ERROR_FAILTX;
+  }
+
+  struct can_frame frame;
+  frame.can_id = id;
+  frame.can_dlc = dlc;
+  memcpy(frame.data, data, dlc);
+  return canController.sendMessage(&frame);
+}
+
+uint8_t canDriverReadMessage (uint32_t *id, uint8_t *dlc, uint8_t *data) {
+  struct can_frame frame;
+  uint8_t res = canController.readMessage(&frame);
+  if (res == CanController::ERROR_OK) {
+    *id = frame.can_id;
+    *dlc = frame.can_dlc;
+    memcpy(data, frame.data, frame.can_dlc);
+  }
+  return res;
+}
+
+/**
+ * The CAN service table in front of CAN_SERVICE_TABLE.
+ * The services are in reverse order, so the first service is next to the
+ * version and the number of services.
+ */
+void canServiceTable (void) __attribute__((naked)) __attribute__((used)) __attribute__((section(".can_service")));
+void canServiceTable (void) {
+  __asm__ __volatile__ (
+    "  rjmp %x[readMessage]    \n\t"
+    "  rjmp %x[sendMessage]    \n\t"
+    "  rjmp %x[setNormalMode]  \n\t"
+    "  rjmp %x[setFilter]      \n\t"
+    "  rjmp %x[setFilterMask]  \n\t"
+    "  rjmp %x[setBitrate]     \n\t"
+    "  rjmp %x[reset]          \n\t"
+    "  rjmp %x[init]           \n\t"
+    "  .word %[version]        \n\t"
+    "  .word %[count]          \n\t"
+    :: [version] "i" (CAN_SERVICE_VERSION), [count] "i" (CAN_SERVICE_COUNT),
+       [init] "i" (canDriverInit), [reset] "i" (canDriverReset),
+       [setBitrate] "i" (canDriverSetBitrate), [setFilterMask] "i" (canDriverSetFilterMask),
+       [setFilter] "i" (canDriverSetFilter), [setNormalMode] "i" (canDriverSetNormalMode),
+       [sendMessage] "i" (canDriverSendMessage), [readMessage] "i" (canDriverReadMessage)
+  );
+}
+#endif
+
 /**
  * Cleanup and start the main application.
  */
 void startApp () {
+  TRACE_EVENT(TRACE_EVT_START_APP, 0);
 
   // reset SPI interface to power-up state
   SPCR = 0;
@@ -481,21 +1671,11 @@ void startApp () {
   // reset SPI pins to input
   SPI_DDR = 0;
 
-  // disable timer 0 overflow interrupt
-  #if defined(TIMSK) && defined(TOIE0)
-    TIMSK &= ~(1<<TOIE0);
-  #elif defined(TIMSK0) && defined(TOIE0)
-    TIMSK0 &= ~(1<<TOIE0);
-  #else
-    #error Timer 0 overflow interrupt not disabled correctly
+  // stop timer 1 (left running for the main application if tracing is enabled)
+  #ifndef TRACE
+    timerDeinit();
   #endif
 
-  // reset interrupt vectors
-  cli();
-  uint8_t ivtemp = IV_REG;
-  IV_REG = ivtemp | (1<<IVCE);
-  IV_REG = ivtemp & ~(1<<IVSEL);
-
   // turn off LED and reset pin to input
   LED_OFF;
   LED_DEINIT;
@@ -505,6 +1685,8 @@ void startApp () {
     EIND = 0;
   #endif
 
+  TRACE_EVENT(TRACE_EVT_START_APP_DONE, 0);
+
   // jump to main application
   gotoApp();
 }
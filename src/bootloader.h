@@ -11,19 +11,37 @@
 #define	__MCP_CAN_BOOT_MAIN_H__
 
 #include <inttypes.h>
+#include <string.h>
 #include <avr/boot.h>
 #include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <avr/wdt.h>
+#include <util/crc16.h>
+#include <util/delay.h>
 
-#include "mcp2515.h"
+#include "can_controller.h"
+#include "can_service.h"
 #include "config.h"
 #include "controllers.h"
+#include "timer.h"
+#include "trace.h"
+#include "spm_service.h"
+#include "uds.h"
+
+#ifdef WARM_START
+  #include "warm_start.h"
+#endif
+
+#ifdef DUAL_SLOT
+  #include "dual_slot.h"
+#endif
 
 /**
  * Command set version of this bootloader.
  * Used to identify a possibly incompatible flash application on remote.
  */
-#define BOOTLOADER_CMD_VERSION 0x01
+#define BOOTLOADER_CMD_VERSION 0x02
 
 /*
  * Positions of fixed data parts in each bootloader CAN message.
@@ -45,13 +63,42 @@
 #define CMD_FLASH_ADDRESS_ERROR      0b00001011 // mcu -> remote
 #define CMD_FLASH_DATA               0b00001000 // remote -> mcu
 #define CMD_FLASH_DATA_ERROR         0b00001101 // mcu -> remote
+#define CMD_FLASH_COPY               0b00001100 // remote -> mcu
+#define CMD_FLASH_RANGE              0b00001110 // remote -> mcu
 #define CMD_FLASH_DONE               0b00010000 // remote -> mcu
 #define CMD_FLASH_DONE_VERIFY        0b01010000 // remote <-> mcu
 #define CMD_FLASH_ERASE              0b00100000 // remote -> mcu
+#define CMD_FLASH_RESUME             0b00010010 // remote <-> mcu
+#define CMD_FLASH_PAGE_MAP           0b00100100 // remote -> mcu
 #define CMD_FLASH_READ               0b01000000 // remote -> mcu
 #define CMD_FLASH_READ_DATA          0b01001000 // mcu -> remote
 #define CMD_FLASH_READ_ADDRESS_ERROR 0b01001011 // mcu -> remote
 #define CMD_START_APP                0b10000000 // mcu <-> remote
+#define CMD_SWITCH_CAN_ID            0b00100010 // remote <-> mcu
+#define CMD_SWITCH_BITRATE           0b00100110 // remote <-> mcu
+#define CMD_TRACE_READ               0b01110000 // remote -> mcu
+#define CMD_TRACE_READ_DATA          0b01111000 // mcu -> remote
+#define CMD_EEPROM_READY             0b00010100 // mcu -> remote
+#define CMD_EEPROM_SET_ADDRESS       0b00011010 // remote -> mcu
+#define CMD_EEPROM_ADDRESS_ERROR     0b00011011 // mcu -> remote
+#define CMD_EEPROM_DATA              0b00011000 // remote -> mcu
+#define CMD_EEPROM_DATA_ERROR        0b00011101 // mcu -> remote
+#define CMD_EEPROM_READ              0b01100000 // remote -> mcu
+#define CMD_EEPROM_READ_DATA         0b01101000 // mcu -> remote
+#define CMD_EEPROM_READ_ADDRESS_ERROR 0b01101011 // mcu -> remote
+
+/*
+ * Ping info types and flags (byte 3 of the ping command)
+ */
+#define PING_TIME     0x00
+#define PING_STATE    0x01
+#define PING_FLASHING 0x80
+
+/*
+ * Shift of the number of bytes in the page buffer into bits 1 to 6 of byte 3
+ * of the state answer (bits 8 to 13 of the number, byte 4 holds bits 0 to 7)
+ */
+#define PING_STATE_COUNT_SHIFT 7
 
 /*
  * Fixed definitions to be used in the code.
@@ -60,13 +107,99 @@
 #define MCU_ID_MSB ((mcuId >> 8) & 0xFF)
 #define FLASHEND_BL (FLASHEND - BOOTLOADER_SIZE)
 
+/*
+ * Layout of the application flash.
+ * If DUAL_SLOT is used, the application flash is split into an execution slot
+ * starting at 0x0000 and a staging slot directly behind it (see dual_slot.h).
+ * All flash addresses used in the CAN messages are relative to the staging
+ * slot then.
+ */
+#ifdef DUAL_SLOT
+  #define SLOT_SIZE DUAL_SLOT_SIZE
+  #define FLASHEND_APP (SLOT_SIZE - 1)
+  #define FLASH_ADDR_OFFSET SLOT_SIZE
+  #define FLASH_PAGE_OFFSET (SLOT_SIZE / SPM_PAGESIZE)
+#else
+  #define FLASHEND_APP FLASHEND_BL
+  #define FLASH_ADDR_OFFSET 0
+  #define FLASH_PAGE_OFFSET 0
+#endif
+
+/*
+ * Number of flash pages of the application flash.
+ */
+#define FLASH_APP_PAGES ((uint16_t)(((uint32_t)FLASHEND_APP + 1) / SPM_PAGESIZE))
+
+/*
+ * Size of the bitmap of the written pages in the EEPROM (one bit per page).
+ */
+#define FLASH_RESUME_BYTES ((FLASH_APP_PAGES + 7) / 8)
+
+/*
+ * Read a byte from the flash, using far addresses if the flash is bigger
+ * than 64k.
+ */
+#if FLASHEND > 0xFFFF
+  #define flash_read_byte(addr) pgm_read_byte_far(addr)
+  #define flash_read_word(addr) pgm_read_word_far(addr)
+#else
+  #define flash_read_byte(addr) pgm_read_byte_near(addr)
+  #define flash_read_word(addr) pgm_read_word_near(addr)
+#endif
+
+/*
+ * Global variables shared with the protocol front-ends
+ */
+#if defined(FLASH_PAGE_CACHE)
+  extern uint8_t *flashBuffer;
+#elif !defined(FLASH_NO_BUFFER)
+  extern uint8_t flashBuffer[SPM_PAGESIZE];
+#endif
+extern uint16_t flashBufferPos;
+extern uint16_t flashBufferDataCount;
+extern uint16_t flashPage;
+extern struct can_frame canMsg;
+extern CanController canController;
+
 /*
  * Function declarations
  */
 int main ();
+void setCanFilters (uint32_t canId);
+void switchCanIds (bool fast);
 void prepMsg (uint8_t cmd, uint8_t len, uint32_t flashAddr);
+void flashErase ();
+void flashErasePageMap (uint16_t page, const uint8_t *map);
+void flashSetAddress (uint32_t addr);
+void flashAnnounceRange (uint32_t first, uint32_t last);
+void flashEraseAhead ();
+void flashEraseAheadFinish ();
+void flashLoadPage ();
+void flashWriteByte (uint8_t data);
+void flushFlashWord ();
+void flashCacheSelect (uint16_t page);
+void flashCacheFlush ();
 void writeFlashPage ();
+uint16_t flashResumePage ();
+void flashResumeClear ();
+bool slotValid (uint16_t pages, uint16_t crc);
+bool slotRequestCopy (uint16_t pages, uint16_t crc);
+void copySlot ();
+void boot_page_fill_word (uint16_t offset, uint16_t w);
 void boot_program_page (uint16_t page, uint8_t *buf);
+#ifdef SPM_SERVICE
+  void spmService (uint8_t command, uint32_t addr, uint16_t data);
+#endif
+#ifdef CAN_SERVICE
+  void canDriverInit ();
+  uint8_t canDriverReset ();
+  uint8_t canDriverSetBitrate (uint8_t canSpeed, uint8_t canClock);
+  uint8_t canDriverSetFilterMask (uint8_t num, bool ext, uint32_t id);
+  uint8_t canDriverSetFilter (uint8_t num, bool ext, uint32_t id);
+  uint8_t canDriverSetNormalMode ();
+  uint8_t canDriverSendMessage (uint32_t id, uint8_t dlc, const uint8_t *data);
+  uint8_t canDriverReadMessage (uint32_t *id, uint8_t *dlc, uint8_t *data);
+#endif
 void startApp ();
 
 /*
@@ -88,6 +221,12 @@ void startApp ();
   #endif
 #endif
 
+#ifdef MCP_INT
+  #if !defined(MCP_INT_PIN)
+    #error When using MCP_INT, also MCP_INT_PIN must be defined!
+  #endif
+#endif
+
 #if CAN_EFF
   #if CAN_ID_MCU_TO_REMOTE > 0x1FFFFFFF
     #error CAN_ID_MCU_TO_REMOTE is greater than 0x1FFFFFFF! Please check your config!
@@ -104,10 +243,149 @@ void startApp ();
   #endif
 #endif
 
+#if defined(CAN_ID_MCU_TO_REMOTE_FAST) || defined(CAN_ID_REMOTE_TO_MCU_FAST)
+  #if !defined(CAN_ID_MCU_TO_REMOTE_FAST) || !defined(CAN_ID_REMOTE_TO_MCU_FAST) || !defined(TIMEOUT_CAN_ID_SWITCH)
+    #error When using high priority CAN-IDs, CAN_ID_MCU_TO_REMOTE_FAST, CAN_ID_REMOTE_TO_MCU_FAST and TIMEOUT_CAN_ID_SWITCH must be defined!
+  #endif
+  #if CAN_EFF
+    #if CAN_ID_MCU_TO_REMOTE_FAST > 0x1FFFFFFF || CAN_ID_REMOTE_TO_MCU_FAST > 0x1FFFFFFF
+      #error CAN_ID_MCU_TO_REMOTE_FAST or CAN_ID_REMOTE_TO_MCU_FAST is greater than 0x1FFFFFFF! Please check your config!
+    #endif
+  #else
+    #if CAN_ID_MCU_TO_REMOTE_FAST > 0x7FF || CAN_ID_REMOTE_TO_MCU_FAST > 0x7FF
+      #error CAN_EFF is not enabled and CAN_ID_MCU_TO_REMOTE_FAST or CAN_ID_REMOTE_TO_MCU_FAST is greater than 0x7FF! Please check your config!
+    #endif
+  #endif
+#endif
+
+#if (TIMEOUT * (F_CPU / 1024UL)) / 1000UL > 0xFFFF
+  #error TIMEOUT is too long for the timer ticks! Please check your config!
+#endif
+
+#ifdef CAN_FD
+  #if !defined(CAN_FD_DATA_KBPS)
+    #error When using CAN_FD, also CAN_FD_DATA_KBPS must be defined!
+  #endif
+#endif
+
 #ifdef CAN_KBPS_DETECT
   #if !defined(TIMEOUT_DETECT_CAN_KBPS)
     #error When using CAN_KBPS_DETECT, also TIMEOUT_DETECT_CAN_KBPS must be defined!
   #endif
 #endif
 
+// size of the bootloader section in bytes, set by tools/pio_profile.py from
+// the build profile of the env
+#if !defined(BOOTLOADER_SIZE)
+  #error BOOTLOADER_SIZE must be defined by the build, it is set by tools/pio_profile.py from the profile of the env!
+#endif
+
+#ifdef DUAL_SLOT
+  #if !defined(DUAL_SLOT_EEPROM_ADDR)
+    #error When using DUAL_SLOT, also DUAL_SLOT_EEPROM_ADDR must be defined!
+  #endif
+  #ifdef FLASH_DELTA
+    #error DUAL_SLOT cannot be used together with FLASH_DELTA, because the source addresses of the flash copy command do not match the staging slot!
+  #endif
+#endif
+
+#ifdef FLASH_NO_BUFFER
+  #ifdef EEPROM_COMMANDS
+    #error FLASH_NO_BUFFER cannot be used together with EEPROM_COMMANDS, because writing the EEPROM clears the temporary page buffer!
+  #endif
+#endif
+
+#ifdef FLASH_RESUME
+  #if !defined(FLASH_RESUME_EEPROM_ADDR)
+    #error When using FLASH_RESUME, also FLASH_RESUME_EEPROM_ADDR must be defined!
+  #endif
+#endif
+
+#ifdef BITRATE_SWITCH
+  #if !defined(TIMEOUT_BITRATE_SWITCH)
+    #error When using BITRATE_SWITCH, also TIMEOUT_BITRATE_SWITCH must be defined!
+  #endif
+#endif
+
+#ifdef WARM_START
+  #if !defined(WARM_START_ADDR)
+    #error When using WARM_START, also WARM_START_ADDR must be defined!
+  #endif
+#endif
+
+#ifdef FLASH_PAGE_MERGE
+  #ifdef FLASH_NO_BUFFER
+    #error FLASH_PAGE_MERGE cannot be used together with FLASH_NO_BUFFER, because the current content of the page is merged in the page buffer in RAM!
+  #endif
+#endif
+
+#ifdef FLASH_PAGE_MERGE
+  #ifdef FLASH_ERASE_AHEAD
+    #error FLASH_PAGE_MERGE cannot be used together with FLASH_ERASE_AHEAD, because a page erased in the background would be merged with the erased content!
+  #endif
+#endif
+
+#ifdef FLASH_DELTA
+  #ifdef FLASH_ERASE_AHEAD
+    #error FLASH_DELTA cannot be used together with FLASH_ERASE_AHEAD, because the flash copy would read pages which may already be erased in the background!
+  #endif
+#endif
+
+#ifdef CAN_SERVICE
+  #ifdef CAN_FD
+    #error CAN_SERVICE cannot be used together with CAN_FD, because only the services of the MCP2515 driver are exported!
+  #endif
+#endif
+
+#ifdef FLASH_PAGE_CACHE
+  #if FLASH_PAGE_CACHE < 2
+    #error FLASH_PAGE_CACHE must be at least 2!
+  #endif
+  #ifdef FLASH_NO_BUFFER
+    #error FLASH_PAGE_CACHE cannot be used together with FLASH_NO_BUFFER, because the pages are cached in RAM!
+  #endif
+  #ifdef FLASH_RESUME
+    #error FLASH_PAGE_CACHE cannot be used together with FLASH_RESUME, because the pages may be written out of order!
+  #endif
+#endif
+
+#ifdef FLASH_ERASE_AHEAD
+  #ifdef FLASH_NO_BUFFER
+    #error FLASH_ERASE_AHEAD cannot be used together with FLASH_NO_BUFFER, because reenabling the RWW section after each background erase clears the temporary page buffer!
+  #endif
+#endif
+
+#ifdef FLASH_PAGE_MAP
+  #ifdef FLASH_NO_BUFFER
+    #error FLASH_PAGE_MAP cannot be used together with FLASH_NO_BUFFER, because reenabling the RWW section after erasing a page clears the temporary page buffer!
+  #endif
+#endif
+
+#ifdef UDS
+  #if !defined(UDS_CAN_ID_REQUEST) || !defined(UDS_CAN_ID_RESPONSE) || !defined(UDS_STMIN)
+    #error When using UDS, also UDS_CAN_ID_REQUEST, UDS_CAN_ID_RESPONSE and UDS_STMIN must be defined!
+  #endif
+  #if CAN_EFF
+    #if UDS_CAN_ID_REQUEST > 0x1FFFFFFF || UDS_CAN_ID_RESPONSE > 0x1FFFFFFF
+      #error UDS_CAN_ID_REQUEST or UDS_CAN_ID_RESPONSE is greater than 0x1FFFFFFF! Please check your config!
+    #endif
+  #else
+    #if UDS_CAN_ID_REQUEST > 0x7FF || UDS_CAN_ID_RESPONSE > 0x7FF
+      #error CAN_EFF is not enabled and UDS_CAN_ID_REQUEST or UDS_CAN_ID_RESPONSE is greater than 0x7FF! Please check your config!
+    #endif
+  #endif
+  #if defined(CAN_ID_REMOTE_TO_MCU_FAST) || defined(EEPROM_COMMANDS) || defined(FLASH_DELTA) || defined(FLASH_PAGE_MAP) || defined(FLASH_RESUME) || defined(BITRATE_SWITCH) || defined(PING_COMMAND)
+    #error UDS cannot be used together with CAN_ID_REMOTE_TO_MCU_FAST, EEPROM_COMMANDS, FLASH_DELTA, FLASH_PAGE_MAP, FLASH_RESUME, BITRATE_SWITCH or PING_COMMAND, since these are commands of the bootloader CAN messages!
+  #endif
+#endif
+
+#ifdef TRACE
+  #if !defined(TRACE_SIZE) || !defined(TRACE_ADDR)
+    #error When using TRACE, also TRACE_SIZE and TRACE_ADDR must be defined!
+  #endif
+  #if TRACE_SIZE > 128 || (TRACE_SIZE & (TRACE_SIZE - 1)) != 0
+    #error TRACE_SIZE must be a power of two and not greater than 128!
+  #endif
+#endif
+
 #endif
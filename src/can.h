@@ -10,6 +10,8 @@
 
 #include <stdint.h>
 
+#include "config.h"
+
 
 typedef unsigned char __u8;
 typedef unsigned short __u16;
@@ -43,10 +45,48 @@ typedef __u32 canid_t;
 #define CAN_MAX_DLC 8
 #define CAN_MAX_DLEN 8
 
+/* CAN FD payload length according to ISO 11898-1:2015 */
+#define CANFD_MAX_DLEN 64
+
+/* payload length of the frame struct depending on the used CAN controller */
+#ifdef CAN_FD
+  #define CAN_FRAME_DLEN CANFD_MAX_DLEN
+#else
+  #define CAN_FRAME_DLEN CAN_MAX_DLEN
+#endif
+
 struct can_frame {
     canid_t can_id;  /* 32 bit CAN_ID + EFF/RTR/ERR flags */
-    __u8    can_dlc; /* frame payload length in byte (0 .. CAN_MAX_DLEN) */
-    __u8    data[CAN_MAX_DLEN] __attribute__((aligned(8)));
+    __u8    can_dlc; /* frame payload length in byte (0 .. CAN_FRAME_DLEN) */
+    __u8    data[CAN_FRAME_DLEN] __attribute__((aligned(8)));
+};
+
+/* clock of the CAN controller */
+enum CAN_CLOCK {
+    MCP_20MHZ,
+    MCP_16MHZ,
+    MCP_8MHZ,
+    MCP_40MHZ
+};
+
+/* bitrate of the CAN bus (nominal bitrate for CAN FD) */
+enum CAN_SPEED {
+    CAN_5KBPS,
+    CAN_10KBPS,
+    CAN_20KBPS,
+    CAN_31K25BPS,
+    CAN_33KBPS,
+    CAN_40KBPS,
+    CAN_50KBPS,
+    CAN_80KBPS,
+    CAN_83K3BPS,
+    CAN_95KBPS,
+    CAN_100KBPS,
+    CAN_125KBPS,
+    CAN_200KBPS,
+    CAN_250KBPS,
+    CAN_500KBPS,
+    CAN_1000KBPS
 };
 
 #endif /* CAN_H_ */
@@ -0,0 +1,30 @@
+/*
+ * MCP-CAN-Boot
+ *
+ * CAN bus bootloader for AVR microcontrollers attached to an MCP2515 CAN controller.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ *
+ * Selection of the CAN controller driver.
+ *
+ * All drivers provide the same interface used by the bootloader:
+ * init(), reset(), setBitrate(), isBitrateSupported(), setConfigMode(),
+ * setListenOnlyMode(), setNormalMode(), setFilters(), sendMessage() and
+ * readMessage() together with the ERROR enum.
+ */
+
+#ifndef	__MCP_CAN_BOOT_CAN_CONTROLLER_H__
+#define	__MCP_CAN_BOOT_CAN_CONTROLLER_H__
+
+#include "config.h"
+
+#ifdef CAN_FD
+  #include "mcp251xfd.h"
+  typedef MCP251XFD CanController;
+#else
+  #include "mcp2515.h"
+  typedef MCP2515 CanController;
+#endif
+
+#endif
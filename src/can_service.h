@@ -0,0 +1,199 @@
+/*
+ * MCP-CAN-Boot
+ *
+ * CAN bus bootloader for AVR microcontrollers attached to an MCP2515 CAN controller.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ *
+ * MCP2515 driver services of the bootloader, callable by the main application.
+ *
+ * This file may be copied into the main application to use the MCP2515 driver
+ * of the bootloader instead of linking an own driver:
+ * \code
+ *  if (canServiceAvailable(CAN_SERVICE_READ_MESSAGE)) {
+ *    canServiceInit();
+ *    canServiceReset();
+ *    canServiceSetBitrate(CAN_500KBPS, MCP_16MHZ);
+ *    canServiceSetNormalMode();
+ *    canServiceSendMessage(0x123, 2, data);
+ *  }
+ * \endcode
+ *
+ * The services don't use timer 1, which is stopped by the bootloader before
+ * the main application is started. Waiting for the MCP2515 is limited by
+ * counting the SPI transfers instead, so the services may be called with any
+ * timer configuration and with interrupts enabled.
+ */
+
+#ifndef	__MCP_CAN_BOOT_CAN_SERVICE_H__
+#define	__MCP_CAN_BOOT_CAN_SERVICE_H__
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+
+/**
+ * Version of the CAN service interface.
+ * Incremented on incompatible changes of the interface. New services are
+ * added at the end of the table without changing the version, so the main
+ * application has to check the number of services too.
+ */
+#define CAN_SERVICE_VERSION 1
+
+/*
+ * The CAN service table is located directly in front of the SPM service table:
+ *   FLASHEND - 9: version of the interface (word)
+ *   FLASHEND - 7: number of services (word)
+ * In front of it there is one rjmp for each service, the first service at the
+ * highest address (a rjmp reaches the whole bootloader section and cannot be
+ * shortened by the linker relaxation):
+ *   FLASHEND - 9 - 2 * (n + 1): rjmp to the service n
+ * So the addresses of the existing services do not change if services are
+ * added. The bootloader must be linked with the section .can_service starting
+ * at FLASHEND - 9 - 2 * CAN_SERVICE_COUNT.
+ */
+#define CAN_SERVICE_TABLE ((uint32_t)FLASHEND + 1 - 10)
+#define CAN_SERVICE_ENTRY(n) (CAN_SERVICE_TABLE - 2 * ((uint32_t)(n) + 1))
+
+/*
+ * CAN services (index in the table)
+ */
+#define CAN_SERVICE_INIT             0 // void init (void): setup the SPI interface
+#define CAN_SERVICE_RESET            1 // uint8_t reset (void)
+#define CAN_SERVICE_SET_BITRATE      2 // uint8_t setBitrate (uint8_t canSpeed, uint8_t canClock)
+#define CAN_SERVICE_SET_FILTER_MASK  3 // uint8_t setFilterMask (uint8_t num, bool ext, uint32_t id)
+#define CAN_SERVICE_SET_FILTER       4 // uint8_t setFilter (uint8_t num, bool ext, uint32_t id)
+#define CAN_SERVICE_SET_NORMAL_MODE  5 // uint8_t setNormalMode (void)
+#define CAN_SERVICE_SEND_MESSAGE     6 // uint8_t sendMessage (uint32_t id, uint8_t dlc, const uint8_t *data)
+#define CAN_SERVICE_READ_MESSAGE     7 // uint8_t readMessage (uint32_t *id, uint8_t *dlc, uint8_t *data)
+#define CAN_SERVICE_COUNT            8
+
+/*
+ * Results of the services (MCP2515::ERROR)
+ */
+#define CAN_SERVICE_OK              0
+#define CAN_SERVICE_ERROR_FAIL      1
+#define CAN_SERVICE_ERROR_ALLTXBUSY 2
+#define CAN_SERVICE_ERROR_FAILINIT  3
+#define CAN_SERVICE_ERROR_FAILTX    4
+#define CAN_SERVICE_ERROR_NOMSG     5
+
+/*
+ * Flags of the CAN-ID like in can.h
+ */
+#ifndef CAN_EFF_FLAG
+  #define CAN_EFF_FLAG 0x80000000UL
+  #define CAN_RTR_FLAG 0x40000000UL
+#endif
+
+#if FLASHEND > 0xFFFF
+  #define canServiceReadWord(addr) pgm_read_word_far(addr)
+#else
+  #define canServiceReadWord(addr) pgm_read_word(addr)
+#endif
+
+/*
+ * Call the service n, which returns an uint8_t.
+ * On MCUs with more than 128k of flash the EIND register is set temporarily
+ * to reach the bootloader section.
+ */
+#ifdef EIND
+  #define CAN_SERVICE_CALL(type, n, ...) ({                                 \
+    uint8_t eind = EIND;                                                    \
+    EIND = (uint8_t)(CAN_SERVICE_ENTRY(n) >> 17);                           \
+    uint8_t res = ((type)(uint16_t)(CAN_SERVICE_ENTRY(n) >> 1))(__VA_ARGS__); \
+    EIND = eind;                                                            \
+    res;                                                                    \
+  })
+#else
+  #define CAN_SERVICE_CALL(type, n, ...) \
+    ((type)(uint16_t)(CAN_SERVICE_ENTRY(n) >> 1))(__VA_ARGS__)
+#endif
+
+/**
+ * Read the version of the CAN service interface provided by the bootloader.
+ * Returns 0xFFFF if the bootloader has no CAN service.
+ */
+static inline uint16_t canServiceVersion (void) {
+  return canServiceReadWord(CAN_SERVICE_TABLE);
+}
+
+/**
+ * Check if the bootloader provides the given service.
+ * @param n One of the CAN_SERVICE_* services.
+ */
+static inline bool canServiceAvailable (uint8_t n) {
+  return canServiceVersion() == CAN_SERVICE_VERSION
+    && canServiceReadWord(CAN_SERVICE_TABLE + 2) > n;
+}
+
+/**
+ * Setup the SPI interface. Must be called first, since the bootloader resets
+ * the SPI interface before starting the main application.
+ */
+static inline void canServiceInit (void) {
+  #ifdef EIND
+    uint8_t eind = EIND;
+    EIND = (uint8_t)(CAN_SERVICE_ENTRY(CAN_SERVICE_INIT) >> 17);
+  #endif
+  ((void (*)(void))(uint16_t)(CAN_SERVICE_ENTRY(CAN_SERVICE_INIT) >> 1))();
+  #ifdef EIND
+    EIND = eind;
+  #endif
+}
+
+/**
+ * Reset the MCP2515 into configuration mode.
+ * Rollover from RXB0 into RXB1 is enabled and RX0IF and RX1IF are enabled in
+ * CANINTE, so the INT pin indicates a message in any receive buffer.
+ */
+static inline uint8_t canServiceReset (void) {
+  return CAN_SERVICE_CALL(uint8_t (*)(void), CAN_SERVICE_RESET);
+}
+
+/**
+ * Set the bitrate. The values of canSpeed and canClock are the CAN_SPEED and
+ * CAN_CLOCK enums of can.h (the same as in the arduino-mcp2515 library).
+ */
+static inline uint8_t canServiceSetBitrate (uint8_t canSpeed, uint8_t canClock) {
+  return CAN_SERVICE_CALL(uint8_t (*)(uint8_t, uint8_t), CAN_SERVICE_SET_BITRATE, canSpeed, canClock);
+}
+
+static inline uint8_t canServiceSetFilterMask (uint8_t num, bool ext, uint32_t id) {
+  return CAN_SERVICE_CALL(uint8_t (*)(uint8_t, bool, uint32_t), CAN_SERVICE_SET_FILTER_MASK, num, ext, id);
+}
+
+static inline uint8_t canServiceSetFilter (uint8_t num, bool ext, uint32_t id) {
+  return CAN_SERVICE_CALL(uint8_t (*)(uint8_t, bool, uint32_t), CAN_SERVICE_SET_FILTER, num, ext, id);
+}
+
+static inline uint8_t canServiceSetNormalMode (void) {
+  return CAN_SERVICE_CALL(uint8_t (*)(void), CAN_SERVICE_SET_NORMAL_MODE);
+}
+
+/**
+ * Send a message and wait until it is transmitted.
+ * @param id   The CAN-ID, including CAN_EFF_FLAG and CAN_RTR_FLAG.
+ * @param dlc  Number of data bytes (0 to 8).
+ * @param data The data bytes.
+ */
+static inline uint8_t canServiceSendMessage (uint32_t id, uint8_t dlc, const uint8_t *data) {
+  return CAN_SERVICE_CALL(uint8_t (*)(uint32_t, uint8_t, const uint8_t*), CAN_SERVICE_SEND_MESSAGE, id, dlc, data);
+}
+
+/**
+ * Read a received message.
+ * RXB0 is read first, then RXB1, which gets the messages accepted by mask 1
+ * and the filters 2 to 5 and the messages rolled over from a full RXB0.
+ * Returns CAN_SERVICE_ERROR_NOMSG if no message is available.
+ * @param id   The CAN-ID, including CAN_EFF_FLAG and CAN_RTR_FLAG.
+ * @param dlc  Number of data bytes.
+ * @param data Buffer of 8 bytes for the data bytes.
+ */
+static inline uint8_t canServiceReadMessage (uint32_t *id, uint8_t *dlc, uint8_t *data) {
+  return CAN_SERVICE_CALL(uint8_t (*)(uint32_t*, uint8_t*, uint8_t*), CAN_SERVICE_READ_MESSAGE, id, dlc, data);
+}
+
+#endif
@@ -27,6 +27,8 @@
  * In this amount of time after MCU reset a "flash init" command must be
  * received via CAN to enter the bootloading mode. Otherwise the main
  * application will be started.
+ * Maximum is about 4000 ms at 16 MHz (65535 ticks of timer 1 with prescaler
+ * 1024).
  */
 #define TIMEOUT 250
 
@@ -67,9 +69,27 @@
 /**
  * Clock speed of the MCP2515 CAN controller.
  * MCP_8MHZ, MCP_16MHZ or MCP_20MHZ
+ * When using a MCP2517FD or MCP2518FD (see CAN_FD below) this is the system
+ * clock of the CAN controller, which must be MCP_20MHZ or MCP_40MHZ.
  */
 #define MCP_CLOCK MCP_16MHZ
 
+/**
+ * Use a MCP2517FD or MCP2518FD CAN FD controller instead of the MCP2515.
+ * The controller is connected in the same way via SPI (and optionally the INT
+ * pin). All bootloader messages are classic CAN frames, but the flash data
+ * command may be sent as a CAN FD frame with up to 60 bytes of data to flash
+ * faster.
+ */
+//#define CAN_FD
+
+/**
+ * Data bitrate of CAN FD frames in kbit/s (e.g. 1000, 2000, 4000, 5000 or
+ * 8000). The nominal bitrate is set by CAN_KBPS.
+ * Only used if CAN_FD is set.
+ */
+//#define CAN_FD_DATA_KBPS 2000
+
 /**
  * Optional definition of a custom CS (chip select) pin for the MCP2515.
  * If not defined, the default SPI_SS pin will be used for chip select.
@@ -78,6 +98,26 @@
 //#define MCP_CS_DDR  DDRB
 //#define MCP_CS_PORT PORTB
 
+/**
+ * Optional definition of the pin connected to the INT pin of the MCP2515.
+ * If defined, the INT pin will be checked for received messages instead of
+ * reading the status of the MCP2515 via SPI in each loop.
+ */
+//#define MCP_INT     PINB1
+//#define MCP_INT_PIN PINB
+
+/**
+ * Use the one-shot mode of the MCP2515 to send the bootloader messages.
+ * Each message will be transmitted only once, without the automatic
+ * retransmission of the MCP2515, and no message is sent while the MCP2515 is
+ * in bus-off state until it recovered by itself after 128 occurrences of 11
+ * recessive bits. This prevents long stalls while sending on a degraded CAN
+ * bus without disturbing the other nodes by a faulty node.
+ * The flash application must resend its last command if it does not receive
+ * a response from the bootloader in time.
+ */
+//#define CAN_ONE_SHOT
+
 /**
  * When using a custom CS pin, then it must be ensured that the SPI_SS pin is
  * defined as an output or externally pulled high. Otherwise the bootloader may
@@ -105,6 +145,78 @@
 #define CAN_ID_REMOTE_TO_MCU 0x1FFFFF02UL
 //#define CAN_ID_REMOTE_TO_MCU 0x1F2
 
+/**
+ * Optional high priority CAN-IDs for the bootloader messages.
+ * If defined, the flash application may switch to these CAN-IDs within a
+ * flashing session using the switch CAN-ID command, e.g. to flash faster
+ * during planned maintenance windows. The default CAN-IDs defined above are
+ * used at startup, so the bootloader has no impact on an active CAN system
+ * unless requested.
+ */
+//#define CAN_ID_MCU_TO_REMOTE_FAST 0x00000101UL
+//#define CAN_ID_REMOTE_TO_MCU_FAST 0x00000102UL
+
+/**
+ * Timeout in milliseconds to receive a message using the new CAN-IDs after
+ * switching the CAN-IDs. If no message is received in this time, the
+ * bootloader will switch back to the previous CAN-IDs.
+ * Only used if the high priority CAN-IDs are set.
+ */
+//#define TIMEOUT_CAN_ID_SWITCH 100
+
+/**
+ * Answer the ping command with the receive and transmit timestamps of the
+ * bootloader or its current state (flashing mode, flash address and number of
+ * bytes in the page buffer).
+ * This allows the flash application to measure the round-trip time split into
+ * the bus and the MCU processing time. A ping also restarts the TIMEOUT while
+ * waiting for flash init, so the bootloader may be kept waiting.
+ */
+//#define PING_COMMAND
+
+/**
+ * Enable the switch bitrate command.
+ * The flash application may switch to a higher bitrate within a flashing
+ * session, e.g. when only the flash application and one MCU are connected
+ * using a service connector. Any bitrate supported by the MCP2515 for the
+ * used MCP_CLOCK up to CAN_1000KBPS may be requested.
+ */
+//#define BITRATE_SWITCH
+
+/**
+ * Timeout in milliseconds to receive a message using the new bitrate after
+ * switching the bitrate. If no message is received in this time, the
+ * bootloader will switch back to the last confirmed bitrate.
+ * Only used if BITRATE_SWITCH is set.
+ */
+//#define TIMEOUT_BITRATE_SWITCH 100
+
+/**
+ * Use UDS (ISO 14229) download services over ISO-TP (ISO 15765-2) instead of
+ * the bootloader CAN messages described in the README.
+ * This allows to flash the MCU using existing UDS tooling, e.g. with the
+ * ISO-TP socket of the Linux kernel (see tools/uds_flash.py).
+ * The MCU is identified by the CAN-IDs only, so each MCU must use its own
+ * CAN-IDs for the UDS requests and responses. MCU_ID is not used.
+ */
+//#define UDS
+
+/**
+ * CAN-IDs for the UDS requests (remote to MCU) and responses (MCU to remote).
+ * Only used if UDS is set.
+ */
+//#define UDS_CAN_ID_REQUEST  0x18DA42F1UL
+//#define UDS_CAN_ID_RESPONSE 0x18DAF142UL
+
+/**
+ * Minimum separation time of the consecutive frames in milliseconds, which is
+ * requested from the remote in each ISO-TP flow control frame (0 to 127).
+ * This must be long enough to read one CAN message from the MCP2515 and to
+ * handle its data, since the MCP2515 holds only two received messages.
+ * Only used if UDS is set.
+ */
+//#define UDS_STMIN 1
+
 /**
  * Optional definition of a LED port, which will be used to indicate
  * bootloader actions.
@@ -147,4 +259,241 @@
  */
 #define MCUSR_TO_R2 true
 
+/**
+ * Fill the temporary page buffer of the MCU directly while the flash data is
+ * received, instead of collecting the data of a whole page in a buffer in RAM.
+ * This saves SPM_PAGESIZE bytes of RAM and removes filling the page from the
+ * time needed to write a full page.
+ * Each word of a flash page can only be filled once, so the flash application
+ * must not send data for the same flash address twice within one page.
+ * Cannot be used together with EEPROM_COMMANDS.
+ */
+//#define FLASH_NO_BUFFER
+
+/**
+ * Preload the page buffer with the current content of the flash page when the
+ * first flash data for a page is received.
+ * Bytes of the page which are not sent by the flash application keep their
+ * current content, instead of being wiped to 0xFF. This allows to patch a few
+ * bytes (e.g. a constant table) after a *flash set address* without sending
+ * the whole page.
+ * Pages which are erased before (flash erase or page map) are merged with
+ * the erased content, so the behavior of full updates is unchanged.
+ * Cannot be used together with FLASH_NO_BUFFER or FLASH_ERASE_AHEAD, since a
+ * page erased in the background would be merged with the erased content.
+ */
+//#define FLASH_PAGE_MERGE
+
+/**
+ * Number of flash pages cached in RAM for out-of-order flash data.
+ * If the flash application sets the address to another page before the
+ * current page is complete, the page is kept in the cache instead of being
+ * written. So each page is written only once, even if the segments of the hex
+ * file are not sent in address order. The least recently used page is written
+ * if the cache is full, all cached pages are written on flash done.
+ * Needs FLASH_PAGE_CACHE * SPM_PAGESIZE bytes of RAM, so only recommended for
+ * MCUs with enough RAM like the ATmega1284P or ATmega2560.
+ * Cannot be used together with FLASH_NO_BUFFER or FLASH_RESUME.
+ */
+//#define FLASH_PAGE_CACHE 4
+
+/**
+ * Enable the flash page map command for sparse images.
+ * Instead of erasing the whole flash, the flash application may send a bitmap
+ * of the used pages of the new application. Only the pages which must become
+ * blank and are not blank already will be erased, so blank regions of the
+ * application don't need to be transmitted at all.
+ * Cannot be used together with FLASH_NO_BUFFER.
+ */
+//#define FLASH_PAGE_MAP
+
+/**
+ * Erase the flash pages in the background while waiting for CAN messages.
+ * The flash application may announce the address range of the data to be
+ * written next using the flash range command (or the UDS RequestDownload). The
+ * pages of this range will be erased one by one while no message is received,
+ * so only the page write remains when a page is full.
+ * Cannot be used together with FLASH_NO_BUFFER.
+ */
+//#define FLASH_ERASE_AHEAD
+
+/**
+ * Allow to resume an interrupted flashing session (e.g. after a power loss).
+ * Each written page is marked in a bitmap in the EEPROM (one bit per page of
+ * the application flash). The flash application may then use the flash
+ * resume command to continue the session behind the last written page after
+ * verifying the CRC of the already written data, instead of starting over.
+ * Marking a page takes the time of writing one EEPROM byte (about 3.4 ms) for
+ * each written page. Each byte of the bitmap is written at most eight times
+ * and reset once per session, so about 11000 sessions are possible within
+ * the 100000 write cycles of the EEPROM.
+ */
+//#define FLASH_RESUME
+
+/**
+ * EEPROM address of the bitmap of the written pages.
+ * The bitmap uses FLASH_RESUME_BYTES bytes (the number of application flash
+ * pages divided by eight, e.g. 28 bytes on an ATmega328P).
+ * Only used if FLASH_RESUME is set.
+ */
+//#define FLASH_RESUME_EEPROM_ADDR (E2END - FLASH_RESUME_BYTES)
+
+/**
+ * Enable commands to read and write the EEPROM while in flashing mode.
+ * This allows to update the EEPROM in the same session as the flash.
+ * Unchanged bytes will not be written to save the time needed for writing
+ * each EEPROM byte (about 3.4 ms) and the EEPROM write cycles.
+ */
+//#define EEPROM_COMMANDS
+
+/**
+ * Enable delta updates using the flash copy command.
+ * With the flash copy command, the flash application may copy data from the
+ * current flash content into the new flash content instead of transmitting
+ * it. This makes it possible to send only the differences between the old and
+ * the new application (e.g. generated with tools/flash_delta.py).
+ * The flash application must make sure that the source data of each copy is
+ * not already overwritten by a previously written page and must not send the
+ * flash erase command in a delta session, since it erases the source data.
+ * Cannot be used together with FLASH_ERASE_AHEAD.
+ */
+//#define FLASH_DELTA
+
+/**
+ * Use a dual slot (A/B) layout of the application flash.
+ * The application flash will be split into two equal slots. The application
+ * is executed from the first slot (starting at 0x0000) and all flash data
+ * received via CAN will be written into the second (staging) slot.
+ * Only after the new application is completely transmitted and the CRC
+ * given by flash done matches the staging slot, it will be copied into the
+ * first slot. So an interrupted flashing session will never leave the MCU
+ * without a working application.
+ * Together with SPM_SERVICE, the main application may also write the staging
+ * slot itself while it keeps running and request the copy (see dual_slot.h).
+ * The size of the application is limited to the half of the application
+ * flash. Recommended only for MCUs with a large flash, like the ATmega1284P or
+ * ATmega2560.
+ * Cannot be used together with FLASH_DELTA.
+ */
+//#define DUAL_SLOT
+
+/**
+ * EEPROM address of the copy request of the staging slot (5 bytes).
+ * Only used if DUAL_SLOT is set.
+ */
+//#define DUAL_SLOT_EEPROM_ADDR (E2END - 4)
+
+/**
+ * Enable the warm start of the bootloader by the main application.
+ * The main application may jump directly into the bootloader after it received
+ * a request to be updated, instead of resetting the MCU using the watchdog.
+ * The application passes the bitrate it is currently using in a small handoff
+ * structure in RAM (see warm_start.h), so the bootloader skips the bitrate
+ * detection and enters the flashing mode immediately by sending the flash ready
+ * message instead of the bootloader start message.
+ *
+ * A warm start is only accepted if the MCU Status Register is zero, which is
+ * only the case if the bootloader was entered without a reset.
+ */
+//#define WARM_START
+
+/**
+ * RAM address of the warm start handoff structure (3 bytes).
+ * It must be located outside of the data and bss sections of the bootloader
+ * and must not overlap the trace buffer.
+ * Only used if WARM_START is set.
+ */
+//#define WARM_START_ADDR (RAMEND - 0x203)
+
+/**
+ * Export an SPM service at a fixed address, so the main application may erase,
+ * fill and write flash pages without restarting into the bootloader.
+ * Only the bootloader section is able to execute the SPM instruction.
+ * See spm_service.h for the interface, which may be copied into the main
+ * application.
+ * The section .spm_service must be placed at FLASHEND - 5 in the PlatformIO
+ * env (already done for the provided envs).
+ */
+//#define SPM_SERVICE
+
+/**
+ * Export the services of the MCP2515 driver at a fixed address, so the main
+ * application may use the driver of the bootloader instead of linking an own
+ * one (init, reset, set bitrate, set filter (mask), set normal mode, send and
+ * read message).
+ * See can_service.h for the interface, which may be copied into the main
+ * application.
+ * The section .can_service must be placed at FLASHEND - 25 in the PlatformIO
+ * env (already done for the provided envs).
+ * Cannot be used together with CAN_FD.
+ */
+//#define CAN_SERVICE
+
+/**
+ * Enable tracing of the bootloader phases.
+ * Each phase (reset, MCP2515 reset, bitrate detection, waiting for flash init,
+ * erasing, writing each flash page and the startApp cleanup) will be recorded
+ * together with a timestamp from timer 1 (prescaler 1024, 64 µs per tick at
+ * 16 MHz) into a circular trace buffer in RAM.
+ *
+ * The trace buffer can be read via CAN using the trace read command while in
+ * flashing mode, or by the main application after the bootloader started it.
+ * Timer 1 will be left running in normal mode when the main application is
+ * started, so the application may add its own timestamps using the same
+ * time base.
+ */
+//#define TRACE
+
+/**
+ * Number of events in the trace buffer.
+ * Must be a power of two and not greater than 128.
+ * Only used if TRACE is set.
+ */
+//#define TRACE_SIZE 32
+
+/**
+ * RAM address of the trace buffer.
+ * The trace buffer is located at a fixed address outside of the data and bss
+ * sections of the bootloader, so it will not be touched by the startup code of
+ * the bootloader and can be read by the main application.
+ * It must be located below the stack of the bootloader and the main
+ * application when the trace buffer is read.
+ * Only used if TRACE is set.
+ */
+//#define TRACE_ADDR (RAMEND - 0x1FF)
+
+/*
+ * Compact profile for a 1024 words (2048 bytes) bootloader section.
+ * The profile is not selected here, but in the PlatformIO env using
+ * `custom_profile = compact` (see the *_compact envs), since the start of the
+ * bootloader section depends on it. COMPACT is defined then and all optional
+ * features are disabled, so only the fixed bitrate CAN_KBPS and the basic
+ * commands (flash init, flash erase, flash set address, flash data, flash done
+ * and start app) are available. Flash read and flash done verify are not
+ * available in this profile.
+ */
+#ifdef COMPACT
+  #undef CAN_KBPS_DETECT
+  #undef CAN_FD
+  #undef CAN_ONE_SHOT
+  #undef CAN_ID_MCU_TO_REMOTE_FAST
+  #undef CAN_ID_REMOTE_TO_MCU_FAST
+  #undef PING_COMMAND
+  #undef BITRATE_SWITCH
+  #undef UDS
+  #undef LED
+  #undef FLASH_PAGE_MERGE
+  #undef FLASH_PAGE_CACHE
+  #undef FLASH_PAGE_MAP
+  #undef FLASH_ERASE_AHEAD
+  #undef FLASH_RESUME
+  #undef EEPROM_COMMANDS
+  #undef FLASH_DELTA
+  #undef DUAL_SLOT
+  #undef WARM_START
+  #undef SPM_SERVICE
+  #undef CAN_SERVICE
+  #undef TRACE
+#endif
+
 #endif
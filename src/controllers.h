@@ -16,11 +16,9 @@
 
 #include <avr/io.h>
 
-#define BOOTLOADER_SIZE 4096
+#include "config.h"
 
 #if defined(__AVR_ATmega32__)
-  #define IV_REG GICR
-
   #define SPI_DDR  DDRB
   #define SPI_PORT PORTB
   #define SPI_SS   4
@@ -29,8 +27,6 @@
   #define SPI_SCK  7
 
 #elif defined(__AVR_ATmega64__) || defined(__AVR_ATmega128__) || defined(__AVR_ATmega2560__)
-  #define IV_REG MCUCR
-
   #define SPI_DDR  DDRB
   #define SPI_PORT PORTB
   #define SPI_SS   0
@@ -39,8 +35,6 @@
   #define SPI_SCK  1
 
 #elif defined(__AVR_ATmega32U4__)
-  #define IV_REG MCUCR
-
   #define SPI_DDR DDRB
   #define SPI_PORT PORTB
   #define SPI_SS 0
@@ -49,8 +43,6 @@
   #define SPI_SCK 1
 
 #elif defined(__AVR_ATmega328P__)
-  #define IV_REG MCUCR
-
   #define SPI_DDR  DDRB
   #define SPI_PORT PORTB
   #define SPI_SS   2
@@ -59,8 +51,6 @@
   #define SPI_SCK  5
 
 #elif defined(__AVR_ATmega644P__) || defined(__AVR_ATmega1284P__)
-  #define IV_REG MCUCR
-
   #define SPI_DDR  DDRB
   #define SPI_PORT PORTB
   #define SPI_SS   4
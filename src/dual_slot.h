@@ -0,0 +1,86 @@
+/*
+ * MCP-CAN-Boot
+ *
+ * CAN bus bootloader for AVR microcontrollers attached to an MCP2515 CAN controller.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ *
+ * Dual slot (A/B) layout of the application flash.
+ *
+ * This file may be copied into the main application. The application has to
+ * define DUAL_SLOT_EEPROM_ADDR with the same value as in the bootloader config
+ * and BOOTLOADER_SIZE if the bootloader section is not 4096 bytes.
+ *
+ * The main application may write the new application into the staging slot
+ * while it keeps running, using the SPM service of the bootloader (see
+ * spm_service.h). After the staging slot is complete, the application requests
+ * the copy and resets the MCU. The bootloader verifies the CRC of the staging
+ * slot and copies it into the execution slot only if it matches:
+ * \code
+ *  // write the pages of the new application to DUAL_SLOT_STAGING + offset
+ *  // using spmServiceCall(), then request the copy
+ *  dualSlotRequestCopy(pages, crc);
+ *  wdt_enable(WDTO_15MS);
+ *  while (1);
+ * \endcode
+ */
+
+#ifndef	__MCP_CAN_BOOT_DUAL_SLOT_H__
+#define	__MCP_CAN_BOOT_DUAL_SLOT_H__
+
+#include <inttypes.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+
+#ifndef DUAL_SLOT_EEPROM_ADDR
+  #error DUAL_SLOT_EEPROM_ADDR must be defined with the same value as in the bootloader config!
+#endif
+
+/**
+ * Size of the bootloader section in bytes, 4096 bytes if not defined.
+ */
+#ifndef BOOTLOADER_SIZE
+  #define BOOTLOADER_SIZE 4096
+#endif
+
+/**
+ * Size of each slot in bytes, the half of the application flash rounded down
+ * to full flash pages.
+ */
+#define DUAL_SLOT_SIZE (((((uint32_t)FLASHEND + 1 - BOOTLOADER_SIZE) / 2) / SPM_PAGESIZE) * SPM_PAGESIZE)
+
+/**
+ * Start address of the staging slot. The execution slot starts at 0x0000.
+ */
+#define DUAL_SLOT_STAGING DUAL_SLOT_SIZE
+
+/**
+ * Value of the flag of a requested (or interrupted) copy of the staging slot.
+ */
+#define DUAL_SLOT_COPY_REQUEST 0xA5
+
+/*
+ * Copy request in the EEPROM starting at DUAL_SLOT_EEPROM_ADDR (5 bytes):
+ *   +0: flag, DUAL_SLOT_COPY_REQUEST or any other value for no request
+ *   +1: number of flash pages of the new application (word)
+ *   +3: CRC-16/XMODEM of these pages in the staging slot (word)
+ */
+#define DUAL_SLOT_REQUEST_FLAG  ((uint8_t*)(DUAL_SLOT_EEPROM_ADDR))
+#define DUAL_SLOT_REQUEST_PAGES ((uint16_t*)(DUAL_SLOT_EEPROM_ADDR + 1))
+#define DUAL_SLOT_REQUEST_CRC   ((uint16_t*)(DUAL_SLOT_EEPROM_ADDR + 3))
+
+/**
+ * Request the copy of the staging slot on the next start of the bootloader.
+ * The flag is written last, so an incomplete request is never used.
+ * @param pages Number of flash pages of the new application.
+ * @param crc   CRC-16/XMODEM (_crc_xmodem_update() starting with 0) of these
+ *              pages in the staging slot.
+ */
+static inline void dualSlotRequestCopy (uint16_t pages, uint16_t crc) {
+  eeprom_update_word(DUAL_SLOT_REQUEST_PAGES, pages);
+  eeprom_update_word(DUAL_SLOT_REQUEST_CRC, crc);
+  eeprom_update_byte(DUAL_SLOT_REQUEST_FLAG, DUAL_SLOT_COPY_REQUEST);
+}
+
+#endif
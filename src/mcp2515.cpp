@@ -26,149 +26,85 @@ const struct MCP2515::RXBn_REGS MCP2515::RXB[N_RXBUFFERS] = {
 MCP2515::MCP2515 () { }
 
 void MCP2515::init () {
-
-  // set spi pins as output
-  #if !defined(MCP_CS) || defined(SET_SPI_SS_OUTPUT)
-    SPI_DDR |= ((1<<SPI_SS) | (1<<SPI_MOSI) | (1<<SPI_SCK));
-  #else
-    SPI_DDR |= ((1<<SPI_MOSI) | (1<<SPI_SCK));
-  #endif
-
-  // set custom CS pin as output if used
-  #ifdef MCP_CS
-    MCP_CS_DDR |= (1 << MCP_CS);
-
-    // set SPI_SS to defined level if used
-    #ifdef SET_SPI_SS_OUTPUT
-      #if SET_SPI_SS_OUTPUT == HIGH
-        SPI_PORT |= (1 << SPI_SS);
-      #else
-        SPI_PORT &= ~(1 << SPI_SS);
-      #endif
-    #endif
-  #endif
-
-  // setup spi
-  #if F_CPU < 4000000L
-    // < 4MHz ... SCK frequency = oscillator frequency / 4
-    SPCR = ((1<<SPE) | (1<<MSTR) | (1<<CPOL) | (1<<CPHA));
-  #elif F_CPU < 8000000L
-    // < 8MHz ... SCK frequency = oscillator frequency / 8
-    SPCR = ((1<<SPE) | (1<<MSTR) | (1<<CPOL) | (1<<CPHA) | (1<<SPR0));
-    SPSR = (1<<SPI2X);
-  #elif F_CPU < 16000000L
-    // < 16MHz ... SCK frequency = oscillator frequency / 16
-    SPCR = ((1<<SPE) | (1<<MSTR) | (1<<CPOL) | (1<<CPHA) | (1<<SPR0));
-  #else
-    // >= 16MHz ... SCK frequency = oscillator frequency / 32
-    SPCR = ((1<<SPE) | (1<<MSTR) | (1<<CPOL) | (1<<CPHA) | (1<<SPR1));
-    SPSR = (1<<SPI2X);
-  #endif
-
-  #ifdef MCP_CS
-    MCP_CS_PORT |= (1 << MCP_CS); // set custom CS high
-  #else
-    SPI_PORT |= (1 << SPI_SS); // set SS high
-  #endif
-}
-
-void MCP2515::startSPI () {
-  #ifdef MCP_CS
-    MCP_CS_PORT &= ~(1 << MCP_CS); // set custom CS low
-  #else
-    SPI_PORT &= ~(1 << SPI_SS); // set SS low
-  #endif
-}
-
-void MCP2515::endSPI () {
-  #ifdef MCP_CS
-    MCP_CS_PORT |= (1 << MCP_CS); // set custom CS high
-  #else
-    SPI_PORT |= (1 << SPI_SS); // set SS high
-  #endif
-}
-
-uint8_t MCP2515::transfer (uint8_t data) {
-  SPDR = data;
-  /*
-   * The following NOP introduces a small delay that can prevent the wait
-   * loop form iterating when running at the maximum speed. This gives
-   * about 10% more speed, even if it seems counter-intuitive. At lower
-   * speeds it is unnoticed.
-   */
-  asm volatile("nop");
-  while (!(SPSR & (1<<SPIF))) ; // wait
-  return SPDR;
+  spiInit();
 }
 
 MCP2515::ERROR MCP2515::reset(void) {
-  startSPI();
-  transfer(INSTRUCTION_RESET);
-  endSPI();
-
-  delay(10);
+  spiStart();
+  spiTransfer(INSTRUCTION_RESET);
+  spiEnd();
+
+  // wait until the MCP2515 is in configuration mode after the reset
+  uint16_t timeout = MODE_TIMEOUT;
+  while ((readRegister(MCP_CANSTAT) & CANSTAT_OPMOD) != CANCTRL_REQOP_CONFIG) {
+    if (--timeout == 0) {
+      return ERROR_FAIL;
+    }
+  }
 
-  // make sure bucketing is disabled by default
-  setRegister(MCP_RXB0CTRL, 0);
+  // roll a message over into rx1 if rx0 is still full, so a second message
+  // is not lost while the bootloader is busy (e.g. writing a flash page)
+  setRegister(MCP_RXB0CTRL, RXB0CTRL_BUKT);
 
-  setRegister(MCP_CANINTE, CANINTF_RX0IF | CANINTF_RX1IF | CANINTF_ERRIF | CANINTF_MERRF);
+  // the INT pin will indicate a message in rx0 or rx1
+  setRegister(MCP_CANINTE, CANINTF_RX0IF | CANINTF_RX1IF);
 
   return ERROR_OK;
 }
 
 uint8_t MCP2515::readRegister(const REGISTER reg) {
-  startSPI();
-  transfer(INSTRUCTION_READ);
-  transfer(reg);
-  uint8_t ret = transfer(0x00);
-  endSPI();
+  spiStart();
+  spiTransfer(INSTRUCTION_READ);
+  spiTransfer(reg);
+  uint8_t ret = spiTransfer(0x00);
+  spiEnd();
 
   return ret;
 }
 
 void MCP2515::readRegisters(const REGISTER reg, uint8_t values[], const uint8_t n) {
-  startSPI();
-  transfer(INSTRUCTION_READ);
-  transfer(reg);
+  spiStart();
+  spiTransfer(INSTRUCTION_READ);
+  spiTransfer(reg);
   // mcp2515 has auto-increment of address-pointer
   for (uint8_t i=0; i<n; i++) {
-    values[i] = transfer(0x00);
+    values[i] = spiTransfer(0x00);
   }
-  endSPI();
+  spiEnd();
 }
 
 void MCP2515::setRegister(const REGISTER reg, const uint8_t value) {
-  startSPI();
-  transfer(INSTRUCTION_WRITE);
-  transfer(reg);
-  transfer(value);
-  endSPI();
+  spiStart();
+  spiTransfer(INSTRUCTION_WRITE);
+  spiTransfer(reg);
+  spiTransfer(value);
+  spiEnd();
 }
 
 void MCP2515::setRegisters(const REGISTER reg, const uint8_t values[], const uint8_t n) {
-  startSPI();
-  transfer(INSTRUCTION_WRITE);
-  transfer(reg);
+  spiStart();
+  spiTransfer(INSTRUCTION_WRITE);
+  spiTransfer(reg);
   for (uint8_t i=0; i<n; i++) {
-    transfer(values[i]);
+    spiTransfer(values[i]);
   }
-  endSPI();
+  spiEnd();
 }
 
 void MCP2515::modifyRegister(const REGISTER reg, const uint8_t mask, const uint8_t data) {
-  startSPI();
-  transfer(INSTRUCTION_BITMOD);
-  transfer(reg);
-  transfer(mask);
-  transfer(data);
-  endSPI();
+  spiStart();
+  spiTransfer(INSTRUCTION_BITMOD);
+  spiTransfer(reg);
+  spiTransfer(mask);
+  spiTransfer(data);
+  spiEnd();
 }
 
 uint8_t MCP2515::getStatus(void) {
-  startSPI();
-  transfer(INSTRUCTION_READ_STATUS);
-  uint8_t i = transfer(0x00);
-  endSPI();
+  spiStart();
+  spiTransfer(INSTRUCTION_READ_STATUS);
+  uint8_t i = spiTransfer(0x00);
+  spiEnd();
 
   return i;
 }
@@ -194,11 +130,16 @@ MCP2515::ERROR MCP2515::setNormalMode() {
 }
 
 MCP2515::ERROR MCP2515::setMode(const CANCTRL_REQOP_MODE mode) {
-  modifyRegister(MCP_CANCTRL, CANCTRL_REQOP, mode);
+  #ifdef CAN_ONE_SHOT
+    // try to transmit each message only once
+    modifyRegister(MCP_CANCTRL, CANCTRL_REQOP | CANCTRL_OSM, mode | CANCTRL_OSM);
+  #else
+    modifyRegister(MCP_CANCTRL, CANCTRL_REQOP, mode);
+  #endif
 
-  unsigned long endTime = millis() + 10;
+  uint16_t timeout = MODE_TIMEOUT;
   bool modeMatch = false;
-  while (millis() < endTime) {
+  while (--timeout != 0) {
     uint8_t newmode = readRegister(MCP_CANSTAT);
     newmode &= CANSTAT_OPMOD;
 
@@ -216,12 +157,7 @@ MCP2515::ERROR MCP2515::setBitrate(const CAN_SPEED canSpeed) {
   return setBitrate(canSpeed, MCP_16MHZ);
 }
 
-MCP2515::ERROR MCP2515::setBitrate(const CAN_SPEED canSpeed, CAN_CLOCK canClock) {
-  ERROR error = setConfigMode();
-  if (error != ERROR_OK) {
-      return error;
-  }
-
+bool MCP2515::getBitrateConfig(const CAN_SPEED canSpeed, const CAN_CLOCK canClock, uint8_t *cfg) {
   uint8_t set, cfg1, cfg2, cfg3;
   set = 1;
 
@@ -495,13 +431,33 @@ MCP2515::ERROR MCP2515::setBitrate(const CAN_SPEED canSpeed, CAN_CLOCK canClock)
   }
 
   if (set) {
-    setRegister(MCP_CNF1, cfg1);
-    setRegister(MCP_CNF2, cfg2);
-    setRegister(MCP_CNF3, cfg3);
-    return ERROR_OK;
-  } else {
+    cfg[0] = cfg1;
+    cfg[1] = cfg2;
+    cfg[2] = cfg3;
+  }
+  return set;
+}
+
+bool MCP2515::isBitrateSupported(const CAN_SPEED canSpeed, const CAN_CLOCK canClock) {
+  uint8_t cfg[3];
+  return getBitrateConfig(canSpeed, canClock, cfg);
+}
+
+MCP2515::ERROR MCP2515::setBitrate(const CAN_SPEED canSpeed, CAN_CLOCK canClock) {
+  uint8_t cfg[3];
+  if (!getBitrateConfig(canSpeed, canClock, cfg)) {
     return ERROR_FAIL;
   }
+
+  ERROR error = setConfigMode();
+  if (error != ERROR_OK) {
+      return error;
+  }
+
+  setRegister(MCP_CNF1, cfg[0]);
+  setRegister(MCP_CNF2, cfg[1]);
+  setRegister(MCP_CNF3, cfg[2]);
+  return ERROR_OK;
 }
 
 MCP2515::ERROR MCP2515::setClkOut(const CAN_CLKOUT divisor) {
@@ -592,6 +548,21 @@ MCP2515::ERROR MCP2515::setFilter(const RXF num, const bool ext, const uint32_t
   return ERROR_OK;
 }
 
+MCP2515::ERROR MCP2515::setFilters(const bool ext, const uint32_t ulData) {
+  // set both masks and all six filters to accept only the given CAN-ID in both
+  // receive buffers
+  setFilterMask(MASK0, ext, ext ? CAN_EFF_MASK : CAN_SFF_MASK);
+  setFilterMask(MASK1, ext, ext ? CAN_EFF_MASK : CAN_SFF_MASK);
+  for (uint8_t i = RXF0; i <= RXF5; i++) {
+    ERROR res = setFilter((RXF)i, ext, ulData);
+    if (res != ERROR_OK) {
+      return res;
+    }
+  }
+
+  return ERROR_OK;
+}
+
 MCP2515::ERROR MCP2515::sendMessage(const struct can_frame *frame) {
   if (frame->can_dlc > CAN_MAX_DLEN) {
     return ERROR_FAILTX;
@@ -599,6 +570,17 @@ MCP2515::ERROR MCP2515::sendMessage(const struct can_frame *frame) {
 
   const struct TXBn_REGS *txbuf = &TXB[0];// bootloader only uses tx0
 
+  #ifdef CAN_ONE_SHOT
+    // Don't try to transmit while in bus-off state. The MCP2515 recovers by
+    // itself after 128 occurrences of 11 recessive bits, which must not be
+    // shortened by resetting the error counters, so a node with a fault does
+    // not disturb the bus again and again. The flash application will resend
+    // its last command.
+    if (getErrorFlags() & EFLG_TXBO) {
+      return ERROR_FAILTX;
+    }
+  #endif
+
   uint8_t data[13];
 
   bool ext = (frame->can_id & CAN_EFF_FLAG);
@@ -630,20 +612,59 @@ MCP2515::ERROR MCP2515::sendMessage(const struct can_frame *frame) {
     modifyRegister(txbuf->CTRL, TXB_TXREQ, 0);
     return ERROR_FAILTX;
   }
+
+  #ifdef CAN_ONE_SHOT
+    // In one-shot mode TXREQ is cleared after a single attempt, so the loop
+    // above takes at most the time of one frame and the result must be checked.
+    // A lost message must be handled by the flash application by resending its
+    // last command.
+    if (ctrl & (TXB_ABTF | TXB_MLOA | TXB_TXERR)) {
+      return ERROR_FAILTX;
+    }
+  #endif
+
   return ERROR_OK;
 }
 
 MCP2515::ERROR MCP2515::readMessage(struct can_frame *frame) {
+  #ifdef MCP_INT
+    // INT pin is low while a message is in rx0 or rx1
+    if (MCP_INT_PIN & (1 << MCP_INT)) {
+      return ERROR_NOMSG;
+    }
+  #endif
+
+  // rx0 is read first, since rx1 only gets a message if rx0 was full
   uint8_t stat = getStatus();
-  if ( ! (stat & STAT_RX0IF)) {
+  INSTRUCTION instruction;
+  if (stat & STAT_RX0IF) {
+    instruction = INSTRUCTION_READ_RX0;
+  } else if (stat & STAT_RX1IF) {
+    instruction = INSTRUCTION_READ_RX1;
+  } else {
     return ERROR_NOMSG;
   }
 
-  const struct RXBn_REGS *rxb = &RXB[0];// bootloader only uses rx0
-
+  // Read the whole message in one SPI transaction using the read rx buffer
+  // instruction, which also clears the RXnIF flag when CS is released.
   uint8_t tbufdata[5];
 
-  readRegisters(rxb->SIDH, tbufdata, 5);
+  spiStart();
+  spiTransfer(instruction);
+  for (uint8_t i = 0; i < 5; i++) {
+    tbufdata[i] = spiTransfer(0x00);
+  }
+
+  uint8_t dlc = (tbufdata[MCP_DLC] & DLC_MASK);
+  if (dlc > CAN_MAX_DLEN) {
+    spiEnd();
+    return ERROR_FAIL;
+  }
+
+  for (uint8_t i = 0; i < dlc; i++) {
+    frame->data[i] = spiTransfer(0x00);
+  }
+  spiEnd();
 
   uint32_t id = (tbufdata[MCP_SIDH]<<3) + (tbufdata[MCP_SIDL]>>5);
 
@@ -652,25 +673,17 @@ MCP2515::ERROR MCP2515::readMessage(struct can_frame *frame) {
     id = (id<<8) + tbufdata[MCP_EID8];
     id = (id<<8) + tbufdata[MCP_EID0];
     id |= CAN_EFF_FLAG;
-  }
-
-  uint8_t dlc = (tbufdata[MCP_DLC] & DLC_MASK);
-  if (dlc > CAN_MAX_DLEN) {
-    return ERROR_FAIL;
-  }
 
-  uint8_t ctrl = readRegister(rxb->CTRL);
-  if (ctrl & RXBnCTRL_RTR) {
+    if (tbufdata[MCP_DLC] & RTR_MASK) {
+      id |= CAN_RTR_FLAG;
+    }
+  } else if (tbufdata[MCP_SIDL] & RXBnSIDL_SRR) {
     id |= CAN_RTR_FLAG;
   }
 
   frame->can_id = id;
   frame->can_dlc = dlc;
 
-  readRegisters(rxb->DATA, frame->data, dlc);
-
-  modifyRegister(MCP_CANINTF, rxb->CANINTF_RXnIF, 0);
-
   return ERROR_OK;
 }
 
@@ -11,10 +11,13 @@
 #ifndef _MCP2515_H_
 #define _MCP2515_H_
 
-#include <Arduino.h>
+#include <inttypes.h>
+#include <string.h>
+#include <avr/io.h>
 #include "can.h"
 #include "config.h"
 #include "controllers.h"
+#include "spi.h"
 
 /*
  *  Speed 8M
@@ -181,31 +184,6 @@
 #define MCP_20MHz_33k3BPS_CFG2 (0xFF)
 #define MCP_20MHz_33k3BPS_CFG3 (0x87)
 
-enum CAN_CLOCK {
-    MCP_20MHZ,
-    MCP_16MHZ,
-    MCP_8MHZ
-};
-
-enum CAN_SPEED {
-    CAN_5KBPS,
-    CAN_10KBPS,
-    CAN_20KBPS,
-    CAN_31K25BPS,
-    CAN_33KBPS,
-    CAN_40KBPS,
-    CAN_50KBPS,
-    CAN_80KBPS,
-    CAN_83K3BPS,
-    CAN_95KBPS,
-    CAN_100KBPS,
-    CAN_125KBPS,
-    CAN_200KBPS,
-    CAN_250KBPS,
-    CAN_500KBPS,
-    CAN_1000KBPS
-};
-
 enum CAN_CLKOUT {
     CLKOUT_DISABLE = -1,
     CLKOUT_DIV1 = 0x0,
@@ -292,6 +270,15 @@ class MCP2515
         static const uint8_t CANSTAT_OPMOD = 0xE0;
         static const uint8_t CANSTAT_ICOD = 0x0E;
 
+        /**
+         * Number of CANSTAT reads to wait for a mode change.
+         * The SPI clock is 1 MHz at most, so each read takes at least 24 µs and
+         * the timeout is at least 24 ms. Timer 1 is not used, since the driver
+         * is also called by the main application (CAN_SERVICE), which may stop
+         * or reconfigure the timer.
+         */
+        static const uint16_t MODE_TIMEOUT = 1000;
+
         static const uint8_t CNF3_SOF = 0x80;
 
         static const uint8_t TXB_EXIDE_MASK = 0x08;
@@ -303,6 +290,7 @@ class MCP2515
         static const uint8_t RXBnCTRL_RXM_STDEXT = 0x00;
         static const uint8_t RXBnCTRL_RXM_MASK   = 0x60;
         static const uint8_t RXBnCTRL_RTR        = 0x08;
+        static const uint8_t RXBnSIDL_SRR        = 0x10;
         static const uint8_t RXB0CTRL_BUKT       = 0x04;
         static const uint8_t RXB0CTRL_FILHIT_MASK = 0x03;
         static const uint8_t RXB1CTRL_FILHIT_MASK = 0x07;
@@ -456,10 +444,6 @@ class MCP2515
 
     private:
 
-        void startSPI();
-        void endSPI();
-        uint8_t transfer(uint8_t data);
-
         ERROR setMode(const CANCTRL_REQOP_MODE mode);
 
         uint8_t readRegister(const REGISTER reg);
@@ -469,6 +453,7 @@ class MCP2515
         void modifyRegister(const REGISTER reg, const uint8_t mask, const uint8_t data);
 
         void prepareId(uint8_t *buffer, const bool ext, const uint32_t id);
+        static bool getBitrateConfig(const CAN_SPEED canSpeed, const CAN_CLOCK canClock, uint8_t *cfg);
 
     public:
         MCP2515();
@@ -482,8 +467,10 @@ class MCP2515
         ERROR setClkOut(const CAN_CLKOUT divisor);
         ERROR setBitrate(const CAN_SPEED canSpeed);
         ERROR setBitrate(const CAN_SPEED canSpeed, const CAN_CLOCK canClock);
+        static bool isBitrateSupported(const CAN_SPEED canSpeed, const CAN_CLOCK canClock);
         ERROR setFilterMask(const MASK num, const bool ext, const uint32_t ulData);
         ERROR setFilter(const RXF num, const bool ext, const uint32_t ulData);
+        ERROR setFilters(const bool ext, const uint32_t ulData);
         ERROR sendMessage(const struct can_frame *frame);
         ERROR readMessage(struct can_frame *frame);
         bool checkReceive(void);
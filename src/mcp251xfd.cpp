@@ -0,0 +1,381 @@
+/*
+ * MCP2517FD / MCP2518FD CAN FD interface library
+ *
+ * Minimal driver for MCP-CAN-Boot providing the same interface as the MCP2515
+ * driver. Only the transmit queue (TXQ) and one receive FIFO are used.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "config.h"
+
+#ifdef CAN_FD
+
+#include "mcp251xfd.h"
+
+/**
+ * Bitrates of the CAN_SPEED enum in bit/s.
+ */
+static const uint32_t bitrates[] PROGMEM = {
+  5000, 10000, 20000, 31250, 33333, 40000, 50000, 80000,
+  83333, 95000, 100000, 125000, 200000, 250000, 500000, 1000000
+};
+
+/**
+ * Payload lengths of the CAN FD DLCs 9 to 15.
+ */
+static const uint8_t dlcLengths[] PROGMEM = {
+  12, 16, 20, 24, 32, 48, 64
+};
+
+/**
+ * Calculate the bit timing with a sample point of 80 %.
+ * The values are stored in the byte order of the NBTCFG and DBTCFG registers
+ * (SJW, TSEG2, TSEG1, BRP), each minus 1 as required by the registers.
+ * @param buffer Buffer for the four register bytes.
+ * @param clocksPerBit Number of SYSCLK cycles per bit.
+ * @param maxTq Maximum number of time quanta per bit.
+ */
+static void calcBitTiming (uint8_t *buffer, uint16_t clocksPerBit, uint8_t maxTq) {
+  uint8_t brp = (clocksPerBit + maxTq - 1) / maxTq;
+  uint8_t tq = clocksPerBit / brp;
+  uint8_t tseg2 = tq / 5;
+
+  buffer[0] = tseg2 - 1; // SJW
+  buffer[1] = tseg2 - 1;
+  buffer[2] = tq - tseg2 - 2; // one tq is used by the sync segment
+  buffer[3] = brp - 1;
+}
+
+MCP251XFD::MCP251XFD () { }
+
+void MCP251XFD::init () {
+  spiInit();
+}
+
+MCP251XFD::ERROR MCP251XFD::reset(void) {
+  spiStart();
+  spiTransfer(INSTRUCTION_RESET);
+  spiTransfer(0x00);
+  spiEnd();
+
+  // wait until the oscillator is ready and the controller is in configuration
+  // mode after the reset
+  uint16_t startTime = timerTicks();
+  while (!(readRegister(MCP_OSC + 1) & OSC_OSCRDY)
+    || (readRegister(MCP_C1CON + 2) >> C1CON_OPMOD_POS) != OPMODE_CONFIG) {
+    if (timerElapsed(startTime) > MS_TO_TICKS(10)) {
+      return ERROR_FAIL;
+    }
+  }
+
+  #ifdef CAN_ONE_SHOT
+    // try to transmit each message only once
+    // (TXAT of the TXQ is 0 and used because of RTXAT)
+    setRegister(MCP_C1TXQCON + 2, 0x00);
+    setRegister(MCP_C1CON + 2, C1CON_TXQEN | C1CON_RTXAT);
+  #else
+    // enable the TXQ and don't store transmitted messages in the TEF
+    setRegister(MCP_C1CON + 2, C1CON_TXQEN);
+  #endif
+
+  // TXQ for one message and FIFO 1 for received messages, both with 64 bytes
+  // payload to support all CAN FD frames
+  setRegister(MCP_C1TXQCON + 3, FIFOCON_PLSIZE64);
+  setRegister(MCP_C1FIFOCON1, FIFOCON_TFNRFNIE);
+  setRegister(MCP_C1FIFOCON1 + 3, FIFOCON_PLSIZE64 | (RX_FIFO_SIZE - 1));
+
+  // the INT pin will only indicate a message in the receive FIFO
+  setRegister(MCP_C1INT + 2, C1INT_RXIE);
+
+  // accept all messages in FIFO 1 until the filters are set
+  uint8_t tbufdata[8];
+  memset(tbufdata, 0x00, 8);
+  setRegisters(MCP_C1FLTOBJ0, tbufdata, 8);
+  setRegister(MCP_C1FLTCON0, FLTCON_FLTEN | 1);
+
+  return ERROR_OK;
+}
+
+void MCP251XFD::startInstruction(const uint8_t instruction, const uint16_t reg) {
+  spiStart();
+  spiTransfer(instruction | (reg >> 8));
+  spiTransfer(reg & 0xFF);
+}
+
+uint8_t MCP251XFD::readRegister(const uint16_t reg) {
+  startInstruction(INSTRUCTION_READ, reg);
+  uint8_t ret = spiTransfer(0x00);
+  spiEnd();
+
+  return ret;
+}
+
+void MCP251XFD::readRegisters(const uint16_t reg, uint8_t values[], const uint8_t n) {
+  startInstruction(INSTRUCTION_READ, reg);
+  // auto-increment of the address
+  for (uint8_t i=0; i<n; i++) {
+    values[i] = spiTransfer(0x00);
+  }
+  spiEnd();
+}
+
+void MCP251XFD::setRegister(const uint16_t reg, const uint8_t value) {
+  startInstruction(INSTRUCTION_WRITE, reg);
+  spiTransfer(value);
+  spiEnd();
+}
+
+void MCP251XFD::setRegisters(const uint16_t reg, const uint8_t values[], const uint8_t n) {
+  startInstruction(INSTRUCTION_WRITE, reg);
+  for (uint8_t i=0; i<n; i++) {
+    spiTransfer(values[i]);
+  }
+  spiEnd();
+}
+
+MCP251XFD::ERROR MCP251XFD::setConfigMode() {
+  return setMode(OPMODE_CONFIG);
+}
+
+MCP251XFD::ERROR MCP251XFD::setListenOnlyMode() {
+  return setMode(OPMODE_LISTENONLY);
+}
+
+MCP251XFD::ERROR MCP251XFD::setNormalMode() {
+  return setMode(OPMODE_NORMAL_FD);
+}
+
+MCP251XFD::ERROR MCP251XFD::setMode(const OPMODE mode) {
+  setRegister(MCP_C1CON + 3, mode);
+
+  uint16_t startTime = timerTicks();
+  while (timerElapsed(startTime) < MS_TO_TICKS(10)) {
+    if ((readRegister(MCP_C1CON + 2) >> C1CON_OPMOD_POS) == mode) {
+      return ERROR_OK;
+    }
+  }
+
+  return ERROR_FAIL;
+}
+
+bool MCP251XFD::isBitrateSupported(const CAN_SPEED canSpeed, const CAN_CLOCK canClock) {
+  // the bit timing is calculated for any bitrate of the list
+  return (canClock == MCP_40MHZ || canClock == MCP_20MHZ) && canSpeed <= CAN_1000KBPS;
+}
+
+MCP251XFD::ERROR MCP251XFD::setBitrate(const CAN_SPEED canSpeed, CAN_CLOCK canClock) {
+  ERROR error = setConfigMode();
+  if (error != ERROR_OK) {
+    return error;
+  }
+
+  uint32_t clock;
+  switch (canClock) {
+    case (MCP_40MHZ): clock = 40000000UL; break;
+    case (MCP_20MHZ): clock = 20000000UL; break;
+    default:
+      return ERROR_FAIL;
+  }
+
+  uint8_t cfg[4];
+
+  // nominal bitrate with up to 255 tq per bit
+  calcBitTiming(cfg, clock / pgm_read_dword(&bitrates[canSpeed]), 255);
+  setRegisters(MCP_C1NBTCFG, cfg, 4);
+
+  // data bitrate with up to 40 tq per bit (TSEG1 is limited to 32 tq)
+  calcBitTiming(cfg, clock / (CAN_FD_DATA_KBPS * 1000UL), 40);
+  setRegisters(MCP_C1DBTCFG, cfg, 4);
+
+  // automatic transmitter delay compensation with the offset at the sample
+  // point, which is only needed and possible for a data BRP of 1
+  uint8_t tdc[3] = { 0x00, 0x00, 0x00 };
+  if (cfg[3] == 0) {
+    tdc[1] = cfg[2] + 1; // TDCO
+    tdc[2] = 0x02; // TDCMOD auto
+  }
+  setRegisters(MCP_C1TDC, tdc, 3);
+
+  return ERROR_OK;
+}
+
+void MCP251XFD::prepareId(uint8_t *buffer, const bool ext, const uint32_t id) {
+  // SID in bits 0 to 10 and EID in bits 11 to 28
+  uint32_t obj;
+  if (ext) {
+    obj = ((id >> 18) & CAN_SFF_MASK) | ((id & 0x3FFFFUL) << 11);
+  } else {
+    obj = id & CAN_SFF_MASK;
+  }
+
+  buffer[0] = (uint8_t) obj;
+  buffer[1] = (uint8_t) (obj >> 8);
+  buffer[2] = (uint8_t) (obj >> 16);
+  buffer[3] = (uint8_t) (obj >> 24);
+}
+
+MCP251XFD::ERROR MCP251XFD::setFilters(const bool ext, const uint32_t ulData) {
+  ERROR res = setConfigMode();
+  if (res != ERROR_OK) {
+    return res;
+  }
+
+  // filter object and mask of filter 0, with the frame format bit included in
+  // the mask to match only the given frame format
+  uint8_t tbufdata[8];
+  prepareId(tbufdata, ext, ulData);
+  prepareId(&tbufdata[4], ext, ext ? CAN_EFF_MASK : CAN_SFF_MASK);
+  if (ext) {
+    tbufdata[3] |= FLTOBJ_EXIDE;
+  }
+  tbufdata[7] |= FLTOBJ_EXIDE;
+
+  // the filter must be disabled to modify it
+  setRegister(MCP_C1FLTCON0, 0x00);
+  setRegisters(MCP_C1FLTOBJ0, tbufdata, 8);
+
+  // enable filter 0 and store matching messages in FIFO 1
+  setRegister(MCP_C1FLTCON0, FLTCON_FLTEN | 1);
+
+  return ERROR_OK;
+}
+
+MCP251XFD::ERROR MCP251XFD::sendMessage(const struct can_frame *frame) {
+  if (frame->can_dlc > CANFD_MAX_DLEN) {
+    return ERROR_FAILTX;
+  }
+
+  #ifdef CAN_ONE_SHOT
+    // Don't try to transmit while in bus-off state, the controller recovers
+    // by itself after 128 occurrences of 11 recessive bits (like the MCP2515).
+    if (readRegister(MCP_C1TREC + 2) & C1TREC_TXBO) {
+      return ERROR_FAILTX;
+    }
+  #endif
+
+  bool ext = (frame->can_id & CAN_EFF_FLAG);
+  bool rtr = (frame->can_id & CAN_RTR_FLAG);
+  uint32_t id = (frame->can_id & (ext ? CAN_EFF_MASK : CAN_SFF_MASK));
+
+  // get the DLC, rounding the length up to the next valid CAN FD length
+  uint8_t len = frame->can_dlc;
+  uint8_t dlc = len;
+  if (len > CAN_MAX_DLEN) {
+    dlc = 9;
+    while (pgm_read_byte(&dlcLengths[dlc - 9]) < len) {
+      dlc++;
+    }
+    len = pgm_read_byte(&dlcLengths[dlc - 9]);
+  }
+
+  // message object header T0 and T1
+  uint8_t header[8];
+  prepareId(header, ext, id);
+  header[4] = dlc;
+  if (ext) {
+    header[4] |= OBJ_IDE;
+  }
+  if (rtr) {
+    header[4] |= OBJ_RTR;
+  }
+  if (len > CAN_MAX_DLEN) {
+    // use CAN FD frames with bitrate switching only if needed
+    header[4] |= OBJ_FDF | OBJ_BRS;
+  }
+  header[5] = 0;
+  header[6] = 0;
+  header[7] = 0;
+
+  // write the message object into the RAM at the address of the next TXQ
+  // message, padded to a multiple of 4 bytes since the RAM is written word-wise
+  uint8_t ua[2];
+  readRegisters(MCP_C1TXQUA, ua, 2);
+
+  startInstruction(INSTRUCTION_WRITE, MCP_RAM + (ua[0] | (ua[1] << 8)));
+  for (uint8_t i = 0; i < 8; i++) {
+    spiTransfer(header[i]);
+  }
+  for (uint8_t i = 0; i < ((len + 3) & ~3); i++) {
+    spiTransfer(i < frame->can_dlc ? frame->data[i] : 0x00);
+  }
+  spiEnd();
+
+  // increment the TXQ head and request the transmission
+  setRegister(MCP_C1TXQCON + 1, FIFOCON_UINC | FIFOCON_TXREQ);
+
+  // wait for transmission to complete or timeout
+  uint8_t timeout = 255;
+  while ((readRegister(MCP_C1TXQCON + 1) & FIFOCON_TXREQ) && (--timeout != 0));
+
+  if (timeout == 0) {
+    // upon timeout, abort tx request and return error
+    setRegister(MCP_C1TXQCON + 1, 0x00);
+    return ERROR_FAILTX;
+  }
+
+  #ifdef CAN_ONE_SHOT
+    // check the result of the single attempt
+    if (readRegister(MCP_C1TXQSTA) & (TXQSTA_TXABT | TXQSTA_TXLARB | TXQSTA_TXERR)) {
+      return ERROR_FAILTX;
+    }
+  #endif
+
+  return ERROR_OK;
+}
+
+MCP251XFD::ERROR MCP251XFD::readMessage(struct can_frame *frame) {
+  #ifdef MCP_INT
+    // INT pin is low while a message is in the receive FIFO
+    if (MCP_INT_PIN & (1 << MCP_INT)) {
+      return ERROR_NOMSG;
+    }
+  #else
+    if (!(readRegister(MCP_C1FIFOSTA1) & FIFOSTA_TFNRFNIF)) {
+      return ERROR_NOMSG;
+    }
+  #endif
+
+  // read the whole message object in one SPI transaction
+  uint8_t ua[2];
+  readRegisters(MCP_C1FIFOUA1, ua, 2);
+
+  uint8_t header[8];
+  startInstruction(INSTRUCTION_READ, MCP_RAM + (ua[0] | (ua[1] << 8)));
+  for (uint8_t i = 0; i < 8; i++) {
+    header[i] = spiTransfer(0x00);
+  }
+
+  uint8_t len = header[4] & 0x0F;
+  if (len > CAN_MAX_DLEN) {
+    len = (header[4] & OBJ_FDF) ? pgm_read_byte(&dlcLengths[len - 9]) : CAN_MAX_DLEN;
+  }
+
+  for (uint8_t i = 0; i < len; i++) {
+    frame->data[i] = spiTransfer(0x00);
+  }
+  spiEnd();
+
+  // release the message object
+  setRegister(MCP_C1FIFOCON1 + 1, FIFOCON_UINC);
+
+  uint32_t obj = header[0] | ((uint32_t)header[1] << 8) | ((uint32_t)header[2] << 16) | ((uint32_t)header[3] << 24);
+  uint32_t id = obj & CAN_SFF_MASK;
+
+  if (header[4] & OBJ_IDE) {
+    id = (id << 18) | ((obj >> 11) & 0x3FFFFUL);
+    id |= CAN_EFF_FLAG;
+  }
+
+  if (header[4] & OBJ_RTR) {
+    id |= CAN_RTR_FLAG;
+  }
+
+  frame->can_id = id;
+  frame->can_dlc = len;
+
+  return ERROR_OK;
+}
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ * MCP2517FD / MCP2518FD CAN FD interface library
+ *
+ * Minimal driver for MCP-CAN-Boot providing the same interface as the MCP2515
+ * driver. Only the transmit queue (TXQ) and one receive FIFO are used.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef _MCP251XFD_H_
+#define _MCP251XFD_H_
+
+#include <inttypes.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "can.h"
+#include "config.h"
+#include "controllers.h"
+#include "timer.h"
+#include "spi.h"
+
+class MCP251XFD
+{
+    public:
+        enum ERROR {
+            ERROR_OK        = 0,
+            ERROR_FAIL      = 1,
+            ERROR_ALLTXBUSY = 2,
+            ERROR_FAILINIT  = 3,
+            ERROR_FAILTX    = 4,
+            ERROR_NOMSG     = 5
+        };
+
+    private:
+        /*
+         * SPI instructions (upper nibble of the first byte, followed by a 12 bit
+         * address)
+         */
+        enum /*class*/ INSTRUCTION : uint8_t {
+            INSTRUCTION_RESET = 0x00,
+            INSTRUCTION_WRITE = 0x20,
+            INSTRUCTION_READ  = 0x30
+        };
+
+        /*
+         * Register addresses
+         * All registers are 32 bit wide in little endian byte order, so the
+         * address of a single byte is the register address plus the byte number.
+         */
+        enum /*class*/ REGISTER : uint16_t {
+            MCP_C1CON      = 0x000,
+            MCP_C1NBTCFG   = 0x004,
+            MCP_C1DBTCFG   = 0x008,
+            MCP_C1TDC      = 0x00C,
+            MCP_C1INT      = 0x01C,
+            MCP_C1TREC     = 0x034,
+            MCP_C1TXQCON   = 0x050,
+            MCP_C1TXQSTA   = 0x054,
+            MCP_C1TXQUA    = 0x058,
+            MCP_C1FIFOCON1 = 0x05C,
+            MCP_C1FIFOSTA1 = 0x060,
+            MCP_C1FIFOUA1  = 0x064,
+            MCP_C1FLTCON0  = 0x1D0,
+            MCP_C1FLTOBJ0  = 0x1F0,
+            MCP_C1MASK0    = 0x1F4,
+            MCP_RAM        = 0x400,
+            MCP_OSC        = 0xE00
+        };
+
+        /*
+         * Operation modes (REQOP in byte 3 and OPMOD in byte 2 of C1CON)
+         */
+        enum /*class*/ OPMODE : uint8_t {
+            OPMODE_NORMAL_FD  = 0x00,
+            OPMODE_LISTENONLY = 0x03,
+            OPMODE_CONFIG     = 0x04
+        };
+
+        /*
+         * Bits in the single bytes of the registers
+         */
+        enum /*class*/ BITS : uint8_t {
+            C1CON_RTXAT      = 0x01, // byte 2
+            C1CON_TXQEN      = 0x10, // byte 2
+            C1CON_OPMOD_POS  = 5,    // byte 2
+            C1CON_ABAT       = 0x08, // byte 3
+            C1INT_RXIE       = 0x02, // byte 2
+            C1TREC_TXBP      = 0x10, // byte 2
+            C1TREC_TXBO      = 0x20, // byte 2
+            FIFOCON_TFNRFNIE = 0x01, // byte 0
+            FIFOCON_UINC     = 0x01, // byte 1
+            FIFOCON_TXREQ    = 0x02, // byte 1
+            FIFOCON_PLSIZE64 = 0xE0, // byte 3
+            FIFOSTA_TFNRFNIF = 0x01, // byte 0
+            TXQSTA_TXERR     = 0x20, // byte 0
+            TXQSTA_TXLARB    = 0x40, // byte 0
+            TXQSTA_TXABT     = 0x80, // byte 0
+            FLTCON_FLTEN     = 0x80, // byte 0
+            FLTOBJ_EXIDE     = 0x40, // byte 3, also MIDE of the mask
+            OSC_OSCRDY       = 0x04, // byte 1
+            OBJ_IDE          = 0x10, // byte 0 of T1/R1
+            OBJ_RTR          = 0x20, // byte 0 of T1/R1
+            OBJ_BRS          = 0x40, // byte 0 of T1/R1
+            OBJ_FDF          = 0x80  // byte 0 of T1/R1
+        };
+
+        /**
+         * Number of messages in the receive FIFO.
+         */
+        static const uint8_t RX_FIFO_SIZE = 8;
+
+        ERROR setMode(const OPMODE mode);
+
+        uint8_t readRegister(const uint16_t reg);
+        void readRegisters(const uint16_t reg, uint8_t values[], const uint8_t n);
+        void setRegister(const uint16_t reg, const uint8_t value);
+        void setRegisters(const uint16_t reg, const uint8_t values[], const uint8_t n);
+        void startInstruction(const uint8_t instruction, const uint16_t reg);
+
+        void prepareId(uint8_t *buffer, const bool ext, const uint32_t id);
+
+    public:
+        MCP251XFD();
+        void init();
+        ERROR reset(void);
+        ERROR setConfigMode();
+        ERROR setListenOnlyMode();
+        ERROR setNormalMode();
+        ERROR setBitrate(const CAN_SPEED canSpeed, const CAN_CLOCK canClock);
+        static bool isBitrateSupported(const CAN_SPEED canSpeed, const CAN_CLOCK canClock);
+        ERROR setFilters(const bool ext, const uint32_t ulData);
+        ERROR sendMessage(const struct can_frame *frame);
+        ERROR readMessage(struct can_frame *frame);
+};
+
+#endif
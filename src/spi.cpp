@@ -0,0 +1,72 @@
+/*
+ * MCP-CAN-Boot
+ *
+ * CAN bus bootloader for AVR microcontrollers attached to an MCP2515 CAN controller.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ *
+ * SPI communication with the CAN controller.
+ */
+
+#include "spi.h"
+
+void spiInit () {
+
+  // set spi pins as output
+  #if !defined(MCP_CS) || defined(SET_SPI_SS_OUTPUT)
+    SPI_DDR |= ((1<<SPI_SS) | (1<<SPI_MOSI) | (1<<SPI_SCK));
+  #else
+    SPI_DDR |= ((1<<SPI_MOSI) | (1<<SPI_SCK));
+  #endif
+
+  // set custom CS pin as output if used
+  #ifdef MCP_CS
+    MCP_CS_DDR |= (1 << MCP_CS);
+
+    // set SPI_SS to defined level if used
+    #ifdef SET_SPI_SS_OUTPUT
+      #if SET_SPI_SS_OUTPUT == HIGH
+        SPI_PORT |= (1 << SPI_SS);
+      #else
+        SPI_PORT &= ~(1 << SPI_SS);
+      #endif
+    #endif
+  #endif
+
+  // setup spi
+  #if F_CPU < 4000000L
+    // < 4MHz ... SCK frequency = oscillator frequency / 4
+    SPCR = ((1<<SPE) | (1<<MSTR) | (1<<CPOL) | (1<<CPHA));
+  #elif F_CPU < 8000000L
+    // < 8MHz ... SCK frequency = oscillator frequency / 8
+    SPCR = ((1<<SPE) | (1<<MSTR) | (1<<CPOL) | (1<<CPHA) | (1<<SPR0));
+    SPSR = (1<<SPI2X);
+  #elif F_CPU < 16000000L
+    // < 16MHz ... SCK frequency = oscillator frequency / 16
+    SPCR = ((1<<SPE) | (1<<MSTR) | (1<<CPOL) | (1<<CPHA) | (1<<SPR0));
+  #else
+    // >= 16MHz ... SCK frequency = oscillator frequency / 32
+    SPCR = ((1<<SPE) | (1<<MSTR) | (1<<CPOL) | (1<<CPHA) | (1<<SPR1));
+    SPSR = (1<<SPI2X);
+  #endif
+
+  #ifdef MCP_CS
+    MCP_CS_PORT |= (1 << MCP_CS); // set custom CS high
+  #else
+    SPI_PORT |= (1 << SPI_SS); // set SS high
+  #endif
+}
+
+uint8_t spiTransfer (uint8_t data) {
+  SPDR = data;
+  /*
+   * The following NOP introduces a small delay that can prevent the wait
+   * loop form iterating when running at the maximum speed. This gives
+   * about 10% more speed, even if it seems counter-intuitive. At lower
+   * speeds it is unnoticed.
+   */
+  asm volatile("nop");
+  while (!(SPSR & (1<<SPIF))) ; // wait
+  return SPDR;
+}
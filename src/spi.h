@@ -0,0 +1,52 @@
+/*
+ * MCP-CAN-Boot
+ *
+ * CAN bus bootloader for AVR microcontrollers attached to an MCP2515 CAN controller.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ *
+ * SPI communication with the CAN controller.
+ */
+
+#ifndef	__MCP_CAN_BOOT_SPI_H__
+#define	__MCP_CAN_BOOT_SPI_H__
+
+#include <inttypes.h>
+#include <avr/io.h>
+
+#include "config.h"
+#include "controllers.h"
+
+// levels for SET_SPI_SS_OUTPUT
+#ifndef HIGH
+  #define HIGH 0x1
+  #define LOW  0x0
+#endif
+
+/**
+ * Select the CAN controller.
+ */
+static inline void spiStart () {
+  #ifdef MCP_CS
+    MCP_CS_PORT &= ~(1 << MCP_CS); // set custom CS low
+  #else
+    SPI_PORT &= ~(1 << SPI_SS); // set SS low
+  #endif
+}
+
+/**
+ * Deselect the CAN controller.
+ */
+static inline void spiEnd () {
+  #ifdef MCP_CS
+    MCP_CS_PORT |= (1 << MCP_CS); // set custom CS high
+  #else
+    SPI_PORT |= (1 << SPI_SS); // set SS high
+  #endif
+}
+
+void spiInit ();
+uint8_t spiTransfer (uint8_t data);
+
+#endif
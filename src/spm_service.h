@@ -0,0 +1,90 @@
+/*
+ * MCP-CAN-Boot
+ *
+ * CAN bus bootloader for AVR microcontrollers attached to an MCP2515 CAN controller.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ *
+ * SPM service of the bootloader, callable by the main application.
+ *
+ * This file may be copied into the main application to write the flash
+ * without restarting into the bootloader:
+ * \code
+ *  if (spmServiceVersion() == SPM_SERVICE_VERSION) {
+ *    spmServiceCall(SPM_SERVICE_PAGE_ERASE, addr, 0);
+ *    for (uint16_t i = 0; i < SPM_PAGESIZE; i += 2) {
+ *      spmServiceCall(SPM_SERVICE_PAGE_FILL, addr + i, data[i] | (data[i + 1] << 8));
+ *    }
+ *    spmServiceCall(SPM_SERVICE_PAGE_WRITE, addr, 0);
+ *  }
+ * \endcode
+ */
+
+#ifndef	__MCP_CAN_BOOT_SPM_SERVICE_H__
+#define	__MCP_CAN_BOOT_SPM_SERVICE_H__
+
+#include <inttypes.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+
+/**
+ * Version of the SPM service interface.
+ * Incremented on incompatible changes of the interface.
+ */
+#define SPM_SERVICE_VERSION 1
+
+/*
+ * The SPM service table is located at the very end of the flash:
+ *   FLASHEND - 5: version of the interface (word)
+ *   FLASHEND - 3: jump to the SPM service function
+ * The bootloader must be linked with the section .spm_service starting at
+ * SPM_SERVICE_TABLE.
+ */
+#define SPM_SERVICE_TABLE ((uint32_t)FLASHEND + 1 - 6)
+#define SPM_SERVICE_ENTRY ((uint32_t)FLASHEND + 1 - 4)
+
+/*
+ * SPM service commands
+ */
+#define SPM_SERVICE_PAGE_FILL  0x01 // fill one word into the temporary page buffer
+#define SPM_SERVICE_PAGE_ERASE 0x03 // erase the page and reenable the RWW section
+#define SPM_SERVICE_PAGE_WRITE 0x05 // write the temporary page buffer to the page and reenable the RWW section
+
+/**
+ * Function type of the SPM service.
+ * @param command One of the SPM_SERVICE_* commands.
+ * @param addr    Byte address in the flash.
+ * @param data    The little-endian word to fill (SPM_SERVICE_PAGE_FILL only).
+ */
+typedef void (*spm_service_t)(uint8_t command, uint32_t addr, uint16_t data);
+
+/**
+ * Read the version of the SPM service interface provided by the bootloader.
+ * Returns 0xFFFF if the bootloader has no SPM service.
+ */
+static inline uint16_t spmServiceVersion (void) {
+  #if FLASHEND > 0xFFFF
+    return pgm_read_word_far(SPM_SERVICE_TABLE);
+  #else
+    return pgm_read_word(SPM_SERVICE_TABLE);
+  #endif
+}
+
+/**
+ * Call the SPM service of the bootloader.
+ * On MCUs with more than 128k of flash the EIND register is set temporarily
+ * to reach the bootloader section.
+ */
+static inline void spmServiceCall (uint8_t command, uint32_t addr, uint16_t data) {
+  #ifdef EIND
+    uint8_t eind = EIND;
+    EIND = (uint8_t)(SPM_SERVICE_ENTRY >> 17);
+  #endif
+  ((spm_service_t)(uint16_t)(SPM_SERVICE_ENTRY >> 1))(command, addr, data);
+  #ifdef EIND
+    EIND = eind;
+  #endif
+}
+
+#endif
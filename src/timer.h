@@ -0,0 +1,64 @@
+/*
+ * MCP-CAN-Boot
+ *
+ * CAN bus bootloader for AVR microcontrollers attached to an MCP2515 CAN controller.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ *
+ * Minimal time base using timer 1 without interrupts.
+ */
+
+#ifndef	__MCP_CAN_BOOT_TIMER_H__
+#define	__MCP_CAN_BOOT_TIMER_H__
+
+#include <inttypes.h>
+#include <avr/io.h>
+
+/**
+ * Prescaler bits for timer 1.
+ * Prescaler 1024 results in 64 µs per tick at 16 MHz and an overflow after
+ * about 4.2 seconds.
+ */
+#define TIMER_PRESCALER ((1<<CS12) | (1<<CS10))
+
+/**
+ * Convert milliseconds into timer ticks.
+ * The result must be less than 65536, which is about 4.2 seconds at 16 MHz.
+ */
+#define MS_TO_TICKS(ms) ((uint16_t)(((uint32_t)(ms) * (F_CPU / 1024UL)) / 1000UL))
+
+/**
+ * Start timer 1 in normal mode.
+ */
+static inline void timerInit () {
+  TCCR1A = 0;
+  TCNT1 = 0;
+  TCCR1B = TIMER_PRESCALER;
+}
+
+/**
+ * Stop timer 1 and reset it to the power-up state.
+ */
+static inline void timerDeinit () {
+  TCCR1B = 0;
+  TCNT1 = 0;
+}
+
+/**
+ * Get the current timer ticks.
+ */
+static inline uint16_t timerTicks () {
+  return TCNT1;
+}
+
+/**
+ * Get the number of timer ticks elapsed since the given start ticks.
+ * This handles the overflow of the timer correctly as long as less than 65536
+ * ticks are elapsed.
+ */
+static inline uint16_t timerElapsed (uint16_t start) {
+  return TCNT1 - start;
+}
+
+#endif
@@ -0,0 +1,105 @@
+/*
+ * MCP-CAN-Boot
+ *
+ * CAN bus bootloader for AVR microcontrollers attached to an MCP2515 CAN controller.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ *
+ * Tracing of the bootloader phases into a RAM trace buffer.
+ */
+
+#ifndef	__MCP_CAN_BOOT_TRACE_H__
+#define	__MCP_CAN_BOOT_TRACE_H__
+
+#include <inttypes.h>
+#include <avr/io.h>
+
+#include "config.h"
+#include "timer.h"
+
+#ifdef TRACE
+
+/*
+ * Trace event IDs
+ */
+#define TRACE_EVT_BOOT             0x01 // main() entered
+#define TRACE_EVT_MCP_RESET        0x02 // mcp2515.reset() started
+#define TRACE_EVT_MCP_RESET_DONE   0x03 // mcp2515.reset() done
+#define TRACE_EVT_DETECT           0x04 // bitrate detection started
+#define TRACE_EVT_DETECT_DONE      0x05 // bitrate detection done, arg = index of the detected bitrate or 0xFF
+#define TRACE_EVT_WAIT_INIT        0x06 // bootloader start sent, waiting for flash init
+#define TRACE_EVT_FLASH_INIT       0x07 // flash init received
+#define TRACE_EVT_ERASE            0x08 // erase of the whole flash started
+#define TRACE_EVT_ERASE_DONE       0x09 // erase of the whole flash done
+#define TRACE_EVT_PAGE_WRITE       0x0A // page write started, arg = lower byte of the page number
+#define TRACE_EVT_PAGE_WRITE_DONE  0x0B // page write done, arg = lower byte of the page number
+#define TRACE_EVT_START_APP        0x0C // startApp() cleanup started
+#define TRACE_EVT_START_APP_DONE   0x0D // startApp() cleanup done, jumping to the application
+#define TRACE_EVT_ERASE_AHEAD      0x0E // background erase of a page started, arg = lower byte of the page number
+#define TRACE_EVT_PAGE_ERASE       0x0F // erase of a page marked as blank in the page map, arg = lower byte of the page number
+#define TRACE_EVT_WARM_START       0x10 // warm start by the main application, arg = CAN_SPEED passed by the application
+
+/**
+ * Magic byte to identify a valid trace buffer.
+ */
+#define TRACE_MAGIC 0xB7
+
+/**
+ * One event in the trace buffer.
+ */
+struct trace_entry {
+  uint8_t  event; // event ID
+  uint8_t  arg;   // optional event argument
+  uint16_t ticks; // timer 1 ticks at the time of the event
+};
+
+/**
+ * The trace buffer located at TRACE_ADDR.
+ */
+struct trace_buffer {
+  uint8_t magic; // TRACE_MAGIC if the buffer is valid
+  uint8_t pos;   // index of the next entry to write
+  uint8_t count; // number of recorded events (saturated at 0xFF)
+  uint8_t size;  // number of entries in the buffer (TRACE_SIZE)
+  struct trace_entry entries[TRACE_SIZE];
+};
+
+#define traceBuffer (*(struct trace_buffer*)(TRACE_ADDR))
+
+/**
+ * Reset the trace buffer.
+ * Timer 1 must be started before using timerInit().
+ */
+static inline void traceInit () {
+  traceBuffer.magic = TRACE_MAGIC;
+  traceBuffer.pos = 0;
+  traceBuffer.count = 0;
+  traceBuffer.size = TRACE_SIZE;
+}
+
+/**
+ * Add an event to the trace buffer.
+ * If the buffer is full, the oldest event will be overwritten.
+ */
+static inline void traceEvent (uint8_t event, uint8_t arg) {
+  struct trace_entry *entry = &traceBuffer.entries[traceBuffer.pos];
+  entry->ticks = timerTicks();
+  entry->event = event;
+  entry->arg = arg;
+
+  traceBuffer.pos = (traceBuffer.pos + 1) & (TRACE_SIZE - 1);
+  if (traceBuffer.count != 0xFF) {
+    traceBuffer.count++;
+  }
+}
+
+#define TRACE_INIT              traceInit()
+#define TRACE_EVENT(event, arg) traceEvent(event, arg)
+
+#else
+  #define TRACE_INIT
+  #define TRACE_EVENT(event, arg)
+#endif
+
+#endif
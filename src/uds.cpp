@@ -0,0 +1,423 @@
+/*
+ * MCP-CAN-Boot
+ *
+ * CAN bus bootloader for AVR microcontrollers attached to an MCP2515 CAN controller.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ *
+ * Optional UDS (ISO 14229) download services over ISO-TP (ISO 15765-2) as an
+ * alternative protocol front-end.
+ *
+ * Only the server side of ISO-TP with normal addressing is implemented.
+ * All responses fit into a single frame. The data of TransferData requests
+ * is written byte by byte into the flash page buffer while the consecutive
+ * frames are received, so there is no buffer for a whole ISO-TP message.
+ */
+
+#include "bootloader.h"
+#include "uds.h"
+
+#ifdef UDS
+
+#include <util/crc16.h>
+
+// ISO-TP receive state
+uint16_t isotpRxLen = 0; // length of the current message
+uint16_t isotpRxPos = 0; // number of received bytes of the current message
+uint8_t isotpRxSn = 0;   // expected sequence number of the next consecutive frame
+uint8_t isotpRxBs = 0;   // remaining consecutive frames until the next flow control
+
+// UDS state
+uint8_t udsBuf[UDS_BUF_SIZE];
+bool udsProgramming = false;
+uint8_t udsTransfer = UDS_TRANSFER_NONE;
+uint8_t udsNrc = 0;  // negative response code found while receiving
+uint8_t udsBsc = 0;  // expected block sequence counter
+uint32_t udsAddr;    // next flash address of the download
+uint32_t udsStart;   // start address of the last download
+uint32_t udsEnd;     // end address (exclusive) of the last download
+
+/**
+ * Send a single frame using the data bytes 1 to len of the CAN message.
+ */
+static void isotpSend (uint8_t len) {
+  #if CAN_EFF
+    canMsg.can_id = UDS_CAN_ID_RESPONSE | CAN_EFF_FLAG;
+  #else
+    canMsg.can_id = UDS_CAN_ID_RESPONSE;
+  #endif
+  canMsg.can_dlc = len + 1;
+  canMsg.data[0] = ISOTP_PCI_SF | len;
+  canController.sendMessage(&canMsg);
+}
+
+/**
+ * Send a flow control frame to request the next consecutive frames.
+ * The block size is set to end at the next flash page boundary, so the remote
+ * waits for the next flow control while the flash page is written and no
+ * consecutive frame will be lost.
+ */
+static void isotpFlowControl () {
+  isotpRxBs = (SPM_PAGESIZE - flashBufferPos + 6) / 7;
+
+  canMsg.data[0] = ISOTP_PCI_FC; // continue to send
+  canMsg.data[1] = isotpRxBs;
+  canMsg.data[2] = UDS_STMIN;
+  #if CAN_EFF
+    canMsg.can_id = UDS_CAN_ID_RESPONSE | CAN_EFF_FLAG;
+  #else
+    canMsg.can_id = UDS_CAN_ID_RESPONSE;
+  #endif
+  canMsg.can_dlc = 3;
+  canController.sendMessage(&canMsg);
+}
+
+/**
+ * Abort the reception of the current ISO-TP message.
+ * A partially written TransferData block also aborts the download, since the
+ * written data cannot be taken back.
+ */
+static void isotpAbort () {
+  isotpRxLen = 0;
+  isotpRxPos = 0;
+  if (udsTransfer == UDS_TRANSFER_WRITE) {
+    udsTransfer = UDS_TRANSFER_NONE;
+  } else if (udsTransfer == UDS_TRANSFER_REPEAT) {
+    udsTransfer = UDS_TRANSFER_READY;
+  }
+}
+
+/**
+ * Send a negative response.
+ */
+static void udsNegativeResponse (uint8_t sid, uint8_t nrc) {
+  canMsg.data[1] = UDS_SID_NEGATIVE_RESPONSE;
+  canMsg.data[2] = sid;
+  canMsg.data[3] = nrc;
+  isotpSend(3);
+}
+
+/**
+ * Finish the programming session before the main application is started.
+ * @return UDS_RESULT_START_APP
+ */
+static uint8_t udsStartApp () {
+  #ifdef FLASH_ERASE_AHEAD
+    flashEraseAheadFinish();
+  #endif
+
+  // copy the new application from the staging slot if requested by
+  // RequestTransferExit
+  #ifdef DUAL_SLOT
+    copySlot();
+  #endif
+  return UDS_RESULT_START_APP;
+}
+
+/**
+ * Handle one received byte of an UDS request.
+ * The first bytes are stored in the request buffer. The data of a
+ * TransferData request is written directly to the flash.
+ */
+static void udsRxByte (uint8_t b) {
+  if (isotpRxPos < UDS_BUF_SIZE) {
+    udsBuf[isotpRxPos] = b;
+  }
+
+  if (udsBuf[0] == UDS_SID_TRANSFER_DATA && udsProgramming) {
+    if (isotpRxPos == 1) {
+      // check the block sequence counter
+      if (udsTransfer == UDS_TRANSFER_NONE) {
+        udsNrc = UDS_NRC_REQUEST_SEQUENCE_ERROR;
+      } else if (b == udsBsc) {
+        udsTransfer = UDS_TRANSFER_WRITE;
+      } else if (b == (uint8_t)(udsBsc - 1)) {
+        // the response to the last block was lost, skip the data
+        udsTransfer = UDS_TRANSFER_REPEAT;
+      } else {
+        udsNrc = UDS_NRC_WRONG_BLOCK_SEQUENCE_COUNTER;
+      }
+
+    } else if (isotpRxPos > 1 && udsTransfer == UDS_TRANSFER_WRITE) {
+      if (udsAddr < udsEnd) {
+        flashWriteByte(b);
+        udsAddr++;
+      } else {
+        // more data than requested
+        udsNrc = UDS_NRC_TRANSFER_DATA_SUSPENDED;
+        udsTransfer = UDS_TRANSFER_NONE;
+      }
+    }
+  }
+
+  isotpRxPos++;
+}
+
+/**
+ * Handle a completely received UDS request and send the response.
+ * @return One of the UDS_RESULT_* values.
+ */
+static uint8_t udsHandleRequest () {
+  uint8_t sid = udsBuf[0];
+
+  if (!udsProgramming && sid != UDS_SID_DIAGNOSTIC_SESSION_CONTROL) {
+    // only the programming session can be entered in the default session
+    udsNegativeResponse(sid, UDS_NRC_SERVICE_NOT_SUPPORTED_IN_SESSION);
+    return UDS_RESULT_NONE;
+  }
+
+  if (udsNrc != 0) {
+    // error found while receiving
+    udsNegativeResponse(sid, udsNrc);
+    return UDS_RESULT_NONE;
+  }
+
+  // positive response to the request
+  canMsg.data[1] = sid + UDS_POSITIVE_RESPONSE;
+  canMsg.data[2] = udsBuf[1];
+
+  if (sid == UDS_SID_DIAGNOSTIC_SESSION_CONTROL) {
+    if (isotpRxLen != 2) {
+      udsNegativeResponse(sid, UDS_NRC_INCORRECT_LENGTH);
+      return UDS_RESULT_NONE;
+    }
+    if (udsBuf[1] != UDS_SESSION_PROGRAMMING && udsBuf[1] != UDS_SESSION_DEFAULT) {
+      udsNegativeResponse(sid, UDS_NRC_SUBFUNCTION_NOT_SUPPORTED);
+      return UDS_RESULT_NONE;
+    }
+
+    // P2 server max 50 ms, P2* server max 5000 ms (in 10 ms resolution)
+    canMsg.data[3] = 0x00;
+    canMsg.data[4] = 0x32;
+    canMsg.data[5] = 0x01;
+    canMsg.data[6] = 0xF4;
+    isotpSend(6);
+
+    if (udsBuf[1] == UDS_SESSION_PROGRAMMING) {
+      udsProgramming = true;
+      return UDS_RESULT_PROGRAMMING;
+    }
+    // leaving the programming session starts the main application
+    return udsProgramming ? udsStartApp() : UDS_RESULT_NONE;
+
+  } else if (sid == UDS_SID_ECU_RESET) {
+    if (udsBuf[1] != UDS_RESET_HARD) {
+      udsNegativeResponse(sid, UDS_NRC_SUBFUNCTION_NOT_SUPPORTED);
+      return UDS_RESULT_NONE;
+    }
+    isotpSend(2);
+    return udsStartApp();
+
+  } else if (sid == UDS_SID_TESTER_PRESENT) {
+    // just keep the session, the response may be suppressed by the remote
+    if (!(udsBuf[1] & 0x80)) {
+      isotpSend(2);
+    }
+
+  } else if (sid == UDS_SID_ROUTINE_CONTROL) {
+    if (isotpRxLen != 4) {
+      udsNegativeResponse(sid, UDS_NRC_INCORRECT_LENGTH);
+      return UDS_RESULT_NONE;
+    }
+    if (udsBuf[1] != UDS_ROUTINE_START) {
+      udsNegativeResponse(sid, UDS_NRC_SUBFUNCTION_NOT_SUPPORTED);
+      return UDS_RESULT_NONE;
+    }
+
+    uint16_t rid = (udsBuf[2] << 8) | udsBuf[3];
+    if (rid == UDS_ROUTINE_ERASE) {
+      // erasing takes longer than P2
+      udsNegativeResponse(sid, UDS_NRC_RESPONSE_PENDING);
+      flashErase();
+      udsTransfer = UDS_TRANSFER_NONE;
+
+      canMsg.data[1] = sid + UDS_POSITIVE_RESPONSE;
+      canMsg.data[2] = UDS_ROUTINE_START;
+      canMsg.data[3] = udsBuf[2];
+      canMsg.data[4] = udsBuf[3];
+      isotpSend(4);
+
+    } else if (rid == UDS_ROUTINE_CRC) {
+      if (udsTransfer != UDS_TRANSFER_NONE) {
+        // download not finished by RequestTransferExit
+        udsNegativeResponse(sid, UDS_NRC_REQUEST_SEQUENCE_ERROR);
+        return UDS_RESULT_NONE;
+      }
+
+      // calculating the CRC of a large download takes longer than P2
+      udsNegativeResponse(sid, UDS_NRC_RESPONSE_PENDING);
+      #ifdef FLASH_ERASE_AHEAD
+        flashEraseAheadFinish();
+      #endif
+      uint16_t crc = 0;
+      for (uint32_t addr = udsStart; addr < udsEnd; addr++) {
+        crc = _crc_xmodem_update(crc, flash_read_byte(FLASH_ADDR_OFFSET + addr));
+      }
+
+      canMsg.data[1] = sid + UDS_POSITIVE_RESPONSE;
+      canMsg.data[2] = UDS_ROUTINE_START;
+      canMsg.data[3] = udsBuf[2];
+      canMsg.data[4] = udsBuf[3];
+      canMsg.data[5] = crc >> 8;
+      canMsg.data[6] = crc & 0xFF;
+      isotpSend(6);
+
+    } else {
+      udsNegativeResponse(sid, UDS_NRC_REQUEST_OUT_OF_RANGE);
+    }
+
+  } else if (sid == UDS_SID_REQUEST_DOWNLOAD) {
+    // data format identifier (no compression/encryption) and the address and
+    // length format identifier (number of bytes of the size and address)
+    uint8_t addrLen = udsBuf[2] & 0x0F;
+    uint8_t sizeLen = udsBuf[2] >> 4;
+    if (isotpRxLen < 3 || isotpRxLen != 3 + addrLen + sizeLen) {
+      udsNegativeResponse(sid, UDS_NRC_INCORRECT_LENGTH);
+      return UDS_RESULT_NONE;
+    }
+    if (udsBuf[1] != 0x00 || addrLen == 0 || addrLen > 4 || sizeLen == 0 || sizeLen > 4) {
+      udsNegativeResponse(sid, UDS_NRC_REQUEST_OUT_OF_RANGE);
+      return UDS_RESULT_NONE;
+    }
+
+    uint8_t *p = &udsBuf[3];
+    uint32_t addr = 0;
+    uint32_t size = 0;
+    while (addrLen--) {
+      addr = (addr << 8) | *p++;
+    }
+    while (sizeLen--) {
+      size = (size << 8) | *p++;
+    }
+
+    if (size == 0 || addr > FLASHEND_APP || size > FLASHEND_APP + 1 - addr) {
+      // address range cannot be flashed
+      udsNegativeResponse(sid, UDS_NRC_REQUEST_OUT_OF_RANGE);
+      return UDS_RESULT_NONE;
+    }
+
+    flashSetAddress(addr);
+    #ifdef FLASH_ERASE_AHEAD
+      // erase the pages of the download in the background
+      flashAnnounceRange(addr, addr + size - 1);
+    #endif
+    udsStart = addr;
+    udsAddr = addr;
+    udsEnd = addr + size;
+    udsBsc = 1;
+    udsTransfer = UDS_TRANSFER_READY;
+    #ifdef DUAL_SLOT
+      eeprom_update_byte(DUAL_SLOT_REQUEST_FLAG, 0xFF);
+    #endif
+
+    // length format identifier and max number of block length (whole request)
+    canMsg.data[2] = 0x20;
+    canMsg.data[3] = ISOTP_MAX_LEN >> 8;
+    canMsg.data[4] = ISOTP_MAX_LEN & 0xFF;
+    isotpSend(4);
+
+  } else if (sid == UDS_SID_TRANSFER_DATA) {
+    if (isotpRxLen < 2) {
+      udsNegativeResponse(sid, UDS_NRC_INCORRECT_LENGTH);
+      return UDS_RESULT_NONE;
+    }
+    if (udsTransfer == UDS_TRANSFER_WRITE) {
+      udsBsc++;
+    }
+    udsTransfer = UDS_TRANSFER_READY;
+    isotpSend(2);
+
+  } else if (sid == UDS_SID_REQUEST_TRANSFER_EXIT) {
+    if (udsTransfer == UDS_TRANSFER_NONE) {
+      udsNegativeResponse(sid, UDS_NRC_REQUEST_SEQUENCE_ERROR);
+      return UDS_RESULT_NONE;
+    }
+    if (flashBufferDataCount > 0) {
+      // still data in flash buffer... write last page
+      writeFlashPage();
+    }
+    #ifdef FLASH_PAGE_CACHE
+      flashCacheFlush();
+    #endif
+    udsTransfer = UDS_TRANSFER_NONE;
+    #ifdef DUAL_SLOT
+      // the staging slot will be copied if the app is started, but only if
+      // the number of pages and the CRC in the parameter record match
+      if (isotpRxLen == 5 && !slotRequestCopy((udsBuf[1] << 8) | udsBuf[2], (udsBuf[3] << 8) | udsBuf[4])) {
+        udsNegativeResponse(sid, UDS_NRC_GENERAL_PROGRAMMING_FAILURE);
+        return UDS_RESULT_NONE;
+      }
+    #endif
+    isotpSend(1);
+
+  } else {
+    udsNegativeResponse(sid, UDS_NRC_SERVICE_NOT_SUPPORTED);
+  }
+
+  return UDS_RESULT_NONE;
+}
+
+/**
+ * Handle a received ISO-TP frame in the global CAN message.
+ * @return One of the UDS_RESULT_* values.
+ */
+uint8_t udsReceive () {
+  uint8_t pci = canMsg.data[0] & 0xF0;
+  uint8_t i; // index of the first data byte in the frame
+
+  if (pci == ISOTP_PCI_CF) {
+    if (isotpRxPos >= isotpRxLen || (canMsg.data[0] & 0x0F) != isotpRxSn) {
+      // unexpected consecutive frame
+      isotpAbort();
+      return UDS_RESULT_NONE;
+    }
+    isotpRxSn = (isotpRxSn + 1) & 0x0F;
+    i = 1;
+
+  } else {
+    // a new message aborts a not completely received message
+    if (isotpRxPos < isotpRxLen) {
+      isotpAbort();
+    }
+
+    if (pci == ISOTP_PCI_SF) {
+      isotpRxLen = canMsg.data[0] & 0x0F;
+      if (isotpRxLen == 0 || isotpRxLen >= canMsg.can_dlc) {
+        isotpRxLen = 0;
+        return UDS_RESULT_NONE;
+      }
+      i = 1;
+    } else if (pci == ISOTP_PCI_FF) {
+      isotpRxLen = ((canMsg.data[0] & 0x0F) << 8) | canMsg.data[1];
+      if (isotpRxLen < 8 || canMsg.can_dlc != 8) {
+        isotpRxLen = 0;
+        return UDS_RESULT_NONE;
+      }
+      isotpRxSn = 1;
+      i = 2;
+    } else {
+      // flow control or invalid frame
+      return UDS_RESULT_NONE;
+    }
+
+    isotpRxPos = 0;
+    udsNrc = 0;
+  }
+
+  while (i < canMsg.can_dlc && isotpRxPos < isotpRxLen) {
+    udsRxByte(canMsg.data[i++]);
+  }
+
+  if (isotpRxPos < isotpRxLen) {
+    // more consecutive frames to receive
+    if (pci == ISOTP_PCI_FF || --isotpRxBs == 0) {
+      isotpFlowControl();
+    }
+    return UDS_RESULT_NONE;
+  }
+
+  return udsHandleRequest();
+}
+
+#endif
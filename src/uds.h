@@ -0,0 +1,105 @@
+/*
+ * MCP-CAN-Boot
+ *
+ * CAN bus bootloader for AVR microcontrollers attached to an MCP2515 CAN controller.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ *
+ * Optional UDS (ISO 14229) download services over ISO-TP (ISO 15765-2) as an
+ * alternative protocol front-end.
+ */
+
+#ifndef	__MCP_CAN_BOOT_UDS_H__
+#define	__MCP_CAN_BOOT_UDS_H__
+
+#include <inttypes.h>
+
+#include "config.h"
+
+#ifdef UDS
+
+/*
+ * ISO-TP protocol control information (upper nibble of the first byte)
+ */
+#define ISOTP_PCI_SF 0x00 // single frame
+#define ISOTP_PCI_FF 0x10 // first frame
+#define ISOTP_PCI_CF 0x20 // consecutive frame
+#define ISOTP_PCI_FC 0x30 // flow control
+
+/**
+ * Maximum length of an ISO-TP message using a 12 bit length in the first frame.
+ */
+#define ISOTP_MAX_LEN 4095
+
+/*
+ * UDS service IDs
+ */
+#define UDS_SID_DIAGNOSTIC_SESSION_CONTROL 0x10
+#define UDS_SID_ECU_RESET                  0x11
+#define UDS_SID_ROUTINE_CONTROL            0x31
+#define UDS_SID_REQUEST_DOWNLOAD           0x34
+#define UDS_SID_TRANSFER_DATA              0x36
+#define UDS_SID_REQUEST_TRANSFER_EXIT      0x37
+#define UDS_SID_TESTER_PRESENT             0x3E
+#define UDS_SID_NEGATIVE_RESPONSE          0x7F
+
+/**
+ * Offset added to the service ID for a positive response.
+ */
+#define UDS_POSITIVE_RESPONSE 0x40
+
+/*
+ * UDS sub-functions and routine IDs
+ */
+#define UDS_SESSION_DEFAULT     0x01
+#define UDS_SESSION_PROGRAMMING 0x02
+#define UDS_RESET_HARD          0x01
+#define UDS_ROUTINE_START       0x01
+#define UDS_ROUTINE_ERASE       0xFF00 // erase the whole application flash
+#define UDS_ROUTINE_CRC         0x0202 // CRC-16/XMODEM of the last download
+
+/*
+ * UDS negative response codes
+ */
+#define UDS_NRC_SERVICE_NOT_SUPPORTED             0x11
+#define UDS_NRC_SUBFUNCTION_NOT_SUPPORTED         0x12
+#define UDS_NRC_INCORRECT_LENGTH                  0x13
+#define UDS_NRC_REQUEST_SEQUENCE_ERROR            0x24
+#define UDS_NRC_REQUEST_OUT_OF_RANGE              0x31
+#define UDS_NRC_TRANSFER_DATA_SUSPENDED           0x71
+#define UDS_NRC_GENERAL_PROGRAMMING_FAILURE       0x72
+#define UDS_NRC_WRONG_BLOCK_SEQUENCE_COUNTER      0x73
+#define UDS_NRC_RESPONSE_PENDING                  0x78
+#define UDS_NRC_SERVICE_NOT_SUPPORTED_IN_SESSION  0x7F
+
+/**
+ * Size of the buffer for the received UDS requests.
+ * The data of TransferData requests is written directly into the flash page
+ * buffer, so only the header of them is stored here.
+ */
+#define UDS_BUF_SIZE 16
+
+/*
+ * States of a download.
+ */
+#define UDS_TRANSFER_NONE   0 // no download requested
+#define UDS_TRANSFER_READY  1 // download requested, waiting for TransferData
+#define UDS_TRANSFER_WRITE  2 // receiving a TransferData block to write
+#define UDS_TRANSFER_REPEAT 3 // receiving a repeated TransferData block to skip
+
+/*
+ * Results of udsReceive() to be handled by the main loop.
+ */
+#define UDS_RESULT_NONE        0 // nothing to do
+#define UDS_RESULT_PROGRAMMING 1 // programming session entered
+#define UDS_RESULT_START_APP   2 // start the main application
+
+/*
+ * Function declarations
+ */
+uint8_t udsReceive ();
+
+#endif
+
+#endif
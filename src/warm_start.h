@@ -0,0 +1,66 @@
+/*
+ * MCP-CAN-Boot
+ *
+ * CAN bus bootloader for AVR microcontrollers attached to an MCP2515 CAN controller.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ *
+ * Warm start handoff from the main application to the bootloader.
+ *
+ * This file may be copied into the main application. The application has to
+ * define WARM_START_ADDR with the same value as in the bootloader config and
+ * BOOTLOADER_SIZE if the bootloader section is not 4096 bytes (e.g. 2048
+ * bytes using the compact profile).
+ *
+ * To enter the bootloader from the main application:
+ * \code
+ *  cli();
+ *  warmStart.magic = WARM_START_MAGIC;
+ *  warmStart.canSpeed = CAN_500KBPS;
+ *  asm volatile ("jmp %0" :: "i" (WARM_START_ENTRY));
+ * \endcode
+ */
+
+#ifndef	__MCP_CAN_BOOT_WARM_START_H__
+#define	__MCP_CAN_BOOT_WARM_START_H__
+
+#include <inttypes.h>
+#include <avr/io.h>
+
+#ifndef WARM_START_ADDR
+  #error WARM_START_ADDR must be defined with the same value as in the bootloader config!
+#endif
+
+/**
+ * Size of the bootloader section in bytes, 4096 bytes if not defined.
+ */
+#ifndef BOOTLOADER_SIZE
+  #define BOOTLOADER_SIZE 4096
+#endif
+
+/**
+ * Magic value to mark a valid handoff structure.
+ */
+#define WARM_START_MAGIC 0xB007
+
+/**
+ * Entry address of the bootloader (start of the boot section).
+ */
+#define WARM_START_ENTRY (FLASHEND + 1 - BOOTLOADER_SIZE)
+
+/**
+ * Handoff structure written by the main application before jumping into the
+ * bootloader.
+ */
+struct warm_start {
+  uint16_t magic;   // WARM_START_MAGIC
+  uint8_t canSpeed; // the CAN_SPEED currently used on the bus
+};
+
+/**
+ * The handoff structure at the fixed RAM address.
+ */
+#define warmStart (*(volatile struct warm_start*)(WARM_START_ADDR))
+
+#endif
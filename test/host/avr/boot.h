@@ -0,0 +1,33 @@
+/*
+ * MCP-CAN-Boot host tests
+ *
+ * Self-programming of the flash, backed by the flash model of host.cpp.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef __HOST_AVR_BOOT_H__
+#define __HOST_AVR_BOOT_H__
+
+#include <avr/io.h>
+
+#define __SPM_REG    SPMCSR
+#define __SPM_ENABLE SPMEN
+
+void boot_page_fill (uint32_t addr, uint16_t data);
+void boot_page_erase (uint32_t addr);
+void boot_page_write (uint32_t addr);
+void boot_rww_enable ();
+
+#define __boot_page_fill_normal(addr, data) boot_page_fill(addr, data)
+
+static inline bool boot_spm_busy () { return hostTime < hostSpmBusyUntil; }
+static inline bool boot_rww_busy () { return hostRwwBusy; }
+static inline void boot_spm_busy_wait () {
+  if (hostTime < hostSpmBusyUntil) {
+    hostTime = hostSpmBusyUntil;
+  }
+}
+
+#endif
@@ -0,0 +1,27 @@
+/*
+ * MCP-CAN-Boot host tests
+ *
+ * EEPROM access, backed by the EEPROM model of host.cpp.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef __HOST_AVR_EEPROM_H__
+#define __HOST_AVR_EEPROM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint8_t eeprom_read_byte (const uint8_t *addr);
+uint16_t eeprom_read_word (const uint16_t *addr);
+void eeprom_read_block (void *dst, const void *src, size_t n);
+void eeprom_write_byte (uint8_t *addr, uint8_t value);
+void eeprom_update_byte (uint8_t *addr, uint8_t value);
+void eeprom_update_word (uint16_t *addr, uint16_t value);
+void eeprom_update_block (const void *src, void *dst, size_t n);
+
+static inline bool eeprom_is_ready () { return true; }
+static inline void eeprom_busy_wait () { }
+
+#endif
@@ -0,0 +1,14 @@
+/*
+ * MCP-CAN-Boot host tests
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef __HOST_AVR_INTERRUPT_H__
+#define __HOST_AVR_INTERRUPT_H__
+
+static inline void cli () { }
+static inline void sei () { }
+
+#endif
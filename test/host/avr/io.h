@@ -0,0 +1,70 @@
+/*
+ * MCP-CAN-Boot host tests
+ *
+ * Minimal <avr/io.h> for an ATmega328P running on the host.
+ * The I/O registers are plain variables. PORTB notifies the SPI model of the
+ * CAN controller about changes of the SS pin, so the single SPI transactions
+ * can be separated.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef __HOST_AVR_IO_H__
+#define __HOST_AVR_IO_H__
+
+#include <stdint.h>
+
+#if !defined(__AVR_ATmega328P__)
+  #error The host tests model an ATmega328P only
+#endif
+
+struct HostPort {
+  volatile uint8_t value;
+
+  operator uint8_t () const { return value; }
+  HostPort& operator= (uint8_t v) { set(v); return *this; }
+  HostPort& operator|= (uint8_t v) { set(value | v); return *this; }
+  HostPort& operator&= (uint8_t v) { set(value & v); return *this; }
+
+  void set (uint8_t v);
+};
+
+extern HostPort PORTB;
+extern volatile uint8_t DDRB, PINB, PORTC, DDRC, PINC, PORTD, DDRD, PIND;
+extern volatile uint8_t SREG, MCUSR, MCUCR, SPCR, SPSR, SPDR, SPMCSR, EECR;
+extern volatile uint8_t TCCR1A, TCCR1B;
+extern volatile uint16_t TCNT1;
+
+#define SPE   6
+#define MSTR  4
+#define CPOL  3
+#define CPHA  2
+#define SPR1  1
+#define SPR0  0
+#define SPIF  7
+#define SPI2X 0
+
+#define IVSEL 1
+#define IVCE  0
+
+#define CS12 2
+#define CS11 1
+#define CS10 0
+
+#define SPMEN 0
+
+#define SPM_PAGESIZE 128
+#define FLASHEND     0x7FFF
+#define RAMSTART     0x100
+#define RAMEND       0x08FF
+#define E2END        0x3FF
+
+#define SIGNATURE_0 0x1E
+#define SIGNATURE_1 0x95
+#define SIGNATURE_2 0x0F
+
+#define _BV(bit) (1 << (bit))
+#define _SFR_MEM_ADDR(sfr) 0
+
+#endif
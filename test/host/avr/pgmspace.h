@@ -0,0 +1,27 @@
+/*
+ * MCP-CAN-Boot host tests
+ *
+ * Program memory access. Constant tables stay in the RAM of the host, reads
+ * of flash addresses use the flash model of host.cpp.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef __HOST_AVR_PGMSPACE_H__
+#define __HOST_AVR_PGMSPACE_H__
+
+#include <stdint.h>
+
+#define PROGMEM
+
+#define pgm_read_byte(addr)  (*(const uint8_t*)(addr))
+#define pgm_read_word(addr)  (*(const uint16_t*)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t*)(addr))
+
+uint8_t pgm_read_byte_near (uint16_t addr);
+uint16_t pgm_read_word_near (uint16_t addr);
+uint8_t pgm_read_byte_far (uint32_t addr);
+uint16_t pgm_read_word_far (uint32_t addr);
+
+#endif
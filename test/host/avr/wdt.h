@@ -0,0 +1,13 @@
+/*
+ * MCP-CAN-Boot host tests
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef __HOST_AVR_WDT_H__
+#define __HOST_AVR_WDT_H__
+
+static inline void wdt_disable () { }
+
+#endif
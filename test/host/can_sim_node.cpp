@@ -0,0 +1,231 @@
+/*
+ * MCP-CAN-Boot host tests
+ *
+ * Bootloader node of tools/can_sim.py. The bootloader runs against the model
+ * of the MCP2515 and the time model of host.h, while the simulation of the
+ * CAN bus controls the node over stdin and stdout, one command per line:
+ *
+ *   run <t>                 run until the time t (ns), answered by one of
+ *     at <t>                  the time is reached (or exceeded)
+ *     tx <t> <id> <ext> <hex> transmission of TXB0 requested at the time t
+ *     abort <t>               transmission of TXB0 aborted at the time t
+ *     app <t> <ovf> <crc>     main application started at the time t with the
+ *                             receive buffer overflows and the CRC-32 of the
+ *                             application flash, the node exits
+ *   rx <id> <ext> <hex>     frame received from the bus
+ *   txdone                  transmission of TXB0 done
+ *   txerror                 error while transmitting TXB0
+ *   txlost                  arbitration lost while transmitting TXB0
+ *   busoff / busok          bus-off state entered / left
+ *   quit                    answered by "stats <ovf>", the node exits
+ *
+ * The node is built by tools/can_sim.py with the configuration of the
+ * simulation (SIM_CONFIG of the Makefile).
+ *
+ * Usage: can_sim_node <mcu id> <start time> <spi byte time> <erase time> <write time>
+ *        (all times in ns)
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "mcp2515_model.h"
+
+// configuration of the simulation instead of config.h
+#include "config.h"
+
+static uint16_t simMcuId;
+
+#undef MCU_ID
+#define MCU_ID simMcuId
+
+#ifdef SIM_TIMEOUT
+  #undef TIMEOUT
+  #define TIMEOUT SIM_TIMEOUT
+#endif
+
+#ifdef SIM_CAN_EFF
+  #undef CAN_EFF
+  #define CAN_EFF SIM_CAN_EFF
+#endif
+
+#ifdef SIM_CAN_ID_MCU_TO_REMOTE
+  #undef CAN_ID_MCU_TO_REMOTE
+  #define CAN_ID_MCU_TO_REMOTE SIM_CAN_ID_MCU_TO_REMOTE
+#endif
+
+#ifdef SIM_CAN_ID_REMOTE_TO_MCU
+  #undef CAN_ID_REMOTE_TO_MCU
+  #define CAN_ID_REMOTE_TO_MCU SIM_CAN_ID_REMOTE_TO_MCU
+#endif
+
+#define main bootloader_main
+#include "bootloader.cpp"
+#undef main
+
+// time of one tick of timer 1 in ns
+#define TIMER_TICK_NS (1024ULL * 1000000000ULL / F_CPU)
+
+// TXB0CTRL and CANCTRL bits
+#define SIM_ABTF  0x40
+#define SIM_MLOA  0x20
+#define SIM_TXERR 0x10
+#define SIM_OSM   0x08
+
+// EFLG and CANINTF bits
+#define SIM_TXBO  0x20
+#define SIM_TX0IF 0x04
+
+/**
+ * Thrown by the jump to the main application.
+ */
+struct AppStarted { };
+
+class SimNode : public Mcp2515Model {
+  public:
+    uint64_t horizon;
+    uint64_t timerTime;
+
+    uint8_t transfer (uint8_t data) {
+      uint8_t ret = Mcp2515Model::transfer(data);
+
+      // timer 1 runs with the time model
+      while (hostTime - timerTime >= TIMER_TICK_NS) {
+        TCNT1++;
+        timerTime += TIMER_TICK_NS;
+      }
+
+      if (hostTime >= horizon) {
+        printf("at %llu\n", (unsigned long long)hostTime);
+        sync();
+      }
+      return ret;
+    }
+
+    /**
+     * Wait for the next run command, handling the events of the bus.
+     */
+    void sync () {
+      char line[128];
+      fflush(stdout);
+      while (fgets(line, sizeof(line), stdin) != NULL) {
+        unsigned long long t;
+        unsigned long id;
+        unsigned ext;
+        char hex[17];
+        if (sscanf(line, "run %llu", &t) == 1) {
+          horizon = t;
+          return;
+        } else if (sscanf(line, "rx %lx %u %16s", &id, &ext, hex) >= 2) {
+          HostFrame f;
+          f.time = hostTime / 1000;
+          f.id = id;
+          f.ext = ext;
+          f.dlc = parseHex(hex, f.data);
+          receive(&f);
+        } else if (strncmp(line, "txdone", 6) == 0) {
+          if (reg[TXB0CTRL] & TXREQ) {
+            reg[TXB0CTRL] &= ~(TXREQ | SIM_MLOA | SIM_TXERR);
+            reg[CANINTF] |= SIM_TX0IF;
+          }
+        } else if (strncmp(line, "txerror", 7) == 0) {
+          // one-shot mode gives up after the first attempt
+          reg[TXB0CTRL] |= SIM_TXERR;
+          if (reg[CANCTRL] & SIM_OSM) {
+            reg[TXB0CTRL] &= ~TXREQ;
+          }
+        } else if (strncmp(line, "txlost", 6) == 0) {
+          reg[TXB0CTRL] |= SIM_MLOA;
+          if (reg[CANCTRL] & SIM_OSM) {
+            reg[TXB0CTRL] &= ~TXREQ;
+          }
+        } else if (strncmp(line, "busoff", 6) == 0) {
+          reg[EFLG] |= SIM_TXBO;
+        } else if (strncmp(line, "busok", 5) == 0) {
+          reg[EFLG] &= ~SIM_TXBO;
+        } else if (strncmp(line, "quit", 4) == 0) {
+          printf("stats %u\n", overflows);
+          exit(0);
+        }
+      }
+      // the simulation is gone
+      exit(1);
+    }
+
+  protected:
+    void transmit () {
+      HostFrame f;
+      txFrame(&f);
+      printf("tx %llu %lx %u ", (unsigned long long)hostTime, (unsigned long)f.id, f.ext);
+      for (uint8_t i = 0; i < f.dlc; i++) {
+        printf("%02x", f.data[i]);
+      }
+      printf("\n");
+      reg[TXB0CTRL] &= ~(SIM_ABTF | SIM_MLOA | SIM_TXERR);
+      sync();
+    }
+
+    void abort () {
+      reg[TXB0CTRL] |= SIM_ABTF;
+      printf("abort %llu\n", (unsigned long long)hostTime);
+      sync();
+    }
+
+  private:
+    static uint8_t parseHex (const char *hex, uint8_t *data) {
+      uint8_t len = 0;
+      while (len < 8 && hex[len * 2] && hex[len * 2 + 1]) {
+        unsigned b;
+        sscanf(&hex[len * 2], "%2x", &b);
+        data[len++] = b;
+      }
+      return len;
+    }
+};
+
+static SimNode node;
+
+static void appStarted () {
+  throw AppStarted();
+}
+
+static uint32_t crc32 (const uint8_t *data, uint32_t len) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (uint32_t i = 0; i < len; i++) {
+    crc ^= data[i];
+    for (uint8_t b = 0; b < 8; b++) {
+      crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+    }
+  }
+  return ~crc;
+}
+
+int main (int argc, char **argv) {
+  if (argc != 6) {
+    fprintf(stderr, "Usage: %s <mcu id> <start time> <spi byte time> <erase time> <write time>\n", argv[0]);
+    return 2;
+  }
+
+  hostReset();
+  simMcuId = strtoul(argv[1], NULL, 0);
+  hostTime = strtoull(argv[2], NULL, 0);
+  node.byteTime = strtoul(argv[3], NULL, 0);
+  hostPageEraseTime = strtoul(argv[4], NULL, 0);
+  hostPageWriteTime = strtoul(argv[5], NULL, 0);
+  node.timerTime = hostTime;
+  node.horizon = hostTime;
+  hostSpiDevice = &node;
+  gotoApp = appStarted;
+
+  // wait for the first run command
+  node.sync();
+
+  try {
+    bootloader_main();
+  } catch (AppStarted&) {
+  }
+
+  printf("app %llu %u %08x\n", (unsigned long long)hostTime, node.overflows,
+    crc32(hostFlash, (uint32_t)FLASHEND_APP + 1));
+  return 0;
+}
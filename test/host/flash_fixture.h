@@ -0,0 +1,62 @@
+/*
+ * MCP-CAN-Boot host tests
+ *
+ * Flashing session on the level of the flash functions of the bootloader,
+ * shared by the tests of the flash buffer variants. The expected content of
+ * the application flash is kept in image[] and checked by done().
+ *
+ * Include this file after bootloader.cpp.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef __HOST_FLASH_FIXTURE_H__
+#define __HOST_FLASH_FIXTURE_H__
+
+#include "test.h"
+
+/**
+ * Expected content of the application flash.
+ */
+static uint8_t image[FLASHEND + 1];
+
+/**
+ * Start a new flashing session.
+ */
+static void start () {
+  hostReset();
+  memset(image, 0xFF, sizeof(image));
+  flashErase();
+}
+
+/**
+ * Write data like a CMD_FLASH_SET_ADDRESS followed by CMD_FLASH_DATA.
+ * The data differs in each page.
+ */
+static void write (uint32_t addr, uint32_t len) {
+  flashSetAddress(addr);
+  for (uint32_t i = 0; i < len; i++) {
+    uint8_t data = (addr + i) * 7 + (addr + i) / 251;
+    image[addr + i] = data;
+    flashWriteByte(data);
+  }
+}
+
+/**
+ * Finish the session like CMD_FLASH_DONE and check the flash content.
+ */
+static void done () {
+  if (flashBufferDataCount > 0) {
+    writeFlashPage();
+  }
+  #ifdef FLASH_PAGE_CACHE
+    flashCacheFlush();
+  #endif
+
+  CHECK(flashBufferDataCount == 0);
+  CHECK(hostPageBufferErrors == 0);
+  CHECK(memcmp(hostFlash, image, FLASHEND_APP + 1) == 0);
+}
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ * MCP-CAN-Boot host tests
+ *
+ * Models of the flash, the EEPROM and the SPI bus of the MCU.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include <string.h>
+#include <avr/boot.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+
+#include "host.h"
+
+HostPort PORTB;
+volatile uint8_t DDRB, PINB, PORTC, DDRC, PINC, PORTD, DDRD, PIND;
+volatile uint8_t SREG, MCUSR, MCUCR, SPCR, SPSR, SPDR, SPMCSR, EECR;
+volatile uint8_t TCCR1A, TCCR1B;
+volatile uint16_t TCNT1;
+
+uint8_t hostFlash[FLASHEND + 1];
+uint8_t hostPageBuffer[SPM_PAGESIZE];
+static bool hostPageBufferFilled[SPM_PAGESIZE / 2];
+uint16_t hostPageBufferFills;
+uint16_t hostPageBufferErrors;
+uint16_t hostPageWrites;
+uint16_t hostPageErases;
+
+uint64_t hostTime;
+uint32_t hostPageEraseTime;
+uint32_t hostPageWriteTime;
+uint64_t hostSpmBusyUntil;
+bool hostRwwBusy;
+
+uint8_t hostEeprom[E2END + 1];
+uint32_t hostEepromWrites[E2END + 1];
+
+HostSpiDevice *hostSpiDevice = NULL;
+
+static void clearPageBuffer () {
+  memset(hostPageBuffer, 0xFF, sizeof(hostPageBuffer));
+  memset(hostPageBufferFilled, 0, sizeof(hostPageBufferFilled));
+  hostPageBufferFills = 0;
+}
+
+void hostReset () {
+  memset(hostFlash, 0xFF, sizeof(hostFlash));
+  clearPageBuffer();
+  hostPageBufferErrors = 0;
+  hostPageWrites = 0;
+  hostPageErases = 0;
+  memset(hostEeprom, 0xFF, sizeof(hostEeprom));
+  memset(hostEepromWrites, 0, sizeof(hostEepromWrites));
+  hostTime = 0;
+  hostSpmBusyUntil = 0;
+  hostRwwBusy = false;
+}
+
+void hostAsm (const uint8_t *pageBuffer) {
+  if (pageBuffer == NULL) {
+    return;
+  }
+  for (uint16_t i = 0; i < SPM_PAGESIZE; i += 2) {
+    boot_page_fill(i, pageBuffer[i] | (pageBuffer[i + 1] << 8));
+  }
+}
+
+void boot_page_fill (uint32_t addr, uint16_t data) {
+  uint16_t word = (addr % SPM_PAGESIZE) / 2;
+  if (hostPageBufferFilled[word]) {
+    hostPageBufferErrors++;
+  }
+  hostPageBufferFilled[word] = true;
+  hostPageBufferFills++;
+  hostPageBuffer[word * 2] = data & 0xFF;
+  hostPageBuffer[word * 2 + 1] = data >> 8;
+}
+
+void boot_page_erase (uint32_t addr) {
+  memset(&hostFlash[addr - addr % SPM_PAGESIZE], 0xFF, SPM_PAGESIZE);
+  hostPageErases++;
+  hostSpmBusyUntil = hostTime + hostPageEraseTime;
+  hostRwwBusy = true;
+}
+
+void boot_page_write (uint32_t addr) {
+  uint8_t *page = &hostFlash[addr - addr % SPM_PAGESIZE];
+  for (uint16_t i = 0; i < SPM_PAGESIZE; i++) {
+    page[i] &= hostPageBuffer[i];
+  }
+  hostPageWrites++;
+  clearPageBuffer();
+  hostSpmBusyUntil = hostTime + hostPageWriteTime;
+  hostRwwBusy = true;
+}
+
+void boot_rww_enable () {
+  clearPageBuffer();
+  hostRwwBusy = false;
+}
+
+uint8_t pgm_read_byte_near (uint16_t addr) {
+  return hostFlash[addr];
+}
+
+uint16_t pgm_read_word_near (uint16_t addr) {
+  return hostFlash[addr] | (hostFlash[addr + 1] << 8);
+}
+
+uint8_t pgm_read_byte_far (uint32_t addr) {
+  return hostFlash[addr];
+}
+
+uint16_t pgm_read_word_far (uint32_t addr) {
+  return hostFlash[addr] | (hostFlash[addr + 1] << 8);
+}
+
+uint8_t eeprom_read_byte (const uint8_t *addr) {
+  return hostEeprom[(uintptr_t)addr];
+}
+
+uint16_t eeprom_read_word (const uint16_t *addr) {
+  return hostEeprom[(uintptr_t)addr] | (hostEeprom[(uintptr_t)addr + 1] << 8);
+}
+
+void eeprom_read_block (void *dst, const void *src, size_t n) {
+  memcpy(dst, &hostEeprom[(uintptr_t)src], n);
+}
+
+void eeprom_write_byte (uint8_t *addr, uint8_t value) {
+  hostEeprom[(uintptr_t)addr] = value;
+  hostEepromWrites[(uintptr_t)addr]++;
+}
+
+void eeprom_update_byte (uint8_t *addr, uint8_t value) {
+  if (hostEeprom[(uintptr_t)addr] != value) {
+    eeprom_write_byte(addr, value);
+  }
+}
+
+void eeprom_update_word (uint16_t *addr, uint16_t value) {
+  eeprom_update_byte((uint8_t*)addr, value & 0xFF);
+  eeprom_update_byte((uint8_t*)addr + 1, value >> 8);
+}
+
+void eeprom_update_block (const void *src, void *dst, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    eeprom_update_byte((uint8_t*)dst + i, ((const uint8_t*)src)[i]);
+  }
+}
+
+// the CAN controller is selected by SS (PB2) of the ATmega328P
+#define HOST_SS (1 << 2)
+
+void HostPort::set (uint8_t v) {
+  bool selected = !(v & HOST_SS) && (value & HOST_SS);
+  value = v;
+  if (selected && hostSpiDevice != NULL) {
+    hostSpiDevice->start();
+  }
+}
+
+void spiInit () {
+  PORTB |= HOST_SS;
+}
+
+uint8_t spiTransfer (uint8_t data) {
+  if (hostSpiDevice == NULL || (PORTB & HOST_SS)) {
+    return 0xFF;
+  }
+  return hostSpiDevice->transfer(data);
+}
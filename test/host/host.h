@@ -0,0 +1,87 @@
+/*
+ * MCP-CAN-Boot host tests
+ *
+ * Models of the flash, the EEPROM and the SPI bus of the MCU, used to run the
+ * bootloader sources on the host. This file is included in front of each
+ * source file of the bootloader (-include host.h).
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef __HOST_H__
+#define __HOST_H__
+
+// include all system headers before the inline assembly is replaced below
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avr/io.h>
+
+/*
+ * Flash model
+ * Like the real flash, a page write can only clear bits, so a missing erase
+ * is detected. Each word of the temporary page buffer may only be filled once
+ * until the buffer is cleared by a page write or boot_rww_enable().
+ */
+extern uint8_t hostFlash[FLASHEND + 1];
+extern uint8_t hostPageBuffer[SPM_PAGESIZE];
+extern uint16_t hostPageBufferFills;  // filled words since the buffer was cleared
+extern uint16_t hostPageBufferErrors; // words filled twice
+extern uint16_t hostPageWrites;
+extern uint16_t hostPageErases;
+
+/*
+ * EEPROM model with the number of writes of each cell.
+ */
+extern uint8_t hostEeprom[E2END + 1];
+extern uint32_t hostEepromWrites[E2END + 1];
+
+/*
+ * Time model in ns. The time only advances if a test needs it, e.g. with each
+ * SPI byte of the MCP2515 model. A page erase or write keeps the flash busy
+ * for the given time (zero by default) and boot_spm_busy_wait() skips this
+ * time.
+ */
+extern uint64_t hostTime;
+extern uint32_t hostPageEraseTime;
+extern uint32_t hostPageWriteTime;
+extern uint64_t hostSpmBusyUntil;
+extern bool hostRwwBusy; // set by a page erase or write until boot_rww_enable()
+
+/**
+ * Reset the flash and the EEPROM to the erased state and the time to zero.
+ */
+void hostReset ();
+
+/**
+ * SPI device attached to the SS pin.
+ * start() is called on a falling edge of SS, transfer() for each byte while SS
+ * is low.
+ */
+struct HostSpiDevice {
+  virtual void start () = 0;
+  virtual uint8_t transfer (uint8_t data) = 0;
+};
+
+extern HostSpiDevice *hostSpiDevice;
+
+/*
+ * The inline assembly of the bootloader cannot run on the host. Each asm
+ * statement is replaced by a call of hostAsm() with the variable `buf` of the
+ * enclosing scope, which is the page buffer in boot_page_fill_buffer() and a
+ * null pointer anywhere else. This way the page buffer is filled into the
+ * temporary page buffer like on the MCU.
+ */
+static const uint8_t * const buf = NULL;
+void hostAsm (const uint8_t *pageBuffer);
+
+#define __asm__
+#define __volatile__(...) hostAsm(buf)
+#define naked
+
+#endif
@@ -0,0 +1,361 @@
+/*
+ * MCP-CAN-Boot host tests
+ *
+ * Model of the SPI registers of the MCP2515, used to run the whole bootloader
+ * on the host. The model stops the bootloader by throwing Mcp2515Model::Stop,
+ * since its main loop never returns.
+ *
+ * A trace of timed frames may be replayed instead of the frames put onto the
+ * bus one by one. Then the time (hostTime) advances with each SPI byte and the
+ * frames are received at their time on the bus.
+ *
+ * A derived class may transmit the frames of TXB0 on a simulated bus instead
+ * (see transmit() and abort()), like the node of tools/can_sim.py.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef __HOST_MCP2515_MODEL_H__
+#define __HOST_MCP2515_MODEL_H__
+
+#include "host.h"
+
+/**
+ * A CAN frame on the bus, the CAN-ID without the flags of can.h.
+ */
+struct HostFrame {
+  uint32_t time; // time on the bus in µs, only used by replay()
+  uint32_t id;
+  bool ext;
+  uint8_t dlc;
+  uint8_t data[8];
+};
+
+/**
+ * Register model of the MCP2515.
+ * Only the behavior used by the driver is modelled: the operation modes, the
+ * masks and filters of both receive buffers including the rollover into RXB1
+ * and TXB0, which transmits each requested message immediately.
+ * Frames put onto the bus by the test are received when the bootloader polls
+ * the status, one frame for each poll.
+ */
+class Mcp2515Model : public HostSpiDevice {
+  public:
+    static const uint8_t CNF1 = 0x2A;
+    static const uint8_t CANSTAT = 0x0E;
+    static const uint8_t CANCTRL = 0x0F;
+    static const uint8_t RXM0 = 0x20;
+    static const uint8_t RXM1 = 0x24;
+    static const uint8_t CANINTF = 0x2C;
+    static const uint8_t EFLG = 0x2D;
+    static const uint8_t TXB0CTRL = 0x30;
+    static const uint8_t RXB0CTRL = 0x60;
+    static const uint8_t RXB1CTRL = 0x70;
+
+    /**
+     * Thrown to leave the main loop of the bootloader.
+     */
+    struct Stop { };
+
+    uint8_t reg[0x80];
+
+    // frames on the bus, which are not yet received
+    HostFrame bus[64];
+    uint8_t busHead;
+    uint8_t busCount;
+
+    // transmitted frames
+    HostFrame tx[64];
+    uint8_t txCount;
+
+    unsigned accepted;   // frames put into a receive buffer
+    unsigned rejected;   // frames rejected by the masks and filters
+    unsigned overflows;  // frames lost because the receive buffers were full
+    unsigned reads;      // frames read out of a receive buffer
+    unsigned statusReads; // status reads, one for each loop of the bootloader
+    unsigned polls;      // status reads without a frame read until the next one
+    unsigned spiBytes;   // all bytes transferred on the SPI bus
+
+    // replayed trace
+    const HostFrame *trace;
+    unsigned traceCount;
+    unsigned tracePos;
+
+    uint32_t byteTime;   // time of one SPI byte in ns (see hostTime)
+
+    unsigned stopPolls;  // stop after this number of polls (0 for no limit)
+    uint8_t stopTx;      // stop after this number of transmitted frames (0 for no limit)
+
+    Mcp2515Model () {
+      powerUp();
+    }
+
+    void powerUp () {
+      memset(reg, 0x00, sizeof(reg));
+      busHead = busCount = 0;
+      txCount = 0;
+      accepted = rejected = overflows = reads = statusReads = polls = spiBytes = 0;
+      statusReadsFrames = 0;
+      trace = NULL;
+      traceCount = tracePos = 0;
+      byteTime = 0;
+      stopPolls = 0;
+      stopTx = 0;
+      reset();
+    }
+
+    /**
+     * Put a frame onto the bus.
+     */
+    void send (uint32_t id, bool ext, uint8_t dlc, const uint8_t *data) {
+      HostFrame *f = &bus[(busHead + busCount++) % 64];
+      f->id = id;
+      f->ext = ext;
+      f->dlc = dlc;
+      memcpy(f->data, data, dlc);
+    }
+
+    /**
+     * Replay a trace of frames sorted by their time. The time advances by
+     * byteTime ns for each SPI byte. The bootloader is stopped at the first
+     * status read 10 ms after the last frame of the trace.
+     */
+    void replay (const HostFrame *frames, unsigned count, uint32_t spiByteTime) {
+      trace = frames;
+      traceCount = count;
+      tracePos = 0;
+      byteTime = spiByteTime;
+    }
+
+    void start () {
+      pos = 0;
+      while (tracePos < traceCount && (uint64_t)trace[tracePos].time * 1000 <= hostTime) {
+        receive(&trace[tracePos++]);
+      }
+    }
+
+    uint8_t transfer (uint8_t data) {
+      uint8_t ret = 0x00;
+      spiBytes++;
+      hostTime += byteTime;
+      if (pos == 0) {
+        instruction = data;
+        if (data == 0xC0) {
+          reset();
+        } else if (data == 0xA0) {
+          status();
+        } else if (data == 0x90 || data == 0x94) {
+          // read rx buffer, the flag is cleared when CS is released
+          addr = (data == 0x90) ? RXB0CTRL + 1 : RXB1CTRL + 1;
+          clearRxFlags((data == 0x90) ? 0x01 : 0x02);
+        }
+      } else if (instruction == 0x03 || instruction == 0x02 || instruction == 0x05) {
+        if (pos == 1) {
+          addr = data;
+        } else if (instruction == 0x03) {
+          ret = reg[addr++ & 0x7F];
+        } else if (instruction == 0x02) {
+          write(addr++ & 0x7F, data);
+        } else if (pos == 2) {
+          mask = data;
+        } else if (pos == 3) {
+          write(addr, (reg[addr] & ~mask) | (data & mask));
+        }
+      } else if (instruction == 0xA0) {
+        ret = (reg[CANINTF] & 0x03) | ((reg[TXB0CTRL] & TXREQ) ? 0x04 : 0x00);
+      } else if (instruction == 0x90 || instruction == 0x94) {
+        ret = reg[addr++ & 0x7F];
+      }
+      pos++;
+      return ret;
+    }
+
+    uint8_t mode () {
+      return reg[CANSTAT] & 0xE0;
+    }
+
+    /**
+     * Receive a frame on the bus like the MCP2515 in normal mode.
+     */
+    void receive (const HostFrame *f) {
+      if (mode() != 0x00 && mode() != 0x60) {
+        rejected++;
+      } else if (matchRx0(f)) {
+        if (!(reg[CANINTF] & 0x01)) {
+          store(RXB0CTRL, f);
+          reg[CANINTF] |= 0x01;
+        } else if ((reg[RXB0CTRL] & 0x04) && !(reg[CANINTF] & 0x02)) {
+          store(RXB1CTRL, f);
+          reg[CANINTF] |= 0x02;
+        } else {
+          overflows++;
+        }
+      } else if (matchRx1(f)) {
+        if (!(reg[CANINTF] & 0x02)) {
+          store(RXB1CTRL, f);
+          reg[CANINTF] |= 0x02;
+        } else {
+          overflows++;
+        }
+      } else {
+        rejected++;
+      }
+    }
+
+  protected:
+    static const uint8_t TXREQ = 0x08;
+
+    /**
+     * Transmission of TXB0 requested by setting TXREQ. The frame is
+     * transmitted immediately.
+     */
+    virtual void transmit () {
+      HostFrame *f = &tx[txCount++ % 64];
+      txFrame(f);
+      reg[TXB0CTRL] &= ~TXREQ;
+      if (txCount == stopTx) {
+        throw Stop();
+      }
+    }
+
+    /**
+     * Transmission of TXB0 aborted by clearing TXREQ.
+     */
+    virtual void abort () {
+    }
+
+    /**
+     * Get the frame of TXB0.
+     */
+    void txFrame (HostFrame *f) {
+      bool ext;
+      f->time = hostTime / 1000;
+      f->id = id(TXB0CTRL + 1, &ext);
+      f->ext = ext;
+      f->dlc = reg[TXB0CTRL + 5] & 0x0F;
+      memcpy(f->data, &reg[TXB0CTRL + 6], 8);
+    }
+
+  private:
+    uint8_t pos;
+    uint8_t instruction;
+    uint8_t addr;
+    uint8_t mask;
+    unsigned statusReadsFrames; // frames read until the last status read
+
+    void reset () {
+      memset(reg, 0x00, sizeof(reg));
+      reg[CANSTAT] = 0x80;
+      reg[CANCTRL] = 0x87;
+    }
+
+    /**
+     * Clear receive flags, each cleared flag frees a receive buffer.
+     */
+    void clearRxFlags (uint8_t flags) {
+      flags &= reg[CANINTF] & 0x03;
+      reads += (flags & 0x01) + (flags >> 1);
+      reg[CANINTF] &= ~flags;
+    }
+
+    void write (uint8_t a, uint8_t data) {
+      if (a == CANSTAT) {
+        return;
+      }
+      if (a == CANINTF) {
+        clearRxFlags(~data);
+      }
+      uint8_t old = reg[a];
+      reg[a] = data;
+      if (a == CANCTRL) {
+        // the requested mode is entered immediately
+        reg[CANSTAT] = (reg[CANSTAT] & 0x1F) | (data & 0xE0);
+      } else if (a == TXB0CTRL && (data & ~old & TXREQ)) {
+        transmit();
+      } else if (a == TXB0CTRL && (old & ~data & TXREQ)) {
+        abort();
+      }
+    }
+
+    /**
+     * Get the CAN-ID of the four ID registers of a filter, mask or buffer.
+     */
+    uint32_t id (uint8_t a, bool *ext) {
+      uint32_t sid = (reg[a] << 3) | (reg[a + 1] >> 5);
+      *ext = reg[a + 1] & 0x08;
+      if (!*ext) {
+        return sid;
+      }
+      return (sid << 18) | ((uint32_t)(reg[a + 1] & 0x03) << 16) | (reg[a + 2] << 8) | reg[a + 3];
+    }
+
+    bool match (const HostFrame *f, uint8_t maskReg, uint8_t filterReg) {
+      bool filterExt;
+      uint32_t filter = id(filterReg, &filterExt);
+      if (filterExt != f->ext) {
+        return false;
+      }
+      // the mask registers always hold all 29 bits, a standard ID is compared
+      // with its upper 11 bits only
+      uint32_t m = ((uint32_t)((reg[maskReg] << 3) | (reg[maskReg + 1] >> 5)) << 18)
+        | ((uint32_t)(reg[maskReg + 1] & 0x03) << 16) | (reg[maskReg + 2] << 8) | reg[maskReg + 3];
+      if (!f->ext) {
+        m >>= 18;
+      }
+      return ((f->id ^ filter) & m) == 0;
+    }
+
+    bool matchRx0 (const HostFrame *f) {
+      if ((reg[RXB0CTRL] & 0x60) == 0x60) {
+        return true;
+      }
+      return match(f, RXM0, 0x00) || match(f, RXM0, 0x04);
+    }
+
+    bool matchRx1 (const HostFrame *f) {
+      if ((reg[RXB1CTRL] & 0x60) == 0x60) {
+        return true;
+      }
+      return match(f, RXM1, 0x08) || match(f, RXM1, 0x10) || match(f, RXM1, 0x14) || match(f, RXM1, 0x18);
+    }
+
+    void store (uint8_t ctrl, const HostFrame *f) {
+      uint8_t *b = &reg[ctrl + 1];
+      if (f->ext) {
+        uint32_t sid = f->id >> 18;
+        b[0] = sid >> 3;
+        b[1] = ((sid & 0x07) << 5) | 0x08 | ((f->id >> 16) & 0x03);
+        b[2] = f->id >> 8;
+        b[3] = f->id;
+      } else {
+        b[0] = f->id >> 3;
+        b[1] = (f->id & 0x07) << 5;
+        b[2] = 0;
+        b[3] = 0;
+      }
+      b[4] = f->dlc;
+      memcpy(&b[5], f->data, f->dlc);
+      accepted++;
+    }
+
+    /**
+     * Status read by the bootloader, one frame of the bus is received first.
+     */
+    void status () {
+      if (statusReads++ > 0 && reads == statusReadsFrames && ++polls == stopPolls) {
+        throw Stop();
+      }
+      statusReadsFrames = reads;
+      if (trace && tracePos == traceCount && hostTime > (uint64_t)(trace[traceCount - 1].time + 10000) * 1000) {
+        throw Stop();
+      }
+      if (busCount > 0) {
+        receive(&bus[busHead]);
+        busHead = (busHead + 1) % 64;
+        busCount--;
+      }
+    }
+};
+
+#endif
@@ -0,0 +1,31 @@
+/*
+ * MCP-CAN-Boot host tests
+ *
+ * Minimal test helpers. A failed check is reported with its line and the
+ * test continues, main() returns RESULT() as exit code.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef __HOST_TEST_H__
+#define __HOST_TEST_H__
+
+#include "host.h"
+
+static const char *testName = "";
+static unsigned testFailures = 0;
+
+#define TEST(name) for (bool _once = (testName = (name), true); _once; _once = false)
+
+#define CHECK(cond) do {                                                   \
+    if (!(cond)) {                                                         \
+      fprintf(stderr, "%s:%d: %s: check failed: %s\n",                     \
+              __FILE__, __LINE__, testName, #cond);                        \
+      testFailures++;                                                      \
+    }                                                                      \
+  } while (0)
+
+#define RESULT() (testFailures == 0 ? (printf("%s: ok\n", __FILE__), 0) : 1)
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ * MCP-CAN-Boot host tests
+ *
+ * Switching the bitrate within a flashing session (BITRATE_SWITCH). A rejected
+ * switch must keep the last confirmed bitrate.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "test.h"
+#include "mcp2515_model.h"
+
+#define main bootloader_main
+#include "bootloader.cpp"
+#undef main
+
+static Mcp2515Model model;
+
+/**
+ * Put a bootloader message for this MCU onto the bus.
+ */
+static void send (uint8_t cmd, uint8_t b4, uint8_t b5, uint8_t b6, uint8_t b7) {
+  const uint8_t data[] = { 0x00, 0x42, cmd, 0x00, b4, b5, b6, b7 };
+  model.send(CAN_ID_REMOTE_TO_MCU, true, sizeof(data), data);
+}
+
+static void run (uint8_t frames) {
+  model.stopTx = frames;
+  model.stopPolls = 100;
+  try {
+    bootloader_main();
+  } catch (Mcp2515Model::Stop&) {
+  }
+}
+
+int main () {
+  hostSpiDevice = &model;
+
+  TEST("reject after a confirmed switch") {
+    hostReset();
+    model.powerUp();
+    send(CMD_FLASH_INIT, SIGNATURE_0, SIGNATURE_1, SIGNATURE_2, 0x00);
+    send(CMD_SWITCH_BITRATE, 0x00, 0x00, 0x00, CAN_250KBPS);
+    send(CMD_FLASH_SET_ADDRESS, 0x00, 0x00, 0x00, 0x00); // confirms the switch
+    send(CMD_SWITCH_BITRATE, 0x00, 0x00, 0x00, CAN_95KBPS); // not possible at 16 MHz
+    run(5);
+
+    CHECK(model.txCount == 5);
+    CHECK(model.tx[2].data[2] == CMD_SWITCH_BITRATE && model.tx[2].data[7] == CAN_250KBPS);
+    CHECK(model.tx[4].data[2] == CMD_SWITCH_BITRATE && model.tx[4].data[7] == 0xFF);
+    CHECK(model.reg[Mcp2515Model::CNF1] == MCP_16MHz_250kBPS_CFG1);
+    CHECK(model.mode() == 0x00);
+  }
+
+  return RESULT();
+}
@@ -0,0 +1,136 @@
+/*
+ * MCP-CAN-Boot host tests
+ *
+ * Benchmark of a flashing session on a busy CAN bus. A trace of a bus with
+ * about 75 % load at 500 kbps is replayed through the model of the MCP2515
+ * together with the messages of the flash application. Only the messages of
+ * the bootloader may reach the receive buffers.
+ *
+ * The loop iterations (status reads) and the SPI bytes are reported for each
+ * message of the flash application. The SPI clock is F_CPU / 32, so each byte
+ * takes 16 µs at 16 MHz.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "test.h"
+#include "mcp2515_model.h"
+
+#define main bootloader_main
+#include "bootloader.cpp"
+#undef main
+
+#define IMAGE_SIZE 512
+#define TRACE_SIZE 2000
+
+static Mcp2515Model model;
+static HostFrame trace[TRACE_SIZE];
+static unsigned traceCount;
+static unsigned useful;
+static uint8_t image[IMAGE_SIZE];
+
+/**
+ * Pseudo random numbers, the same trace for each run.
+ */
+static uint32_t rnd () {
+  static uint32_t state = 0x2F6B1A3D;
+  state = state * 1103515245UL + 12345UL;
+  return state >> 8;
+}
+
+static void add (uint32_t time, uint32_t id, bool ext, const uint8_t *data) {
+  HostFrame *f = &trace[traceCount++];
+  f->time = time;
+  f->id = id;
+  f->ext = ext;
+  f->dlc = 8;
+  memcpy(f->data, data, 8);
+}
+
+/**
+ * Add a message of the flash application.
+ */
+static void addBootloader (uint32_t time, uint8_t cmd, uint8_t b3, uint32_t data) {
+  const uint8_t msg[] = { 0x00, 0x42, cmd, b3,
+    (uint8_t)(data >> 24), (uint8_t)(data >> 16), (uint8_t)(data >> 8), (uint8_t)data };
+  add(time, CAN_ID_REMOTE_TO_MCU, true, msg);
+  useful++;
+}
+
+/**
+ * Build the trace. The flash application sends a message each 2 ms, which is
+ * about the time to get the reply of the bootloader. The gaps are filled with
+ * other messages of 250 µs (11 bit CAN-ID) or 300 µs (29 bit CAN-ID) with an
+ * idle time of up to 2/3 of the message.
+ */
+static void buildTrace () {
+  uint32_t time = 0;
+  uint32_t next = 10000;
+  uint16_t offset = 0;
+  uint8_t step = 0;
+
+  for (uint16_t i = 0; i < IMAGE_SIZE; i++) {
+    image[i] = i * 7 + 1;
+  }
+
+  while (offset < IMAGE_SIZE) {
+    if (time >= next) {
+      if (step == 0) {
+        addBootloader(time, CMD_FLASH_INIT, 0x00, ((uint32_t)SIGNATURE_0 << 24) | ((uint32_t)SIGNATURE_1 << 16) | ((uint32_t)SIGNATURE_2 << 8));
+      } else if (step == 1) {
+        addBootloader(time, CMD_FLASH_SET_ADDRESS, 0x00, 0);
+      } else {
+        uint32_t data = ((uint32_t)image[offset] << 24) | ((uint32_t)image[offset + 1] << 16) | ((uint16_t)image[offset + 2] << 8) | image[offset + 3];
+        addBootloader(time, CMD_FLASH_DATA, (4 << 5) | (offset & 0x1F), data);
+        offset += 4;
+      }
+      step++;
+      next = time + 2000;
+      time += 300 + rnd() % 200;
+      continue;
+    }
+
+    uint8_t data[8];
+    for (uint8_t i = 0; i < 8; i++) {
+      data[i] = rnd();
+    }
+    bool ext = rnd() % 10 < 3;
+    uint32_t id = ext ? rnd() % 0x1FFFFFFF : rnd() % 0x7FF;
+    if (id == CAN_ID_REMOTE_TO_MCU) {
+      continue;
+    }
+    add(time, id, ext, data);
+    uint32_t len = ext ? 300 : 250;
+    time += len + rnd() % (len * 2 / 3);
+  }
+}
+
+int main () {
+  hostSpiDevice = &model;
+  buildTrace();
+
+  TEST("flashing on a busy bus") {
+    hostReset();
+    model.powerUp();
+    model.replay(trace, traceCount, 16000);
+    try {
+      bootloader_main();
+    } catch (Mcp2515Model::Stop&) {
+    }
+
+    printf("%u messages, %u for the bootloader\n", traceCount, useful);
+    printf("  other messages in the receive buffers: %u, overflows: %u\n", model.accepted - useful, model.overflows);
+    printf("  loop iterations: %u (%.1f per message)\n", model.statusReads, (double)model.statusReads / useful);
+    printf("  SPI bytes: %u (%.1f per message)\n", model.spiBytes, (double)model.spiBytes / useful);
+    // each status read without a received message takes two bytes
+    printf("  SPI bytes without idle polls: %u (%.1f per message)\n",
+      model.spiBytes - model.polls * 2, (double)(model.spiBytes - model.polls * 2) / useful);
+
+    CHECK(model.accepted == useful);
+    CHECK(model.reads == useful);
+    CHECK(memcmp(hostFlash, image, IMAGE_SIZE) == 0);
+  }
+
+  return RESULT();
+}
@@ -0,0 +1,76 @@
+/*
+ * MCP-CAN-Boot host tests
+ *
+ * Switching to the high priority CAN-IDs within a flashing session
+ * (CAN_ID_REMOTE_TO_MCU_FAST). The session must always end with start app
+ * using the default CAN-ID.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "test.h"
+#include "mcp2515_model.h"
+
+#define main bootloader_main
+#include "bootloader.cpp"
+#undef main
+
+static Mcp2515Model model;
+
+/**
+ * Put a bootloader message for this MCU onto the bus.
+ */
+static void send (uint32_t id, uint8_t cmd, uint8_t b4, uint8_t b5, uint8_t b6, uint8_t b7) {
+  const uint8_t data[] = { 0x00, 0x42, cmd, 0x00, b4, b5, b6, b7 };
+  model.send(id, true, sizeof(data), data);
+}
+
+static void run (uint8_t frames) {
+  model.stopTx = frames;
+  model.stopPolls = 100;
+  try {
+    bootloader_main();
+  } catch (Mcp2515Model::Stop&) {
+  }
+}
+
+/**
+ * Start a session and switch to the high priority CAN-IDs.
+ */
+static void startFast () {
+  hostReset();
+  model.powerUp();
+  // the CAN-IDs of the previous test are kept, unlike on a reset of the MCU
+  canIdMcuToRemote = CAN_ID_MCU_TO_REMOTE;
+  canIdRemoteToMcu = CAN_ID_REMOTE_TO_MCU;
+  send(CAN_ID_REMOTE_TO_MCU, CMD_FLASH_INIT, SIGNATURE_0, SIGNATURE_1, SIGNATURE_2, 0x00);
+  send(CAN_ID_REMOTE_TO_MCU, CMD_SWITCH_CAN_ID, 0x00, 0x00, 0x00, 0x01);
+}
+
+int main () {
+  hostSpiDevice = &model;
+
+  TEST("start app") {
+    startFast();
+    send(CAN_ID_REMOTE_TO_MCU_FAST, CMD_START_APP, 0x00, 0x00, 0x00, 0x00);
+    run(4);
+
+    CHECK(model.txCount == 4);
+    CHECK(model.tx[2].data[2] == CMD_SWITCH_CAN_ID && model.tx[2].id == CAN_ID_MCU_TO_REMOTE);
+    CHECK(model.tx[3].data[2] == CMD_START_APP && model.tx[3].id == CAN_ID_MCU_TO_REMOTE);
+  }
+
+  TEST("flash done") {
+    startFast();
+    send(CAN_ID_REMOTE_TO_MCU_FAST, CMD_FLASH_SET_ADDRESS, 0x00, 0x00, 0x00, 0x00);
+    send(CAN_ID_REMOTE_TO_MCU_FAST, CMD_FLASH_DONE, 0x00, 0x00, 0x00, 0x00);
+    run(5);
+
+    CHECK(model.txCount == 5);
+    CHECK(model.tx[3].data[2] == CMD_FLASH_READY && model.tx[3].id == CAN_ID_MCU_TO_REMOTE_FAST);
+    CHECK(model.tx[4].data[2] == CMD_START_APP && model.tx[4].id == CAN_ID_MCU_TO_REMOTE);
+  }
+
+  return RESULT();
+}
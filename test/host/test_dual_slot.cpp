@@ -0,0 +1,106 @@
+/*
+ * MCP-CAN-Boot host tests
+ *
+ * Copy of the staging slot (DUAL_SLOT). The staging slot must only be copied
+ * if the number of pages and the CRC of the request match, an interrupted copy
+ * must be finished on the next start and the copy may also be requested by
+ * the main application.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "test.h"
+
+#define main bootloader_main
+#include "bootloader.cpp"
+#undef main
+
+#define PAGES 5
+
+/**
+ * Write the new application into the staging slot like a flashing session
+ * and return its CRC.
+ */
+static uint16_t stage (uint8_t seed) {
+  uint16_t crc = 0;
+  flashErase();
+  flashSetAddress(0);
+  for (uint32_t i = 0; i < (uint32_t)PAGES * SPM_PAGESIZE; i++) {
+    uint8_t data = i * 13 + seed;
+    flashWriteByte(data);
+    crc = _crc_xmodem_update(crc, data);
+  }
+  writeFlashPage();
+  return crc;
+}
+
+static bool copied () {
+  return memcmp(hostFlash, &hostFlash[DUAL_SLOT_STAGING], (uint32_t)PAGES * SPM_PAGESIZE) == 0;
+}
+
+int main () {
+  TEST("matching CRC") {
+    hostReset();
+    uint16_t crc = stage(1);
+    CHECK(!copied());
+    CHECK(slotRequestCopy(PAGES, crc));
+    copySlot();
+    CHECK(copied());
+    CHECK(eeprom_read_byte(DUAL_SLOT_REQUEST_FLAG) == 0xFF);
+  }
+
+  TEST("wrong CRC or number of pages") {
+    hostReset();
+    uint16_t crc = stage(2);
+    CHECK(!slotRequestCopy(PAGES, crc ^ 1));
+    CHECK(!slotRequestCopy(PAGES - 1, crc));
+    CHECK(!slotRequestCopy(0, 0));
+    CHECK(!slotRequestCopy(SLOT_SIZE / SPM_PAGESIZE + 1, crc));
+    CHECK(eeprom_read_byte(DUAL_SLOT_REQUEST_FLAG) == 0xFF);
+    uint16_t writes = hostPageWrites;
+    copySlot();
+    CHECK(hostPageWrites == writes);
+  }
+
+  TEST("request by the main application") {
+    hostReset();
+    uint16_t crc = stage(3);
+    dualSlotRequestCopy(PAGES, crc);
+    copySlot();
+    CHECK(copied());
+    CHECK(eeprom_read_byte(DUAL_SLOT_REQUEST_FLAG) == 0xFF);
+  }
+
+  TEST("damaged staging slot") {
+    hostReset();
+    uint16_t crc = stage(4);
+    dualSlotRequestCopy(PAGES, crc);
+    hostFlash[DUAL_SLOT_STAGING + SPM_PAGESIZE] &= 0x7F;
+    copySlot();
+    CHECK(hostFlash[0] == 0xFF);
+    CHECK(eeprom_read_byte(DUAL_SLOT_REQUEST_FLAG) == 0xFF);
+  }
+
+  TEST("interrupted copy") {
+    hostReset();
+    uint16_t crc = stage(5);
+    dualSlotRequestCopy(PAGES, crc);
+    // the first two pages are already copied
+    memcpy(hostFlash, &hostFlash[DUAL_SLOT_STAGING], 2 * SPM_PAGESIZE);
+    uint16_t writes = hostPageWrites;
+    copySlot();
+    CHECK(copied());
+    CHECK(hostPageWrites == writes + PAGES - 2);
+  }
+
+  TEST("flash erase clears the request") {
+    hostReset();
+    uint16_t crc = stage(6);
+    CHECK(slotRequestCopy(PAGES, crc));
+    flashErase();
+    CHECK(eeprom_read_byte(DUAL_SLOT_REQUEST_FLAG) == 0xFF);
+  }
+
+  return RESULT();
+}
@@ -0,0 +1,81 @@
+/*
+ * MCP-CAN-Boot host tests
+ *
+ * Bitmap of the written pages in the EEPROM (FLASH_RESUME). The resume page
+ * must be the page behind the last written page and each EEPROM byte must
+ * only be written a few times per session.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "test.h"
+
+#define main bootloader_main
+#include "bootloader.cpp"
+#undef main
+
+#include "flash_fixture.h"
+
+/**
+ * Write the given pages like CMD_FLASH_SET_ADDRESS followed by CMD_FLASH_DATA.
+ */
+static void writePages (uint16_t page, uint16_t count) {
+  write((uint32_t)page * SPM_PAGESIZE, (uint32_t)count * SPM_PAGESIZE);
+}
+
+/**
+ * Highest number of writes of a byte of the bitmap.
+ */
+static uint32_t maxWrites () {
+  uint32_t max = 0;
+  for (uint16_t i = 0; i < FLASH_RESUME_BYTES; i++) {
+    if (hostEepromWrites[FLASH_RESUME_EEPROM_ADDR + i] > max) {
+      max = hostEepromWrites[FLASH_RESUME_EEPROM_ADDR + i];
+    }
+  }
+  return max;
+}
+
+int main () {
+  TEST("nothing to resume") {
+    hostReset();
+    CHECK(flashResumePage() == 0);
+    flashErase();
+    CHECK(flashResumePage() == 0);
+  }
+
+  TEST("interrupted session") {
+    start();
+    writePages(0, 11);
+    CHECK(flashResumePage() == 11);
+  }
+
+  TEST("skipped pages") {
+    start();
+    writePages(0, 2);
+    writePages(20, 3);
+    CHECK(flashResumePage() == 23);
+  }
+
+  TEST("last page") {
+    start();
+    writePages(FLASH_APP_PAGES - 1, 1);
+    CHECK(flashResumePage() == FLASH_APP_PAGES);
+  }
+
+  TEST("complete sessions") {
+    hostReset();
+    for (uint8_t session = 0; session < 10; session++) {
+      flashErase();
+      writePages(0, FLASH_APP_PAGES);
+      CHECK(flashResumePage() == FLASH_APP_PAGES);
+      flashResumeClear();
+      CHECK(flashResumePage() == 0);
+    }
+    CHECK(maxWrites() == 10 * 9);
+    CHECK(hostEepromWrites[FLASH_RESUME_EEPROM_ADDR + FLASH_RESUME_BYTES] == 0);
+  }
+
+  return RESULT();
+}
@@ -0,0 +1,451 @@
+/*
+ * MCP-CAN-Boot host tests
+ *
+ * MCP2517FD/MCP2518FD driver (CAN_FD) against a model of the SPI registers:
+ * initialization after reset, bit timing, TXQ and FIFO setup, filters and the
+ * mapping of the CAN FD lengths to the DLC. The whole bootloader is run
+ * against the model for the data lengths of CAN FD frames.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "test.h"
+
+#define main bootloader_main
+#include "bootloader.cpp"
+#undef main
+
+/**
+ * Register model of the MCP251xFD.
+ * The registers and the RAM are one byte array addressed like on SPI. Only the
+ * behavior used by the driver is modelled: the operation mode, the TXQ which
+ * transmits each requested message immediately and FIFO 1 with one received
+ * message at a time. The received messages are queued and the next one is put
+ * into FIFO 1 when its status is read while it is empty.
+ */
+class Mcp251xfdModel : public HostSpiDevice {
+  public:
+    static const uint16_t C1CON = 0x000;
+    static const uint16_t C1NBTCFG = 0x004;
+    static const uint16_t C1DBTCFG = 0x008;
+    static const uint16_t C1TDC = 0x00C;
+    static const uint16_t C1INT = 0x01C;
+    static const uint16_t C1TXQCON = 0x050;
+    static const uint16_t C1TXQUA = 0x058;
+    static const uint16_t C1FIFOCON1 = 0x05C;
+    static const uint16_t C1FIFOSTA1 = 0x060;
+    static const uint16_t C1FIFOUA1 = 0x064;
+    static const uint16_t C1FLTCON0 = 0x1D0;
+    static const uint16_t C1FLTOBJ0 = 0x1F0;
+    static const uint16_t C1MASK0 = 0x1F4;
+    static const uint16_t RAM = 0x400;
+    static const uint16_t OSC = 0xE00;
+
+    /**
+     * Thrown to leave the main loop of the bootloader.
+     */
+    struct Stop { };
+
+    // message objects in the RAM: TXQ first, FIFO 1 behind it (64 bytes payload)
+    static const uint16_t TXQ_OBJ = 0x000;
+    static const uint16_t RX_OBJ = 8 + 64;
+
+    uint8_t reg[0x1000];
+
+    unsigned configWrites; // bit timing written outside of the configuration mode
+    unsigned filterWrites; // filter written while enabled
+    unsigned rxReleased;
+
+    // last transmitted message object and the number of bytes written for it
+    uint8_t txObj[8 + 64];
+    unsigned txCount;
+    unsigned txLen;
+    unsigned stopTx; // stop after this number of transmitted messages (0 for no limit)
+
+    // received messages waiting for FIFO 1, kept over a reset
+    uint8_t rxQueue[8][8 + 64];
+    uint8_t rxQueueHead;
+    uint8_t rxQueueCount;
+
+    Mcp251xfdModel () {
+      powerUp();
+    }
+
+    void powerUp () {
+      memset(reg, 0x55, sizeof(reg));
+      configWrites = 0;
+      filterWrites = 0;
+      rxReleased = 0;
+      txCount = 0;
+      stopTx = 0;
+      rxQueueHead = rxQueueCount = 0;
+      reset();
+    }
+
+    void start () {
+      pos = 0;
+    }
+
+    uint8_t transfer (uint8_t data) {
+      uint8_t ret = 0x00;
+      if (pos == 0) {
+        instruction = data & 0xF0;
+        addr = (data & 0x0F) << 8;
+      } else if (pos == 1) {
+        addr |= data;
+        if (instruction == 0x00 && addr == 0x000) {
+          reset();
+        }
+      } else if (instruction == 0x30) {
+        if ((addr & 0xFFF) == C1FIFOSTA1 && !(reg[C1FIFOSTA1] & 0x01) && rxQueueCount > 0) {
+          // put the next message object into FIFO 1
+          memcpy(&reg[RAM + RX_OBJ], rxQueue[rxQueueHead++ % 8], sizeof(rxQueue[0]));
+          rxQueueCount--;
+          reg[C1FIFOSTA1] |= 0x01; // TFNRFNIF
+        }
+        ret = reg[addr++ & 0xFFF];
+      } else if (instruction == 0x20) {
+        write(addr++ & 0xFFF, data);
+      }
+      pos++;
+      return ret;
+    }
+
+    uint8_t mode () {
+      return reg[C1CON + 2] >> 5;
+    }
+
+    uint32_t reg32 (uint16_t a) {
+      return reg[a] | (reg[a + 1] << 8) | ((uint32_t)reg[a + 2] << 16) | ((uint32_t)reg[a + 3] << 24);
+    }
+
+    /**
+     * Receive a message object.
+     */
+    void receive (const uint8_t *obj, uint8_t len) {
+      memset(rxQueue[(rxQueueHead + rxQueueCount) % 8], 0, sizeof(rxQueue[0]));
+      memcpy(rxQueue[(rxQueueHead + rxQueueCount++) % 8], obj, len);
+    }
+
+  private:
+    uint8_t pos;
+    uint8_t instruction;
+    uint16_t addr;
+    uint16_t txWritten; // bytes of the TXQ message object written so far
+
+    void set32 (uint16_t a, uint32_t v) {
+      reg[a] = v;
+      reg[a + 1] = v >> 8;
+      reg[a + 2] = v >> 16;
+      reg[a + 3] = v >> 24;
+    }
+
+    void reset () {
+      memset(reg, 0x00, RAM);
+      set32(C1CON, 0x04980760);
+      set32(C1NBTCFG, 0x003E0F0F);
+      set32(C1DBTCFG, 0x000E0303);
+      set32(C1TDC, 0x00021000);
+      set32(C1TXQCON, 0x00600400);
+      set32(C1TXQUA, TXQ_OBJ);
+      set32(C1FIFOCON1, 0x00600400);
+      set32(C1FIFOUA1, RX_OBJ);
+      set32(OSC, 0x00000460);
+    }
+
+    void write (uint16_t a, uint8_t data) {
+      if (a >= C1NBTCFG && a < C1TDC + 4 && mode() != 4) {
+        configWrites++;
+      }
+      if (a >= C1FLTOBJ0 && a < C1MASK0 + 4 && (reg[C1FLTCON0] & 0x80)) {
+        filterWrites++;
+      }
+
+      if (a == C1CON + 2) {
+        // OPMOD is read-only
+        reg[a] = (reg[a] & 0xE0) | (data & 0x1F);
+      } else if (a == C1CON + 3) {
+        // the new mode is entered immediately
+        reg[a] = data;
+        reg[C1CON + 2] = (reg[C1CON + 2] & 0x1F) | ((data & 0x07) << 5);
+      } else if (a == C1TXQCON + 1) {
+        // UINC and TXREQ... transmit the message object immediately
+        reg[a] = data & ~0x03;
+        if (data & 0x01) {
+          memcpy(txObj, &reg[RAM + TXQ_OBJ], sizeof(txObj));
+          txLen = txWritten;
+          if (++txCount == stopTx) {
+            throw Stop();
+          }
+        }
+      } else if (a == C1FIFOCON1 + 1) {
+        // UINC... release the message object
+        if (data & 0x01) {
+          reg[C1FIFOSTA1] &= ~0x01;
+          rxReleased++;
+        }
+        reg[a] = data & ~0x01;
+      } else {
+        reg[a] = data;
+        if (a >= RAM + TXQ_OBJ && a < RAM + RX_OBJ) {
+          txWritten = a + 1 - (RAM + TXQ_OBJ);
+        }
+      }
+    }
+};
+
+static Mcp251xfdModel model;
+static MCP251XFD mcp;
+
+/**
+ * Check the bit timing in the NBTCFG or DBTCFG format.
+ * @param timing     The register value.
+ * @param clock      The system clock.
+ * @param bitrate    The expected bitrate.
+ * @param maxTseg1   Maximum TSEG1 (register value + 1).
+ * @param maxTseg2   Maximum TSEG2 (register value + 1).
+ */
+static void checkBitTiming (uint32_t timing, uint32_t clock, uint32_t bitrate, uint16_t maxTseg1, uint16_t maxTseg2) {
+  uint16_t sjw = (timing & 0x7F) + 1;
+  uint16_t tseg2 = ((timing >> 8) & 0x7F) + 1;
+  uint16_t tseg1 = ((timing >> 16) & 0xFF) + 1;
+  uint16_t brp = ((timing >> 24) & 0xFF) + 1;
+  uint16_t tq = 1 + tseg1 + tseg2;
+  uint32_t actual = clock / ((uint32_t)brp * tq);
+
+  // bitrate within 0.5 %, sample point at 80 % (+- 2 %)
+  CHECK(actual * 1000 >= bitrate * 995UL && actual * 1000 <= bitrate * 1005UL);
+  CHECK((1 + tseg1) * 100 >= tq * 78 && (1 + tseg1) * 100 <= tq * 82);
+  CHECK(tseg1 <= maxTseg1);
+  CHECK(tseg2 <= maxTseg2);
+  CHECK(sjw <= tseg2);
+}
+
+static const uint32_t bitrates[] = {
+  5000, 10000, 20000, 31250, 33333, 40000, 50000, 80000,
+  83333, 95000, 100000, 125000, 200000, 250000, 500000, 1000000
+};
+
+/**
+ * Send a message with the given length and return the DLC of the message
+ * object.
+ */
+static uint8_t send (uint8_t len) {
+  struct can_frame frame;
+  frame.can_id = 0x1FFFFF01 | CAN_EFF_FLAG;
+  frame.can_dlc = len;
+  for (uint8_t i = 0; i < len; i++) {
+    frame.data[i] = i + 1;
+  }
+
+  unsigned count = model.txCount;
+  CHECK(mcp.sendMessage(&frame) == MCP251XFD::ERROR_OK);
+  CHECK(model.txCount == count + 1);
+  return model.txObj[4] & 0x0F;
+}
+
+/**
+ * Receive a bootloader message with the given DLC, as a CAN FD frame if the
+ * DLC is greater than 8.
+ */
+static void receiveMsg (uint8_t dlc, uint8_t cmd, uint8_t lenAddr, const uint8_t *data, uint8_t len) {
+  uint8_t obj[8 + 64];
+  memset(obj, 0, sizeof(obj));
+  uint32_t id = ((CAN_ID_REMOTE_TO_MCU >> 18) & 0x7FF) | ((CAN_ID_REMOTE_TO_MCU & 0x3FFFF) << 11);
+  obj[0] = id;
+  obj[1] = id >> 8;
+  obj[2] = id >> 16;
+  obj[3] = id >> 24;
+  obj[4] = dlc | 0x10 | (dlc > 8 ? 0xC0 : 0x00);
+  obj[8] = MCU_ID >> 8;
+  obj[9] = MCU_ID & 0xFF;
+  obj[10] = cmd;
+  obj[11] = lenAddr;
+  memcpy(&obj[12], data, len);
+  model.receive(obj, sizeof(obj));
+}
+
+int main () {
+  hostSpiDevice = &model;
+  mcp.init();
+
+  TEST("reset") {
+    CHECK(mcp.reset() == MCP251XFD::ERROR_OK);
+    CHECK(model.mode() == 4); // configuration mode
+
+    // TXQ enabled, messages are not stored in the TEF
+    CHECK((model.reg[Mcp251xfdModel::C1CON + 2] & 0x1F) == 0x10);
+    // TXQ and FIFO 1 with 64 bytes payload, FIFO 1 for 8 received messages
+    // with the not empty interrupt
+    CHECK(model.reg[Mcp251xfdModel::C1TXQCON + 3] >> 5 == 7);
+    CHECK(model.reg[Mcp251xfdModel::C1FIFOCON1 + 3] >> 5 == 7);
+    CHECK((model.reg[Mcp251xfdModel::C1FIFOCON1 + 3] & 0x1F) == 7);
+    CHECK((model.reg[Mcp251xfdModel::C1FIFOCON1] & 0x80) == 0); // FIFO 1 receives
+    CHECK(model.reg[Mcp251xfdModel::C1FIFOCON1] & 0x01);
+    // INT pin only for received messages
+    CHECK(model.reg[Mcp251xfdModel::C1INT + 2] == 0x02);
+    CHECK(model.reg[Mcp251xfdModel::C1INT + 3] == 0x00);
+    // filter 0 accepts all messages into FIFO 1
+    CHECK(model.reg[Mcp251xfdModel::C1FLTCON0] == 0x81);
+    CHECK(model.reg32(Mcp251xfdModel::C1MASK0) == 0);
+  }
+
+  TEST("bit timing") {
+    const CAN_CLOCK clocks[] = { MCP_20MHZ, MCP_40MHZ };
+    const uint32_t clockHz[] = { 20000000UL, 40000000UL };
+    for (uint8_t c = 0; c < 2; c++) {
+      for (uint8_t s = 0; s < sizeof(bitrates) / sizeof(bitrates[0]); s++) {
+        model.powerUp();
+        mcp.reset();
+        CHECK(mcp.setBitrate((CAN_SPEED)s, clocks[c]) == MCP251XFD::ERROR_OK);
+        CHECK(model.configWrites == 0);
+        checkBitTiming(model.reg32(Mcp251xfdModel::C1NBTCFG), clockHz[c], bitrates[s], 256, 128);
+        checkBitTiming(model.reg32(Mcp251xfdModel::C1DBTCFG), clockHz[c], CAN_FD_DATA_KBPS * 1000UL, 32, 16);
+
+        // automatic transmitter delay compensation with the offset at the
+        // sample point for a data BRP of 1
+        uint32_t dbt = model.reg32(Mcp251xfdModel::C1DBTCFG);
+        uint32_t tdc = model.reg32(Mcp251xfdModel::C1TDC);
+        if ((dbt >> 24) == 0) {
+          CHECK(((tdc >> 16) & 0x03) == 0x02);
+          CHECK(((tdc >> 8) & 0x7F) == ((dbt >> 16) & 0xFF) + 1);
+        } else {
+          CHECK(tdc == 0);
+        }
+      }
+    }
+    CHECK(mcp.setBitrate(CAN_500KBPS, MCP_16MHZ) == MCP251XFD::ERROR_FAIL);
+  }
+
+  TEST("filters") {
+    model.powerUp();
+    mcp.reset();
+    CHECK(mcp.setFilters(true, 0x1FFFFF02) == MCP251XFD::ERROR_OK);
+    CHECK(model.filterWrites == 0);
+    CHECK(model.reg[Mcp251xfdModel::C1FLTCON0] == 0x81);
+    // SID in bits 0 to 10, EID in bits 11 to 28, EXIDE and MIDE in bit 30
+    uint32_t obj = model.reg32(Mcp251xfdModel::C1FLTOBJ0);
+    uint32_t mask = model.reg32(Mcp251xfdModel::C1MASK0);
+    CHECK(obj == (((0x1FFFFF02UL >> 18) & 0x7FF) | ((0x1FFFFF02UL & 0x3FFFF) << 11) | 0x40000000UL));
+    CHECK(mask == 0x5FFFFFFFUL);
+
+    CHECK(mcp.setFilters(false, 0x123) == MCP251XFD::ERROR_OK);
+    CHECK(model.filterWrites == 0);
+    CHECK(model.reg32(Mcp251xfdModel::C1FLTOBJ0) == 0x123);
+    CHECK(model.reg32(Mcp251xfdModel::C1MASK0) == 0x400007FFUL);
+  }
+
+  TEST("normal mode") {
+    CHECK(mcp.setNormalMode() == MCP251XFD::ERROR_OK);
+    CHECK(model.mode() == 0);
+  }
+
+  TEST("DLC of sent messages") {
+    static const uint8_t lengths[] = { 12, 16, 20, 24, 32, 48, 64 };
+    for (uint8_t len = 0; len <= 64; len++) {
+      uint8_t dlc = send(len);
+      if (len <= 8) {
+        CHECK(dlc == len);
+        CHECK((model.txObj[4] & 0xC0) == 0x00); // classic CAN frame
+      } else {
+        CHECK(dlc >= 9);
+        CHECK(lengths[dlc - 9] >= len);
+        CHECK(dlc == 9 || lengths[dlc - 10] < len);
+        CHECK((model.txObj[4] & 0xC0) == 0xC0); // FDF and BRS
+      }
+      CHECK(model.txObj[4] & 0x10); // IDE
+
+      // the payload is padded to the length of the DLC and to full words
+      uint8_t padded = (len <= 8) ? len : lengths[dlc - 9];
+      CHECK(model.txLen == 8u + ((padded + 3) & ~3));
+      for (uint8_t i = 0; i < padded; i++) {
+        CHECK(model.txObj[8 + i] == (i < len ? i + 1 : 0));
+      }
+    }
+
+    struct can_frame frame;
+    frame.can_id = 0x123;
+    frame.can_dlc = 65;
+    CHECK(mcp.sendMessage(&frame) == MCP251XFD::ERROR_FAILTX);
+  }
+
+  TEST("DLC of received messages") {
+    static const uint8_t lengths[] = { 12, 16, 20, 24, 32, 48, 64 };
+    for (uint8_t dlc = 0; dlc <= 15; dlc++) {
+      for (uint8_t fdf = 0; fdf <= 1; fdf++) {
+        uint8_t obj[8 + 64];
+        memset(obj, 0, sizeof(obj));
+        // extended CAN-ID 0x1FFFFF02
+        uint32_t id = ((0x1FFFFF02UL >> 18) & 0x7FF) | ((0x1FFFFF02UL & 0x3FFFF) << 11);
+        obj[0] = id;
+        obj[1] = id >> 8;
+        obj[2] = id >> 16;
+        obj[3] = id >> 24;
+        obj[4] = dlc | 0x10 | (fdf ? 0xC0 : 0x00);
+        for (uint8_t i = 0; i < 64; i++) {
+          obj[8 + i] = 0xA0 + i;
+        }
+        model.receive(obj, sizeof(obj));
+
+        unsigned released = model.rxReleased;
+        struct can_frame frame;
+        CHECK(mcp.readMessage(&frame) == MCP251XFD::ERROR_OK);
+        CHECK(model.rxReleased == released + 1);
+        CHECK(frame.can_id == (0x1FFFFF02UL | CAN_EFF_FLAG));
+
+        uint8_t len = dlc <= 8 ? dlc : (fdf ? lengths[dlc - 9] : 8);
+        CHECK(frame.can_dlc == len);
+        for (uint8_t i = 0; i < len; i++) {
+          CHECK(frame.data[i] == 0xA0 + i);
+        }
+
+        CHECK(mcp.readMessage(&frame) == MCP251XFD::ERROR_NOMSG);
+      }
+    }
+  }
+
+  TEST("padding of CAN FD frames") {
+    hostReset();
+    model.powerUp();
+
+    const uint8_t signature[] = { SIGNATURE_0, SIGNATURE_1, SIGNATURE_2, 0x00 };
+    receiveMsg(8, CMD_FLASH_INIT, 0x00, signature, 4);
+
+    // 17 bytes in a frame of 24 bytes, so 3 bytes of padding
+    uint8_t data[20];
+    for (uint8_t i = 0; i < 20; i++) {
+      data[i] = (i < 17) ? i + 1 : 0xEE;
+    }
+    receiveMsg(12, CMD_FLASH_DATA, (3 << 5) | 0, data, 20);
+
+    // the next 4 bytes at the address 17 in a classic frame
+    const uint8_t next[] = { 18, 19, 20, 21 };
+    receiveMsg(8, CMD_FLASH_DATA, (4 << 5) | 17, next, 4);
+
+    // 7 bytes for the EEPROM in a frame of 16 bytes, so 5 bytes of padding
+    receiveMsg(10, CMD_EEPROM_DATA, (5 << 5) | 0, data, 12);
+
+    // bootloader start, flash ready, 2x flash ready and eeprom ready
+    model.stopTx = 5;
+    try {
+      bootloader_main();
+    } catch (Mcp251xfdModel::Stop&) {
+    }
+    CHECK(model.txCount == 5);
+    CHECK(model.txObj[8 + 2] == CMD_EEPROM_READY);
+    CHECK(model.txObj[8 + 7] == 7);
+
+    writeFlashPage();
+    for (uint8_t i = 0; i < 21; i++) {
+      CHECK(hostFlash[i] == i + 1);
+    }
+    CHECK(hostFlash[21] == 0xFF);
+    for (uint8_t i = 0; i < 7; i++) {
+      CHECK(hostEeprom[i] == i + 1);
+    }
+    CHECK(hostEeprom[7] == 0xFF);
+  }
+
+  return RESULT();
+}
@@ -0,0 +1,65 @@
+/*
+ * MCP-CAN-Boot host tests
+ *
+ * Flash data filled directly into the temporary page buffer (FLASH_NO_BUFFER).
+ * Bytes skipped by a new flash address must be filled with 0xFF and each word
+ * of the temporary page buffer must only be filled once.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "test.h"
+
+#define main bootloader_main
+#include "bootloader.cpp"
+#undef main
+
+#include "flash_fixture.h"
+
+int main () {
+  TEST("odd address in the next page") {
+    start();
+    write(0, 3);
+    write(SPM_PAGESIZE + 1, 3);
+    done();
+  }
+
+  TEST("odd address in the same page") {
+    start();
+    write(0, 3);
+    write(9, 3);
+    done();
+  }
+
+  TEST("odd address after a page without data") {
+    start();
+    write(0, 3);
+    write(2 * SPM_PAGESIZE, 0);
+    write(3 * SPM_PAGESIZE + 5, 2);
+    done();
+  }
+
+  TEST("same address again") {
+    start();
+    write(0, 3);
+    write(3, 5);
+    done();
+  }
+
+  TEST("low byte of the started word again") {
+    start();
+    write(0, 3);
+    write(2, 5);
+    done();
+  }
+
+  TEST("full pages") {
+    start();
+    write(0, 2 * SPM_PAGESIZE + 1);
+    done();
+    CHECK(hostPageWrites == 3);
+  }
+
+  return RESULT();
+}
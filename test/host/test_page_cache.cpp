@@ -0,0 +1,61 @@
+/*
+ * MCP-CAN-Boot host tests
+ *
+ * Flash data written out of order using the page cache (FLASH_PAGE_CACHE).
+ * All pages must be written completely when flashing is done, including the
+ * cached page selected as current page after writing a page.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "test.h"
+
+#define main bootloader_main
+#include "bootloader.cpp"
+#undef main
+
+#include "flash_fixture.h"
+
+int main () {
+  TEST("partial page, partial previous page") {
+    start();
+    write(6 * SPM_PAGESIZE, 64);
+    write(5 * SPM_PAGESIZE, 32);
+    done();
+  }
+
+  TEST("partial page, full previous page") {
+    start();
+    write(6 * SPM_PAGESIZE, 64);
+    write(5 * SPM_PAGESIZE, SPM_PAGESIZE);
+    done();
+  }
+
+  TEST("previous page completes the cached page") {
+    start();
+    write(6 * SPM_PAGESIZE + 16, SPM_PAGESIZE - 16);
+    write(5 * SPM_PAGESIZE, SPM_PAGESIZE + 16);
+    done();
+    CHECK(hostPageWrites == 2);
+  }
+
+  TEST("eviction of the least recently used page") {
+    start();
+    write(2 * SPM_PAGESIZE + 8, 8);
+    write(4 * SPM_PAGESIZE + 8, 8);
+    write(6 * SPM_PAGESIZE + 8, 8);
+    write(3 * SPM_PAGESIZE, 8);
+    done();
+    CHECK(hostPageWrites == 4);
+  }
+
+  TEST("in order") {
+    start();
+    write(0, 5 * SPM_PAGESIZE + 3);
+    done();
+    CHECK(hostPageWrites == 6);
+  }
+
+  return RESULT();
+}
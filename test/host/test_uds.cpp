@@ -0,0 +1,65 @@
+/*
+ * MCP-CAN-Boot host tests
+ *
+ * UDS requests through the masks and filters of the MCP2515 (UDS). The
+ * filters must be set to the UDS request CAN-ID instead of the CAN-ID of the
+ * bootloader messages.
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#include "test.h"
+#include "mcp2515_model.h"
+
+#define main bootloader_main
+#include "bootloader.cpp"
+#undef main
+
+static Mcp2515Model model;
+
+/**
+ * Run the bootloader until it sent the given number of frames or polled the
+ * MCP2515 100 times without a received frame.
+ */
+static void run (uint8_t frames) {
+  model.stopTx = frames;
+  model.stopPolls = 100;
+  try {
+    bootloader_main();
+  } catch (Mcp2515Model::Stop&) {
+  }
+}
+
+int main () {
+  hostSpiDevice = &model;
+
+  TEST("diagnostic session control") {
+    hostReset();
+    model.powerUp();
+    const uint8_t request[] = { 0x02, UDS_SID_DIAGNOSTIC_SESSION_CONTROL, 0x02 };
+    model.send(UDS_CAN_ID_REQUEST, true, sizeof(request), request);
+    run(1);
+
+    CHECK(model.accepted == 1);
+    CHECK(model.rejected == 0);
+    CHECK(model.txCount == 1);
+    CHECK(model.tx[0].id == UDS_CAN_ID_RESPONSE);
+    CHECK(model.tx[0].data[1] == UDS_SID_DIAGNOSTIC_SESSION_CONTROL + 0x40);
+    CHECK(model.tx[0].data[2] == 0x02);
+  }
+
+  TEST("bootloader message") {
+    hostReset();
+    model.powerUp();
+    const uint8_t msg[] = { 0x00, 0x42, CMD_FLASH_INIT, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    model.send(CAN_ID_REMOTE_TO_MCU, true, sizeof(msg), msg);
+    run(1);
+
+    CHECK(model.accepted == 0);
+    CHECK(model.rejected == 1);
+    CHECK(model.txCount == 0);
+  }
+
+  return RESULT();
+}
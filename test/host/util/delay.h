@@ -0,0 +1,14 @@
+/*
+ * MCP-CAN-Boot host tests
+ *
+ * Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+ * License: CC BY-NC-SA 4.0
+ */
+
+#ifndef __HOST_UTIL_DELAY_H__
+#define __HOST_UTIL_DELAY_H__
+
+static inline void _delay_ms (double ms) { (void)ms; }
+static inline void _delay_us (double us) { (void)us; }
+
+#endif
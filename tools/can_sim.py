@@ -0,0 +1,725 @@
+#!/usr/bin/env python3
+"""
+MCP-CAN-Boot
+
+Discrete-event simulation of flashing one or more bootloaders on a shared CAN
+bus, to compare the protocol modes before trying them on a real bus.
+
+The bus is modelled at bit level: the length of each frame is calculated from
+its actual bits including the bit stuffing and the CRC, the arbitration
+compares the arbitration fields bit by bit, and random bit errors cause error
+frames and retransmissions with the error counters of the transmitter
+(error passive and bus-off included).
+
+Each bootloader is the real bootloader of src/, built with the models of the
+host tests (test/host/can_sim_node.cpp) for an ATmega328P and run as a
+process in lockstep with the simulation. Its time advances with each SPI byte
+to the register model of the MCP2515 and with the page erase and page write
+times of the flash, so the masks, filters and receive buffers of the MCP2515,
+the transmissions and the background erase of FLASH_ERASE_AHEAD are those of
+the actual code. The application flash is checked after the flashing. The
+flash application (host) sends one command at a time and resends it after a
+timeout. Production traffic is added by periodic messages, which are
+simulated a second time without the flashing to show the latency impact.
+
+The simulation is deterministic for a given seed.
+
+Example:
+
+  python3 tools/can_sim.py --nodes 4 --parallel --size 16384 \\
+    --traffic 0x100:10:8 --traffic 0x200:5:4 --ber 1e-6 --seed 1
+
+Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+License: CC BY-NC-SA 4.0
+"""
+
+import argparse
+import heapq
+import os
+import random
+import subprocess
+import sys
+import tempfile
+import zlib
+
+import flash_session
+
+CMD_BOOTLOADER_START = 0x02
+CMD_FLASH_READY = 0x04
+CMD_FLASH_INIT = 0x06
+CMD_FLASH_DATA = 0x08
+CMD_FLASH_SET_ADDRESS = 0x0A
+CMD_FLASH_DATA_ERROR = 0x0D
+CMD_FLASH_RANGE = 0x0E
+CMD_FLASH_DONE = 0x10
+CMD_FLASH_ERASE = 0x20
+CMD_FLASH_DONE_VERIFY = 0x50
+CMD_START_APP = 0x80
+
+# ATmega328P with a bootloader of 4 KiB, like the models of test/host
+SIGNATURE = (0x1E, 0x95, 0x0F)
+PAGE_SIZE = 128
+APP_SIZE = 0x7000
+
+HOST_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'test', 'host')
+
+MS = 1000000  # nanoseconds per millisecond
+US = 1000     # nanoseconds per microsecond
+
+ERROR_FLAG_BITS = 6
+ERROR_DELIMITER_BITS = 8
+IFS_BITS = 3
+SUSPEND_BITS = 8         # suspend transmission of error passive transmitters
+BUS_OFF_RECOVERY_BITS = 128 * 11
+
+
+def to_bits(value, n):
+    return [(value >> i) & 1 for i in range(n - 1, -1, -1)]
+
+
+def crc15(bits):
+    crc = 0
+    for b in bits:
+        nxt = b ^ ((crc >> 14) & 1)
+        crc = (crc << 1) & 0x7FFF
+        if nxt:
+            crc ^= 0x4599
+    return crc
+
+
+def stuff(bits):
+    out = []
+    last, count = None, 0
+    for b in bits:
+        out.append(b)
+        if b == last:
+            count += 1
+        else:
+            last, count = b, 1
+        if count == 5:
+            last, count = 1 - b, 1
+            out.append(last)
+    return out
+
+
+class Frame:
+    """A classic CAN data frame with its bits on the bus."""
+
+    def __init__(self, can_id, ext, data, owner=None):
+        self.can_id = can_id
+        self.ext = ext
+        self.data = bytes(data)
+        self.owner = owner
+        self.queued = None  # time the frame was queued for transmission
+        self.on_bus = False
+
+        bits = [0]  # SOF
+        if ext:
+            bits += to_bits(can_id >> 18, 11) + [1, 1] + to_bits(can_id & 0x3FFFF, 18) + [0, 0, 0]
+            arb = 1 + 11 + 2 + 18 + 1
+        else:
+            bits += to_bits(can_id, 11) + [0, 0, 0]
+            arb = 1 + 11 + 2
+        bits += to_bits(len(self.data), 4)
+        for b in self.data:
+            bits += to_bits(b, 8)
+        bits += to_bits(crc15(bits), 15)
+
+        self.arbitration = tuple(bits[:arb])
+        self.payload = tuple(bits[arb:])
+        # CRC delimiter, ACK slot, ACK delimiter and EOF are not stuffed
+        self.bits = len(stuff(bits)) + 1 + 2 + 7
+
+
+class Node:
+    """A CAN node with its transmit buffers and the transmit error counter."""
+
+    def __init__(self, sim, name, tx_buffers=None, one_shot=False):
+        self.sim = sim
+        self.name = name
+        self.tx = []
+        self.tx_buffers = tx_buffers  # None for a FIFO of unlimited size
+        self.one_shot = one_shot
+        self.tec = 0
+        self.ready_at = 0
+        self.sent = 0
+        self.tx_errors = 0
+        self.dropped = 0
+        sim.bus.nodes.append(self)
+
+    def send(self, frame):
+        if self.tx_buffers is not None and len(self.tx) >= self.tx_buffers:
+            self.dropped += 1
+            return False
+        frame.owner = self
+        frame.queued = self.sim.now
+        self.tx.append(frame)
+        self.sim.bus.request()
+        return True
+
+    def pending(self):
+        if not self.tx or self.sim.now < self.ready_at:
+            return None
+        if self.tx_buffers is None:
+            return self.tx[0]
+        return min(self.tx, key=lambda f: f.arbitration)
+
+    def tx_done(self, frame):
+        self.tx.remove(frame)
+        self.sent += 1
+        self.tec = max(0, self.tec - 1)
+        if self.tec >= 128:
+            self.ready_at = self.sim.now + SUSPEND_BITS * self.sim.bus.bit_ns
+
+    def tx_error(self, frame):
+        self.tx_errors += 1
+        self.tec += 8
+        if self.one_shot:
+            self.tx.remove(frame)
+        if self.tec >= 256:
+            # bus-off... all pending frames are lost in the MCP2515
+            self.dropped += len(self.tx)
+            self.tx = []
+            self.tec = 0
+            self.ready_at = self.sim.now + BUS_OFF_RECOVERY_BITS * self.sim.bus.bit_ns
+            self.sim.at(self.ready_at, self.sim.bus.request)
+        elif self.tec >= 128:
+            self.ready_at = self.sim.now + SUSPEND_BITS * self.sim.bus.bit_ns
+
+    def lost_arbitration(self, frame):
+        if self.one_shot:
+            self.tx.remove(frame)
+            self.dropped += 1
+
+    def receive(self, frame):
+        pass
+
+
+class Bus:
+    """The shared bus with bitwise arbitration and error frames."""
+
+    def __init__(self, sim, bitrate, ber):
+        self.sim = sim
+        self.bit_ns = 1000000000 // bitrate
+        self.ber = ber
+        self.nodes = []
+        self.busy_until = 0
+        self.scheduled = False
+        self.busy_ns = 0
+        self.frames = 0
+        self.error_frames = 0
+
+    def request(self):
+        if not self.scheduled:
+            self.scheduled = True
+            self.sim.at(max(self.sim.now, self.busy_until), self.arbitrate)
+
+    def arbitrate(self):
+        self.scheduled = False
+        contenders = [(n, n.pending()) for n in self.nodes]
+        contenders = [(n, f) for n, f in contenders if f is not None]
+        if not contenders:
+            # wake up when a suspended node may send again
+            waiting = [n.ready_at for n in self.nodes if n.tx and n.ready_at > self.sim.now]
+            if waiting:
+                self.scheduled = True
+                self.sim.at(min(waiting), self.arbitrate)
+            return
+
+        arb = min(f.arbitration for _, f in contenders)
+        winners = [(n, f) for n, f in contenders if f.arbitration == arb]
+        for n, f in contenders:
+            if f.arbitration != arb:
+                n.lost_arbitration(f)
+
+        frame = winners[0][1]
+        for _, f in winners:
+            f.on_bus = True
+        error_at = None
+        if any(f.payload != frame.payload for _, f in winners[1:]):
+            # same CAN-ID with different data... bit error at the first difference
+            error_at = len(arb) + min(next(i for i, (a, b) in enumerate(zip(frame.payload, f.payload)) if a != b)
+                                      for _, f in winners[1:] if f.payload != frame.payload)
+        elif self.ber > 0 and self.sim.rng.random() < 1 - (1 - self.ber) ** frame.bits:
+            error_at = self.sim.rng.randrange(frame.bits)
+
+        start = self.sim.now
+        if error_at is None:
+            end = start + frame.bits * self.bit_ns
+            self.frames += 1
+            self.sim.at(end, lambda: self.complete(winners, frame))
+        else:
+            end = start + (error_at + 1 + ERROR_FLAG_BITS + ERROR_DELIMITER_BITS) * self.bit_ns
+            self.error_frames += 1
+            self.sim.at(end, lambda: self.error(winners))
+        self.busy_ns += end - start
+        self.busy_until = end + IFS_BITS * self.bit_ns
+        self.request()
+
+    def complete(self, winners, frame):
+        for n, f in winners:
+            f.on_bus = False
+            n.tx_done(f)
+        for n in self.nodes:
+            if all(n is not w for w, _ in winners):
+                n.receive(frame)
+
+    def error(self, winners):
+        for n, f in winners:
+            f.on_bus = False
+            n.tx_error(f)
+
+
+class TrafficNode(Node):
+    """Periodic production traffic."""
+
+    def __init__(self, sim, can_id, ext, period_ms, dlc, phase):
+        super().__init__(sim, 'traffic 0x%x' % can_id, tx_buffers=3)
+        self.can_id = can_id
+        self.ext = ext
+        self.period = int(period_ms * MS)
+        self.dlc = dlc
+        self.latencies = []
+        sim.at(phase, self.tick)
+
+    def tick(self):
+        self.send(Frame(self.can_id, self.ext, bytes(self.dlc)))
+        self.sim.at(self.sim.now + self.period, self.tick)
+
+    def tx_done(self, frame):
+        super().tx_done(frame)
+        self.latencies.append(self.sim.now - frame.queued)
+
+
+class BootloaderNode(Node):
+    """The bootloader of one MCU with an MCP2515.
+
+    The bootloader of src/ runs as a process built from
+    test/host/can_sim_node.cpp with the models of the host tests. It runs in
+    steps up to the time of the next event of the simulation or its next
+    transmission, so it never misses an event of the bus.
+    """
+
+    def __init__(self, sim, cfg, mcu_id):
+        # the bootloader only uses TXB0 of the MCP2515
+        super().__init__(sim, 'bootloader 0x%04x' % mcu_id, tx_buffers=1, one_shot=cfg.one_shot)
+        self.cfg = cfg
+        self.mcu_id = mcu_id
+        self.proc = None
+        self.clock = 0
+        self.frame = None  # frame of TXB0
+        self.overflows = 0
+        self.crc = None  # CRC-32 of the application flash after the start of the application
+        sim.runners.append(self)
+
+    def boot(self):
+        self.proc = subprocess.Popen(
+            [self.cfg.node, '0x%x' % self.mcu_id, str(self.sim.now), str(int(self.cfg.spi_byte_time * US)),
+             str(int(self.cfg.erase_time * MS)), str(int(self.cfg.write_time * MS))],
+            stdin=subprocess.PIPE, stdout=subprocess.PIPE, universal_newlines=True)
+        self.clock = self.sim.now
+
+    def command(self, line):
+        if self.proc is not None:
+            self.proc.stdin.write(line + '\n')
+
+    def reply(self):
+        self.proc.stdin.flush()
+        reply = self.proc.stdout.readline().split()
+        if not reply:
+            raise RuntimeError('%s: node process failed' % self.name)
+        return reply
+
+    def step(self, t):
+        """Run the bootloader until the time t or its next transmission."""
+        self.command('run %d' % t)
+        reply = self.reply()
+        self.clock = int(reply[1])
+        if reply[0] == 'tx':
+            frame = Frame(int(reply[2], 16), reply[3] == '1', bytes.fromhex(reply[4]) if len(reply) > 4 else b'')
+            self.sim.at(self.clock, lambda: self.transmit(frame))
+        elif reply[0] == 'abort':
+            self.sim.at(self.clock, self.abort)
+        elif reply[0] == 'app':
+            self.finish(reply[2:])
+
+    def stop(self):
+        """Stop a bootloader which did not start the application."""
+        if self.proc is not None:
+            self.command('quit')
+            self.finish(self.reply()[1:])
+
+    def finish(self, stats):
+        self.overflows = int(stats[0])
+        if len(stats) > 1:
+            self.crc = int(stats[1], 16)
+        self.proc.wait()
+        self.proc = None
+
+    def transmit(self, frame):
+        self.frame = frame
+        self.send(frame)
+
+    def abort(self):
+        # a frame on the bus is not aborted by the MCP2515
+        if self.frame in self.tx and not self.frame.on_bus:
+            self.tx.remove(self.frame)
+            self.dropped += 1
+        self.frame = None
+
+    def tx_done(self, frame):
+        super().tx_done(frame)
+        self.command('txdone')
+
+    def tx_error(self, frame):
+        pending = list(self.tx)
+        bus_off = self.tec + 8 >= 256
+        super().tx_error(frame)
+        self.command('txerror')
+        if bus_off:
+            # bus-off... the MCP2515 keeps TXB0 and sends it after the recovery
+            if not self.one_shot:
+                self.tx = pending
+                self.dropped -= len(pending)
+            self.command('busoff')
+            self.sim.at(self.ready_at, lambda: self.command('busok'))
+
+    def lost_arbitration(self, frame):
+        super().lost_arbitration(frame)
+        self.command('txlost')
+
+    def receive(self, frame):
+        self.command('rx %x %d %s' % (frame.can_id, frame.ext, frame.data.hex()))
+
+
+class Session:
+    """Flashing of one bootloader by the flash application replaying the frames of a session."""
+
+    def __init__(self, host, mcu_id, frames, data_index, size):
+        self.host = host
+        self.mcu_id = mcu_id
+        self.frames = frames
+        self.data_index = data_index
+        self.size = size
+        self.state = 'wait'
+        self.index = 0
+        self.sent_at = None
+        self.timer = 0
+        self.retries = 0
+        self.rtt = []
+        self.start = None
+        self.end = None
+
+    def transmit(self):
+        data = self.frames[self.index][0]
+        cfg = self.host.cfg
+        self.host.send(Frame(cfg.remote_to_mcu, cfg.ext,
+                             bytes([self.mcu_id >> 8, self.mcu_id & 0xFF]) + data[2:]))
+        self.sent_at = self.host.sim.now
+        self.timer += 1
+        timer = self.timer
+        self.host.sim.at(self.sent_at + cfg.timeout * MS, lambda: self.expire(timer))
+
+    def expire(self, timer):
+        if timer == self.timer and self.state == 'flashing':
+            self.retries += 1
+            self.transmit()
+
+    def handle(self, cmd, addr):
+        now = self.host.sim.now
+        if self.state == 'wait':
+            if cmd == CMD_BOOTLOADER_START:
+                self.start = now
+                self.state = 'flashing'
+                self.transmit()
+            return
+
+        if self.state == 'done':
+            return
+
+        self.timer += 1  # any response stops the timeout
+        self.rtt.append(now - self.sent_at)
+
+        _, expect_cmd, expect_addr = self.frames[self.index]
+        if cmd == expect_cmd and (addr == expect_addr or cmd != CMD_FLASH_READY):
+            self.index += 1
+        elif cmd in (CMD_FLASH_READY, CMD_FLASH_DATA_ERROR) and addr in self.data_index:
+            # continue at the address expected by the bootloader
+            self.index = self.data_index[addr]
+
+        if cmd in (CMD_START_APP, CMD_FLASH_DONE_VERIFY) or self.index >= len(self.frames):
+            self.state = 'done'
+            self.end = now
+            self.host.session_done(self)
+        else:
+            self.transmit()
+
+
+class HostNode(Node):
+    """The flash application using a SocketCAN interface."""
+
+    def __init__(self, sim, cfg, sessions):
+        super().__init__(sim, 'host')
+        self.cfg = cfg
+        self.sessions = {s.mcu_id: s for s in sessions}
+        for s in sessions:
+            s.host = self
+        self.on_done = None
+
+    def receive(self, frame):
+        if frame.can_id != self.cfg.mcu_to_remote or frame.ext != self.cfg.ext or len(frame.data) != 8:
+            return
+        session = self.sessions.get((frame.data[0] << 8) | frame.data[1])
+        if session is None:
+            return
+        cmd, addr = frame.data[2], int.from_bytes(frame.data[4:8], 'big')
+        self.sim.at(self.sim.now + self.cfg.host_delay * US, lambda: session.handle(cmd, addr))
+
+    def session_done(self, session):
+        if self.on_done:
+            self.on_done(session)
+
+
+class Simulator:
+    def __init__(self, cfg, seed):
+        self.now = 0
+        self.queue = []
+        self.seq = 0
+        self.rng = random.Random(seed)
+        self.bus = Bus(self, cfg.bitrate, cfg.ber)
+        self.runners = []
+        self.stopped = False
+
+    def at(self, t, fn):
+        self.seq += 1
+        heapq.heappush(self.queue, (int(t), self.seq, fn))
+
+    def run(self, until):
+        while not self.stopped:
+            running = [n for n in self.runners if n.proc is not None]
+            if not self.queue and not running:
+                break
+            t = min(self.queue[0][0], until) if self.queue else until
+
+            # run the bootloaders up to the next event, a transmission of a
+            # bootloader may add an earlier event
+            for n in running:
+                if n.clock < t:
+                    n.step(t)
+                    if self.queue and self.queue[0][0] < t:
+                        break
+            if self.queue and self.queue[0][0] < t:
+                continue
+
+            if not self.queue or self.queue[0][0] > until:
+                self.now = until
+                break
+            t, _, fn = heapq.heappop(self.queue)
+            self.now = t
+            fn()
+
+
+def add_traffic(sim, cfg, rng):
+    nodes = []
+    for spec in cfg.traffic:
+        parts = spec.split(':')
+        can_id = int(parts[0], 0)
+        period = float(parts[1])
+        dlc = int(parts[2]) if len(parts) > 2 else 8
+        phase = int(rng.random() * period * MS)
+        nodes.append(TrafficNode(sim, can_id, can_id > 0x7FF, period, dlc, phase))
+    return nodes
+
+
+def run_flashing(cfg):
+    rng = random.Random(cfg.seed)
+    sim = Simulator(cfg, rng.getrandbits(32))
+    traffic = add_traffic(sim, cfg, rng)
+
+    if cfg.session:
+        session = flash_session.SessionFile(cfg.session)
+        frames = list(session.frames())
+    else:
+        image = {addr: rng.getrandbits(8) for addr in range(cfg.size)}
+        flags = (flash_session.FLAG_ERASE if cfg.erase else 0) | (flash_session.FLAG_RANGE if cfg.erase_ahead else 0)
+        content = flash_session.compile_session(image, SIGNATURE, PAGE_SIZE, APP_SIZE - 1, flags)
+        frames = list(flash_session.SessionBuffer(content).frames())
+    data_index = {}
+    size = 0
+    for i, (data, _, addr) in enumerate(frames):
+        if data[2] == CMD_FLASH_DATA:
+            data_index.setdefault(addr - (data[3] >> 5), i)
+            size += data[3] >> 5
+
+    bootloaders = [BootloaderNode(sim, cfg, 0x0042 + i) for i in range(cfg.nodes)]
+    sessions = [Session(None, b.mcu_id, frames, data_index, size) for b in bootloaders]
+    host = HostNode(sim, cfg, sessions)
+
+    remaining = list(bootloaders)
+
+    def next_node(session=None):
+        if session is not None and all(s.state == 'done' for s in sessions):
+            sim.stopped = True
+            return
+        if cfg.parallel:
+            if session is None:
+                for b in remaining:
+                    sim.at(sim.now + int(rng.random() * cfg.reset_time * MS), b.boot)
+        elif remaining:
+            # reset the next MCU into the bootloader
+            sim.at(sim.now + cfg.reset_time * MS, remaining.pop(0).boot)
+
+    host.on_done = next_node
+    next_node()
+    sim.run(int(cfg.max_time * 1000 * MS))
+
+    # let the bootloaders start the application after their last response
+    for b in bootloaders:
+        if b.proc is not None:
+            b.step(sim.now + 10 * MS)
+            b.stop()
+
+    return sim, traffic, bootloaders, sessions, host, flash_crc(frames)
+
+
+def flash_crc(frames):
+    """CRC-32 of the application flash expected after the frames."""
+    flash = bytearray(b'\xff' * APP_SIZE)
+    addr = 0
+    for data, _, _ in frames:
+        if data[2] == CMD_FLASH_SET_ADDRESS:
+            addr = int.from_bytes(data[4:8], 'big')
+        elif data[2] == CMD_FLASH_DATA:
+            n = data[3] >> 5
+            flash[addr:addr + n] = data[4:4 + n]
+            addr += n
+    return zlib.crc32(flash)
+
+
+def build_node(cfg, path):
+    """Build the bootloader node of test/host with the configuration of the simulation."""
+    config = [
+        '-DSIM_TIMEOUT=%d' % cfg.boot_timeout,
+        '-DSIM_CAN_EFF=%s' % ('true' if cfg.ext else 'false'),
+        '-DSIM_CAN_ID_MCU_TO_REMOTE=0x%xUL' % cfg.mcu_to_remote,
+        '-DSIM_CAN_ID_REMOTE_TO_MCU=0x%xUL' % cfg.remote_to_mcu,
+    ]
+    if cfg.erase_ahead:
+        config.append('-DFLASH_ERASE_AHEAD')
+    if cfg.one_shot:
+        config.append('-DCAN_ONE_SHOT')
+    subprocess.check_call(['make', '-s', '-C', HOST_DIR, 'sim_node',
+                           'SIM_CONFIG=' + ' '.join(config), 'SIM_NODE=' + path])
+
+
+def run_baseline(cfg, duration):
+    rng = random.Random(cfg.seed)
+    sim = Simulator(cfg, rng.getrandbits(32))
+    traffic = add_traffic(sim, cfg, rng)
+    sim.run(duration)
+    return sim, traffic
+
+
+def percentiles(values):
+    if not values:
+        return 'n/a'
+    values = sorted(values)
+
+    def p(q):
+        return values[min(len(values) - 1, int(q * len(values)))] / US
+
+    return 'p50 %8.1f  p90 %8.1f  p99 %8.1f  max %8.1f us' % (p(0.5), p(0.9), p(0.99), values[-1] / US)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Simulate flashing MCP-CAN-Boot bootloaders on a shared CAN bus.')
+    parser.add_argument('--seed', type=int, default=1, help='seed of the simulation (default: 1)')
+    parser.add_argument('--bitrate', type=int, default=500000, help='bitrate in bit/s (default: 500000)')
+    parser.add_argument('--ber', type=float, default=0.0, help='bit error rate (default: 0)')
+    parser.add_argument('--nodes', type=int, default=1, help='number of bootloaders on the bus (default: 1)')
+    parser.add_argument('--parallel', action='store_true', help='flash all bootloaders at the same time instead of one after another')
+    parser.add_argument('--size', type=int, default=16384, help='size of the application in bytes (default: 16384)')
+    parser.add_argument('--erase-time', type=float, default=4.0, help='page erase time in ms (default: 4.0)')
+    parser.add_argument('--write-time', type=float, default=4.0, help='page write time in ms (default: 4.0)')
+    parser.add_argument('--spi-byte-time', type=float, default=16.0, help='time of one SPI byte between the bootloader and the MCP2515 in us (default: 16, F_CPU / 32 at 16 MHz)')
+    parser.add_argument('--host-delay', type=float, default=200.0, help='response time of the flash application in us (default: 200)')
+    parser.add_argument('--timeout', type=float, default=100.0, help='response timeout of the flash application in ms (default: 100)')
+    parser.add_argument('--boot-timeout', type=float, default=250.0, help='TIMEOUT of the bootloader in ms (default: 250)')
+    parser.add_argument('--reset-time', type=float, default=10.0, help='time to reset an MCU into the bootloader in ms (default: 10)')
+    parser.add_argument('--session', help='replay a session file of tools/flash_session.py instead of a random application')
+    parser.add_argument('--erase', action='store_true', help='send flash erase before the flash data')
+    parser.add_argument('--erase-ahead', action='store_true', help='announce the flash range for the background erase (FLASH_ERASE_AHEAD)')
+    parser.add_argument('--one-shot', action='store_true', help='one-shot transmission of the bootloader (CAN_ONE_SHOT)')
+    parser.add_argument('--mcu-to-remote', type=lambda x: int(x, 0), help='CAN_ID_MCU_TO_REMOTE (default: 0x1FFFFF01, 0x1F1 with --sff)')
+    parser.add_argument('--remote-to-mcu', type=lambda x: int(x, 0), help='CAN_ID_REMOTE_TO_MCU (default: 0x1FFFFF02, 0x1F2 with --sff)')
+    parser.add_argument('--sff', action='store_true', help='use standard frame format CAN-IDs for the bootloader')
+    parser.add_argument('--traffic', action='append', default=[], metavar='ID:PERIOD_MS[:DLC]', help='periodic production traffic, may be used multiple times')
+    parser.add_argument('--max-time', type=float, default=600.0, help='maximum simulated time in s (default: 600)')
+    cfg = parser.parse_args()
+
+    cfg.ext = not cfg.sff
+    if cfg.mcu_to_remote is None:
+        cfg.mcu_to_remote = 0x1FFFFF01 if cfg.ext else 0x1F1
+    if cfg.remote_to_mcu is None:
+        cfg.remote_to_mcu = 0x1FFFFF02 if cfg.ext else 0x1F2
+    if cfg.session:
+        # protocol mode is given by the session file
+        try:
+            session = flash_session.SessionFile(cfg.session)
+        except ValueError as e:
+            sys.stderr.write('Error: %s\n' % e)
+            sys.exit(1)
+        if tuple(session.signature) != SIGNATURE or session.page_size != PAGE_SIZE or session.flashend >= APP_SIZE:
+            sys.stderr.write('Error: the session file is not made for the ATmega328P of the simulation\n')
+            sys.exit(1)
+        cfg.erase_ahead = bool(session.flags & flash_session.FLAG_RANGE)
+        cfg.size = session.size
+    if cfg.size > APP_SIZE:
+        sys.stderr.write('Error: application is bigger than the application flash\n')
+        sys.exit(1)
+
+    with tempfile.TemporaryDirectory() as tmp:
+        cfg.node = os.path.join(tmp, 'can_sim_node')
+        try:
+            build_node(cfg, cfg.node)
+        except (OSError, subprocess.CalledProcessError):
+            sys.stderr.write('Error: failed to build the bootloader node in %s\n' % HOST_DIR)
+            sys.exit(1)
+        sim, traffic, bootloaders, sessions, host, crc = run_flashing(cfg)
+    duration = sim.now
+
+    print('simulated time         %10.3f s' % (duration / 1000 / MS))
+    print('bus load               %10.1f %%' % (100.0 * sim.bus.busy_ns / max(duration, 1)))
+    print('frames / error frames  %10d / %d' % (sim.bus.frames, sim.bus.error_frames))
+    print()
+
+    total = 0
+    for b, s in zip(bootloaders, sessions):
+        if s.end is not None:
+            t = (s.end - s.start) / 1000 / MS
+            total += s.size
+            print('%s: done in %.3f s, %.0f byte/s, %d retries, %d rx overflows, %d tx dropped, flash %s'
+                  % (b.name, t, s.size / t, s.retries, b.overflows, b.dropped,
+                     'ok' if b.crc == crc else 'differs'))
+        else:
+            print('%s: not finished (%s), %d retries, %d rx overflows, %d tx dropped'
+                  % (b.name, s.state, s.retries, b.overflows, b.dropped))
+        print('  response time  %s' % percentiles(s.rtt))
+    if duration:
+        print('goodput                %10.0f byte/s' % (total * 1000.0 * MS / duration))
+
+    if traffic:
+        _, baseline = run_baseline(cfg, duration)
+        print()
+        print('production traffic latency (queued until transmitted):')
+        for t, b in zip(traffic, baseline):
+            print('%s' % t.name)
+            print('  without flashing  %s' % percentiles(b.latencies))
+            print('  with flashing     %s' % percentiles(t.latencies))
+
+    if any(s.end is None for s in sessions) or any(b.crc != crc for b in bootloaders):
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,343 @@
+#!/usr/bin/env python3
+"""
+MCP-CAN-Boot
+
+Analyze flashing sessions recorded by candump, to find out where the time of
+slow or failed updates went.
+
+The bootloader CAN messages are decoded for each MCU ID and the following is
+reported for each flashing session:
+
+  - effective flash data rate (bytes of new flash data per second)
+  - distribution of the latency between a request and the response of the MCU
+  - time attributable to page writes (responses completing a flash page)
+    and to the flash erase
+  - time of the flash application between a response and the next request
+  - retransmissions of requests and the time spent waiting for the timeout
+  - error responses of the bootloader
+  - foreign CAN messages and error frames seen while a request was pending
+
+The log is processed in a single pass line by line with a constant amount of
+memory for each MCU, so logs of several gigabytes can be analyzed. Logs may be
+compressed using gzip.
+
+Supported log formats (timestamps are required):
+
+  candump -l                (1436509052.249713) can0 1FFFFF02#00420608...
+  candump -ta / -tz         (1436509052.249713)  can0  1FFFFF02   [8]  00 42 06 08 ...
+
+Example:
+
+  candump -l can0
+  python3 tools/candump_analyze.py candump-2023-06-12_101500.log --page-size 128
+
+Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+License: CC BY-NC-SA 4.0
+"""
+
+import argparse
+import gzip
+import re
+import sys
+from collections import Counter
+
+CAN_EFF_FLAG = 0x80000000
+CAN_ERR_FLAG = 0x20000000
+
+CMD_ERROR = 0x01
+CMD_BOOTLOADER_START = 0x02
+CMD_FLASH_READY = 0x04
+CMD_FLASH_INIT = 0x06
+CMD_FLASH_DATA = 0x08
+CMD_FLASH_ADDRESS_ERROR = 0x0B
+CMD_FLASH_DATA_ERROR = 0x0D
+CMD_FLASH_DONE = 0x10
+CMD_FLASH_ERASE = 0x20
+CMD_FLASH_READ_ADDRESS_ERROR = 0x4B
+CMD_FLASH_DONE_VERIFY = 0x50
+CMD_EEPROM_ADDRESS_ERROR = 0x1B
+CMD_EEPROM_DATA_ERROR = 0x1D
+CMD_EEPROM_READ_ADDRESS_ERROR = 0x6B
+CMD_START_APP = 0x80
+
+ERRORS = {
+    CMD_ERROR: 'error',
+    CMD_FLASH_ADDRESS_ERROR: 'flash address error',
+    CMD_FLASH_DATA_ERROR: 'flash data error',
+    CMD_FLASH_READ_ADDRESS_ERROR: 'flash read address error',
+    CMD_EEPROM_ADDRESS_ERROR: 'eeprom address error',
+    CMD_EEPROM_DATA_ERROR: 'eeprom data error',
+    CMD_EEPROM_READ_ADDRESS_ERROR: 'eeprom read address error',
+}
+
+LATENCY_BUCKET = 10e-6  # resolution of the latency distribution in seconds
+
+# (1436509052.249713) can0 1FFFFF02#0042060800000000
+RE_LOG = re.compile(r'^\((\d+\.\d+)\)\s+\S+\s+([0-9A-Fa-f]+)#(#[0-9A-Fa-f])?([0-9A-Fa-f]*)')
+# (1436509052.249713)  can0  1FFFFF02   [8]  00 42 06 08 00 00 00 00
+RE_TEXT = re.compile(r'^\s*\((\d+\.\d+)\)\s+\S+\s+([0-9A-Fa-f]+)\s+\[(\d+)\]\s+((?:[0-9A-Fa-f]{2}\s*)*)')
+
+
+def parse_line(line):
+    """
+    Parse one line of a candump log.
+    Returns (timestamp, CAN-ID, data) or None for unknown lines and remote
+    frames. Error frames have the CAN_ERR_FLAG set in the CAN-ID.
+    """
+    m = RE_LOG.match(line)
+    if m:
+        data = bytes.fromhex(m.group(4))
+    else:
+        m = RE_TEXT.match(line)
+        if not m:
+            return None
+        data = bytes.fromhex(m.group(4))[:int(m.group(3))]
+    can_id = int(m.group(2), 16)
+    if len(m.group(2)) > 3 and not can_id & CAN_ERR_FLAG:
+        can_id |= CAN_EFF_FLAG
+    return float(m.group(1)), can_id, data
+
+
+def frame_bits(can_id, dlc):
+    """Nominal number of bits of a frame on the bus (without stuff bits)."""
+    return (67 if can_id & CAN_EFF_FLAG else 47) + 8 * min(dlc, 8)
+
+
+def parse_id(value):
+    """Parse a hex CAN-ID like candump, 8 digits are an extended CAN-ID."""
+    return int(value, 16) | (CAN_EFF_FLAG if len(value) > 3 else 0)
+
+
+class Session:
+    """Statistics of one flashing session of one MCU."""
+
+    def __init__(self, mcu_id, ts):
+        self.mcu_id = mcu_id
+        self.start = ts
+        self.init = None
+        self.end = None
+        self.completed = False
+        self.last = ts
+
+        self.pending = None        # (timestamp, command, payload) of the request waiting for a response
+        self.last_response = None  # timestamp of the last response
+
+        self.data_bytes = 0
+        self.data_messages = 0
+        self.retransmissions = 0
+        self.timeout_time = 0.0
+        self.unanswered = 0
+        self.errors = Counter()
+
+        self.latency = Counter()   # latency buckets of the normal responses
+        self.latency_min = None
+        self.latency_max = 0.0
+        self.page_writes = 0
+        self.page_write_time = 0.0
+        self.erases = 0
+        self.erase_time = 0.0
+        self.host_time = 0.0
+
+        self.foreign_frames = 0
+        self.foreign_bits = 0
+        self.error_frames = 0
+
+    def request(self, ts, cmd, payload):
+        if self.pending and self.pending[2] == payload:
+            # same request again without a response... retransmission
+            self.retransmissions += 1
+            self.timeout_time += ts - self.pending[0]
+        else:
+            if self.pending:
+                self.unanswered += 1
+            elif self.last_response is not None:
+                self.host_time += ts - self.last_response
+            if cmd == CMD_FLASH_INIT and self.init is None:
+                self.init = ts
+            elif cmd == CMD_FLASH_DATA:
+                self.data_bytes += payload[1] >> 5
+                self.data_messages += 1
+        self.pending = (ts, cmd, payload)
+        self.last = ts
+
+    def response(self, ts, cmd, data, page_size):
+        if cmd in ERRORS:
+            self.errors[ERRORS[cmd]] += 1
+
+        if self.pending:
+            latency = ts - self.pending[0]
+            req = self.pending[1]
+            addr = int.from_bytes(data[4:8], 'big')
+            if req == CMD_FLASH_DATA and cmd == CMD_FLASH_READY and addr % page_size == 0:
+                # the last data of a page... the page was written before the response
+                self.page_writes += 1
+                self.page_write_time += latency
+            elif req == CMD_FLASH_ERASE:
+                self.erases += 1
+                self.erase_time += latency
+            else:
+                self.latency[int(latency / LATENCY_BUCKET)] += 1
+                if self.latency_min is None or latency < self.latency_min:
+                    self.latency_min = latency
+                self.latency_max = max(self.latency_max, latency)
+            self.pending = None
+
+        self.last_response = ts
+        self.last = ts
+        if cmd in (CMD_START_APP, CMD_FLASH_DONE_VERIFY):
+            self.end = ts
+            self.completed = self.init is not None
+
+    def percentile(self, p):
+        total = sum(self.latency.values())
+        limit = total * p / 100
+        count = 0
+        for bucket in sorted(self.latency):
+            count += self.latency[bucket]
+            if count >= limit:
+                return min((bucket + 0.5) * LATENCY_BUCKET, self.latency_max)
+        return 0.0
+
+    def report(self, bitrate, out):
+        first = self.init if self.init is not None else self.start
+        duration = (self.end if self.end is not None else self.last) - first
+        normal = sum(self.latency.values())
+
+        out.write('MCU 0x%04x session at %.6f (%s)\n' % (self.mcu_id, self.start,
+                                                         'completed' if self.completed else 'incomplete'))
+        out.write('  duration         %.3f s (flash init to %s)\n' % (duration,
+                                                                    'end' if self.end is not None else 'last message'))
+        out.write('  flash data       %d bytes in %d messages, %.1f bytes/s\n' % (
+            self.data_bytes, self.data_messages, self.data_bytes / duration if duration > 0 else 0.0))
+        if normal:
+            out.write('  latency          n=%d min %.2f ms p50 %.2f ms p90 %.2f ms p99 %.2f ms max %.2f ms\n' % (
+                normal, self.latency_min * 1e3, self.percentile(50) * 1e3, self.percentile(90) * 1e3,
+                self.percentile(99) * 1e3, self.latency_max * 1e3))
+        if self.page_writes:
+            per_page = self.page_write_time / self.page_writes
+            out.write('  page writes      %d, %.3f s (%.2f ms per page, %.2f ms more than the median latency)\n' % (
+                self.page_writes, self.page_write_time, per_page * 1e3,
+                (per_page - self.percentile(50)) * 1e3 if normal else per_page * 1e3))
+        if self.erases:
+            out.write('  flash erase      %d, %.3f s\n' % (self.erases, self.erase_time))
+        out.write('  host time        %.3f s between a response and the next request\n' % self.host_time)
+        if self.retransmissions or self.unanswered:
+            out.write('  retransmissions  %d, %.3f s waiting for the timeout, %d requests without response\n' % (
+                self.retransmissions, self.timeout_time, self.unanswered))
+        if self.errors:
+            out.write('  errors           %s\n' % ', '.join('%s: %d' % e for e in sorted(self.errors.items())))
+        if self.foreign_frames or self.error_frames:
+            out.write('  interference     %d foreign frames (~%.3f s bus time at %d kbit/s), %d error frames\n' % (
+                self.foreign_frames, self.foreign_bits / bitrate, bitrate // 1000, self.error_frames))
+
+
+class Analyzer:
+    """Streaming analyzer of the bootloader CAN messages."""
+
+    def __init__(self, ids, page_size, bitrate, out):
+        self.to_remote = set(m for m, _ in ids)
+        self.to_mcu = set(r for _, r in ids)
+        self.page_size = page_size
+        self.bitrate = bitrate
+        self.out = out
+        self.sessions = {}
+        self.frames = 0
+        self.foreign_frames = 0
+        self.foreign_bits = 0
+        self.error_frames = 0
+        self.first = None
+        self.last = None
+
+    def frame(self, ts, can_id, data):
+        self.frames += 1
+        if self.first is None:
+            self.first = ts
+        self.last = ts
+
+        if can_id & CAN_ERR_FLAG:
+            self.error_frames += 1
+            for s in self.sessions.values():
+                if s.pending:
+                    s.error_frames += 1
+            return
+
+        if len(data) >= 4 and (can_id in self.to_mcu or can_id in self.to_remote):
+            mcu_id = (data[0] << 8) | data[1]
+            cmd = data[2]
+            s = self.sessions.get(mcu_id)
+            if can_id in self.to_remote:
+                if cmd == CMD_BOOTLOADER_START or s is None:
+                    # (re)start of the bootloader
+                    self.finish(mcu_id)
+                    s = self.sessions[mcu_id] = Session(mcu_id, ts)
+                s.response(ts, cmd, data, self.page_size)
+            else:
+                if s is None:
+                    s = self.sessions[mcu_id] = Session(mcu_id, ts)
+                s.request(ts, cmd, bytes(data[2:]))
+            return
+
+        self.foreign_frames += 1
+        bits = frame_bits(can_id, len(data))
+        self.foreign_bits += bits
+        for s in self.sessions.values():
+            if s.pending:
+                s.foreign_frames += 1
+                s.foreign_bits += bits
+
+    def finish(self, mcu_id):
+        s = self.sessions.pop(mcu_id, None)
+        if s is not None and (s.init is not None or s.data_messages):
+            s.report(self.bitrate, self.out)
+
+    def close(self):
+        for mcu_id in sorted(self.sessions):
+            self.finish(mcu_id)
+        duration = (self.last - self.first) if self.frames else 0.0
+        self.out.write('log: %d frames in %.3f s, %d foreign frames (~%.1f %% bus load at %d kbit/s), %d error frames\n' % (
+            self.frames, duration, self.foreign_frames,
+            100 * self.foreign_bits / self.bitrate / duration if duration > 0 else 0.0,
+            self.bitrate // 1000, self.error_frames))
+
+
+def open_log(path):
+    if path == '-':
+        return sys.stdin
+    if path.endswith('.gz'):
+        return gzip.open(path, 'rt', errors='replace')
+    return open(path, 'r', errors='replace')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Analyze flashing sessions of MCP-CAN-Boot in candump logs.')
+    parser.add_argument('file', help='candump log file, may be gzip compressed, - for stdin')
+    parser.add_argument('--ids', action='append', metavar='MCU_TO_REMOTE:REMOTE_TO_MCU',
+                        help='hex CAN-IDs of the bootloader messages like in the log (8 digits for extended CAN-IDs), '
+                             'may be repeated for the fast CAN-IDs (default: 1FFFFF01:1FFFFF02)')
+    parser.add_argument('--page-size', type=int, default=128, help='flash page size of the MCU in bytes (SPM_PAGESIZE)')
+    parser.add_argument('--bitrate', type=int, default=500, help='bitrate of the CAN bus in kbit/s')
+    args = parser.parse_args()
+
+    try:
+        ids = [tuple(parse_id(v) for v in i.split(':')) for i in (args.ids or ['1FFFFF01:1FFFFF02'])]
+        if any(len(i) != 2 for i in ids):
+            raise ValueError('the CAN-IDs must be given as MCU_TO_REMOTE:REMOTE_TO_MCU')
+    except ValueError as e:
+        sys.stderr.write('Error: %s\n' % e)
+        sys.exit(1)
+
+    analyzer = Analyzer(ids, args.page_size, args.bitrate * 1000, sys.stdout)
+    try:
+        with open_log(args.file) as f:
+            for line in f:
+                frame = parse_line(line)
+                if frame:
+                    analyzer.frame(*frame)
+    except OSError as e:
+        sys.stderr.write('Error: %s\n' % e)
+        sys.exit(1)
+    analyzer.close()
+
+
+if __name__ == '__main__':
+    main()
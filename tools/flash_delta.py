@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+"""
+MCP-CAN-Boot
+
+Generate a delta update from the currently flashed application to a new
+application for bootloaders with FLASH_DELTA enabled.
+
+The delta consists of the following operations, which map directly to the
+bootloader commands:
+
+  address <addr>          -> flash set address
+  copy <addr> <src> <len> -> flash copy (copy len bytes from the old flash)
+  data <addr> <hex>       -> flash data (up to 4 bytes)
+
+Pages which are identical in the old and the new application are skipped
+completely. Each copy is checked to read only from pages which are not
+written before the copy is applied and only from the data of the old hex
+file, so the result is the same as flashing the new application. Pages of the
+old application behind the end of the new one are overwritten with 0xFF.
+
+The copies read the current flash content, so the flash application must not
+send *flash erase* before or during a delta session.
+
+Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+License: CC BY-NC-SA 4.0
+"""
+
+import argparse
+import sys
+
+from flash_session import segments
+from ihex import read_hex, to_image
+
+MIN_COPY_LEN = 5    # a copy is one frame like a data frame with 4 bytes
+MAX_COPY_LEN = 255  # maximum length of a single flash copy command
+MAX_CANDIDATES = 64 # maximum number of match candidates per 4 byte key
+
+
+def build_index(old):
+    """Index all 4 byte sequences of the old image."""
+    index = {}
+    for i in range(len(old) - 3):
+        lst = index.setdefault(bytes(old[i:i + 4]), [])
+        if len(lst) < MAX_CANDIDATES:
+            lst.append(i)
+    return index
+
+
+def find_copy(old, old_len, new, index, pos, end, written, page_size):
+    """
+    Find the longest usable copy for new[pos:end].
+    A source is usable if it is within old[:old_len] and none of its pages
+    was written before.
+    """
+    best_src, best_len = None, 0
+    for src in index.get(bytes(new[pos:pos + 4]), ()):
+        length = 0
+        limit = min(end - pos, MAX_COPY_LEN, old_len - src)
+        while length < limit and old[src + length] == new[pos + length]:
+            length += 1
+        if length <= best_len:
+            continue
+        first = src // page_size
+        last = (src + length - 1) // page_size
+        if any(p in written for p in range(first, last + 1)):
+            continue
+        best_src, best_len = src, length
+    return best_src, best_len
+
+
+def make_delta(old, new, page_size):
+    """Create the list of delta operations."""
+    # only the data of the old hex file may be copied, the flash behind it
+    # is not known
+    index = build_index(old)
+    old_len = len(old)
+    new_len = len(new)
+
+    # the new image covers all pages of the old one, so the pages behind the
+    # new application are compared against (and overwritten with) 0xFF
+    size = -(-max(len(new), old_len) // page_size) * page_size
+    new = new + bytearray(b'\xff' * (size - len(new)))
+    old = old + bytearray(b'\xff' * (size - old_len))
+
+    ops = []
+    written = set()
+    next_addr = None
+
+    for page in range(size // page_size):
+        start = page * page_size
+        end = start + page_size
+        if old[start:end] == new[start:end]:
+            continue
+
+        if next_addr != start:
+            ops.append(('address', start))
+
+        if start >= new_len:
+            # page behind the new application... the bootloader fills a page
+            # with 0xFF, so a single data frame erases it
+            ops.append(('data', start, bytes(new[start:start + 4])))
+            written.add(page)
+            next_addr = start + 4
+            continue
+
+        # copies never cross a page boundary, so the source is read before
+        # the target page is written
+        pos = start
+        while pos < end:
+            src, length = find_copy(old, old_len, new, index, pos, end, written, page_size)
+            if length >= MIN_COPY_LEN:
+                ops.append(('copy', pos, src, length))
+                pos += length
+            else:
+                ops.append(('data', pos, bytes(new[pos:min(pos + 4, end)])))
+                pos += 4
+
+        written.add(page)
+        next_addr = end
+
+    return ops
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Generate a delta update for MCP-CAN-Boot.')
+    parser.add_argument('old', help='hex file of the currently flashed application')
+    parser.add_argument('new', help='hex file of the new application')
+    parser.add_argument('--page-size', type=int, required=True, help='flash page size of the MCU in bytes (SPM_PAGESIZE)')
+    parser.add_argument('-o', '--output', help='output file (default: stdout)')
+    args = parser.parse_args()
+
+    old = to_image(read_hex(args.old))
+    new_data = read_hex(args.new)
+    new = to_image(new_data)
+    ops = make_delta(old, new, args.page_size)
+
+    out = open(args.output, 'w') if args.output else sys.stdout
+    for op in ops:
+        if op[0] == 'address':
+            out.write('address 0x%08x\n' % op[1])
+        elif op[0] == 'copy':
+            out.write('copy 0x%08x 0x%06x %d\n' % (op[1], op[2], op[3]))
+        else:
+            out.write('data 0x%08x %s\n' % (op[1], op[2].hex()))
+    if out is not sys.stdout:
+        out.close()
+
+    # both including flash init and flash done, the full update counted like
+    # the frames of tools/flash_session.py
+    frames = len(ops) + 2
+    copied = sum(op[3] for op in ops if op[0] == 'copy')
+    literal = sum(len(op[2]) for op in ops if op[0] == 'data')
+    full = 2
+    next_addr = 0
+    for addr, seg in segments(new_data, args.page_size):
+        if addr != next_addr:
+            full += 1
+        full += -(-len(seg) // 4)
+        next_addr = addr + len(seg)
+    sys.stderr.write('%d frames (%d bytes copied, %d bytes sent) instead of %d frames for a full update\n'
+                     % (frames, copied, literal, full))
+
+
+if __name__ == '__main__':
+    main()
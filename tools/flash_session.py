@@ -0,0 +1,262 @@
+#!/usr/bin/env python3
+"""
+MCP-CAN-Boot
+
+Compile an application into a session file of pre-encoded CAN messages, so a
+flash application only needs to stream the messages and compare the responses
+without parsing the hex file and encoding the messages for each MCU.
+
+Session file format (all values little-endian):
+
+  header (48 bytes)
+    0  magic 'MCBS'
+    4  uint16 format version (1)
+    6  uint16 flags (bit 0: flash erase, bit 1: flash range, bit 2: verify,
+                   bit 3: dual slot)
+    8  uint8[3] device signature, uint8 command set version
+    12 uint16 flash page size (SPM_PAGESIZE)
+    14 uint16 reserved
+    16 uint32 last address of the application flash (FLASHEND_BL)
+    20 uint32 size of the flashed area (highest address + 1)
+    24 uint32 number of frames
+    28 uint32 offset of the frames
+    32 uint32 number of pages
+    36 uint32 offset of the page table
+    40 uint32 reserved
+    44 uint32 CRC-32 of the frames and the page table
+
+  frames (12 bytes each)
+    uint8[8] data of the CAN message, bytes 0 and 1 (MCU ID) are left 0x00
+             and must be set by the flash application
+    uint32   expected response: command << 24 | flash address
+
+  page table (12 bytes each, one entry for each written page)
+    uint16   page number
+    uint16   CRC-16/XMODEM of the page
+    uint16   CRC-16/XMODEM of the flash from address 0 up to the end of the
+             page (like the CRC of the flash resume command), where bytes not
+             contained in the hex file are 0xFF
+    uint16   reserved
+    uint32   index of the first frame with flash data for this page
+
+Usage:
+
+  python3 tools/flash_session.py compile firmware.hex -o firmware.mcbs \\
+    --signature 1e950f --page-size 128 --flashend 0x6FFF
+  python3 tools/flash_session.py info firmware.mcbs
+
+Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+License: CC BY-NC-SA 4.0
+"""
+
+import argparse
+import binascii
+import mmap
+import struct
+import sys
+
+from ihex import read_hex
+
+MAGIC = b'MCBS'
+FORMAT_VERSION = 1
+BOOTLOADER_CMD_VERSION = 0x02
+
+FLAG_ERASE = 0x01
+FLAG_RANGE = 0x02
+FLAG_VERIFY = 0x04
+FLAG_DUAL_SLOT = 0x08
+
+HEADER = struct.Struct('<4sHH3sBHHIIIIIIII')
+FRAME = struct.Struct('<8sI')
+PAGE = struct.Struct('<HHHHI')
+
+CMD_FLASH_READY = 0x04
+CMD_FLASH_INIT = 0x06
+CMD_FLASH_DATA = 0x08
+CMD_FLASH_SET_ADDRESS = 0x0A
+CMD_FLASH_RANGE = 0x0E
+CMD_FLASH_DONE = 0x10
+CMD_FLASH_ERASE = 0x20
+CMD_FLASH_DONE_VERIFY = 0x50
+CMD_START_APP = 0x80
+
+
+def crc_xmodem(data, crc=0):
+    return binascii.crc_hqx(bytes(data), crc)
+
+
+def segments(data, page_size):
+    """
+    Split the data from read_hex() into contiguous segments.
+    Gaps smaller than a flash page are filled with 0xFF.
+    """
+    result = []
+    for addr in sorted(data):
+        if result and addr - (result[-1][0] + len(result[-1][1])) < page_size:
+            seg = result[-1][1]
+            seg.extend(b'\xff' * (addr - (result[-1][0] + len(seg))))
+            seg.append(data[addr])
+        else:
+            result.append((addr, bytearray([data[addr]])))
+    return result
+
+
+def message(cmd, len_addr, data=b'\x00\x00\x00\x00'):
+    return bytes([0x00, 0x00, cmd, len_addr]) + bytes(data)
+
+
+def compile_session(data, signature, page_size, flashend, flags):
+    """
+    Compile the data from read_hex() into a session file.
+    Returns the content of the session file.
+    """
+    if not data:
+        raise ValueError('no data to flash')
+    if max(data) > flashend:
+        raise ValueError('application is bigger than the application flash')
+
+    frames = []
+    first_frame = {}
+    image = bytearray()
+
+    frames.append((message(CMD_FLASH_INIT, 0, bytes(signature) + b'\x00'), CMD_FLASH_READY << 24))
+    if flags & FLAG_ERASE:
+        frames.append((message(CMD_FLASH_ERASE, 0), CMD_FLASH_READY << 24))
+
+    next_addr = 0
+    for addr, seg in segments(data, page_size):
+        if addr != next_addr:
+            frames.append((message(CMD_FLASH_SET_ADDRESS, 0, addr.to_bytes(4, 'big')), (CMD_FLASH_READY << 24) | addr))
+        if flags & FLAG_RANGE:
+            last = addr + len(seg) - 1
+            frames.append((message(CMD_FLASH_RANGE, 0, last.to_bytes(4, 'big')), (CMD_FLASH_READY << 24) | addr))
+
+        if len(image) < addr + len(seg):
+            image.extend(b'\xff' * (addr + len(seg) - len(image)))
+        image[addr:addr + len(seg)] = seg
+
+        for pos in range(0, len(seg), 4):
+            a = addr + pos
+            chunk = seg[pos:pos + 4]
+            first_frame.setdefault(a // page_size, len(frames))
+            frames.append((message(CMD_FLASH_DATA, (len(chunk) << 5) | (a & 0x1F), chunk + bytes(4 - len(chunk))),
+                           (CMD_FLASH_READY << 24) | (a + len(chunk))))
+        next_addr = addr + len(seg)
+
+    # pad the image to full pages for the CRCs
+    image.extend(b'\xff' * (-len(image) % page_size))
+
+    # with DUAL_SLOT the staging slot is only copied if the number of pages
+    # and the CRC given by flash done match
+    done = b'\x00\x00\x00\x00'
+    if flags & FLAG_DUAL_SLOT:
+        done = (len(image) // page_size).to_bytes(2, 'big') + crc_xmodem(image).to_bytes(2, 'big')
+
+    if flags & FLAG_VERIFY:
+        frames.append((message(CMD_FLASH_DONE_VERIFY, 0, done), CMD_FLASH_DONE_VERIFY << 24))
+    else:
+        frames.append((message(CMD_FLASH_DONE, 0, done), CMD_START_APP << 24))
+
+    pages = []
+    prefix = 0
+    for page in range(len(image) // page_size):
+        content = image[page * page_size:(page + 1) * page_size]
+        prefix = crc_xmodem(content, prefix)
+        if page in first_frame:
+            pages.append((page, crc_xmodem(content), prefix, 0, first_frame[page]))
+
+    body = b''.join(FRAME.pack(d, e) for d, e in frames) + b''.join(PAGE.pack(*p) for p in pages)
+    header = HEADER.pack(MAGIC, FORMAT_VERSION, flags, bytes(signature), BOOTLOADER_CMD_VERSION,
+                         page_size, 0, flashend, max(data) + 1,
+                         len(frames), HEADER.size, len(pages), HEADER.size + len(frames) * FRAME.size,
+                         0, binascii.crc32(body))
+    return header + body
+
+
+class SessionBuffer:
+    """Session from the content of a session file."""
+
+    def __init__(self, buf, name='session'):
+        self.buf = buf
+        (magic, version, self.flags, self.signature, self.cmd_version,
+         self.page_size, _, self.flashend, self.size,
+         self.frame_count, self.frames_offset, self.page_count, self.pages_offset,
+         _, crc) = HEADER.unpack_from(self.buf, 0)
+        if magic != MAGIC or version != FORMAT_VERSION:
+            raise ValueError('%s is not a session file of version %d' % (name, FORMAT_VERSION))
+        if binascii.crc32(self.buf[HEADER.size:]) != crc:
+            raise ValueError('%s is corrupted' % name)
+
+    def frame(self, i):
+        """Data of the CAN message and the expected response (command, address)."""
+        data, expect = FRAME.unpack_from(self.buf, self.frames_offset + i * FRAME.size)
+        return data, expect >> 24, expect & 0xFFFFFF
+
+    def frames(self):
+        for i in range(self.frame_count):
+            yield self.frame(i)
+
+    def pages(self):
+        for i in range(self.page_count):
+            page, crc, prefix, _, first = PAGE.unpack_from(self.buf, self.pages_offset + i * PAGE.size)
+            yield page, crc, prefix, first
+
+
+class SessionFile(SessionBuffer):
+    """Memory-mapped session file."""
+
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            super().__init__(mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ), path)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Compile and inspect session files for MCP-CAN-Boot.')
+    sub = parser.add_subparsers(dest='command', required=True)
+
+    comp = sub.add_parser('compile', help='compile a hex file into a session file')
+    comp.add_argument('file', help='hex file of the application')
+    comp.add_argument('-o', '--output', required=True, help='output session file')
+    comp.add_argument('--signature', type=bytes.fromhex, required=True, help='device signature as hex, e.g. 1e950f')
+    comp.add_argument('--page-size', type=int, required=True, help='flash page size of the MCU in bytes (SPM_PAGESIZE)')
+    comp.add_argument('--flashend', type=lambda x: int(x, 0), required=True, help='last address of the application flash (FLASHEND_BL)')
+    comp.add_argument('--erase', action='store_true', help='send flash erase before the flash data')
+    comp.add_argument('--range', action='store_true', help='announce each flash range for the background erase (FLASH_ERASE_AHEAD)')
+    comp.add_argument('--verify', action='store_true', help='end with flash done verify instead of flash done')
+    comp.add_argument('--dual-slot', action='store_true', help='add the number of pages and the CRC to flash done (DUAL_SLOT)')
+
+    info = sub.add_parser('info', help='show the content of a session file')
+    info.add_argument('file', help='session file')
+    info.add_argument('--frames', action='store_true', help='list all frames')
+
+    args = parser.parse_args()
+
+    try:
+        if args.command == 'compile':
+            if len(args.signature) != 3:
+                raise ValueError('the signature must be 3 bytes')
+            flags = ((FLAG_ERASE if args.erase else 0) | (FLAG_RANGE if args.range else 0) | (FLAG_VERIFY if args.verify else 0)
+                     | (FLAG_DUAL_SLOT if args.dual_slot else 0))
+            content = compile_session(read_hex(args.file), args.signature, args.page_size, args.flashend, flags)
+            with open(args.output, 'wb') as f:
+                f.write(content)
+            sys.stderr.write('%d bytes\n' % len(content))
+        else:
+            s = SessionFile(args.file)
+            print('signature   %s' % s.signature.hex())
+            print('page size   %d' % s.page_size)
+            print('flashend    0x%06x' % s.flashend)
+            print('size        %d' % s.size)
+            print('flags       %s' % ' '.join(n for f, n in ((FLAG_ERASE, 'erase'), (FLAG_RANGE, 'range'), (FLAG_VERIFY, 'verify'), (FLAG_DUAL_SLOT, 'dual-slot')) if s.flags & f))
+            print('frames      %d' % s.frame_count)
+            print('pages       %d' % s.page_count)
+            if args.frames:
+                for data, cmd, addr in s.frames():
+                    print('%s -> 0x%02x 0x%06x' % (data.hex(), cmd, addr))
+    except ValueError as e:
+        sys.stderr.write('Error: %s\n' % e)
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+"""
+MCP-CAN-Boot
+
+Generate a sparse update for bootloaders with FLASH_PAGE_MAP enabled.
+Pages of the application flash which are completely blank (0xFF) in the new
+application are never transmitted. Instead the page occupancy bitmap is sent,
+so the bootloader erases only the pages which must become blank.
+
+The update consists of the following operations, which map directly to the
+bootloader commands:
+
+  pagemap <index> <hex>   -> flash page map (bitmap of the pages index*32 to index*32+31)
+  address <addr>          -> flash set address
+  data <addr> <hex>       -> flash data (up to 4 bytes)
+
+Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+License: CC BY-NC-SA 4.0
+"""
+
+import argparse
+import sys
+
+from ihex import read_hex, to_image
+
+PAGES_PER_MAP = 32  # pages per flash page map command (4 data bytes)
+
+
+def make_sparse(image, page_size, app_size):
+    """Create the list of sparse update operations."""
+    if len(image) > app_size:
+        raise ValueError('application is bigger than the application flash')
+    pages = app_size // page_size
+    image = image + bytearray(b'\xff' * (app_size - len(image)))
+
+    used = [any(b != 0xFF for b in image[p * page_size:(p + 1) * page_size]) for p in range(pages)]
+
+    ops = []
+    for index in range(-(-pages // PAGES_PER_MAP)):
+        bitmap = bytearray(PAGES_PER_MAP // 8)
+        for i in range(PAGES_PER_MAP):
+            page = index * PAGES_PER_MAP + i
+            if page < pages and used[page]:
+                bitmap[i >> 3] |= 1 << (i & 7)
+        ops.append(('pagemap', index, bytes(bitmap)))
+
+    next_addr = None
+    for page in range(pages):
+        if not used[page]:
+            continue
+        start = page * page_size
+        if next_addr != start:
+            ops.append(('address', start))
+        for pos in range(start, start + page_size, 4):
+            ops.append(('data', pos, bytes(image[pos:pos + 4])))
+        next_addr = start + page_size
+
+    return ops
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Generate a sparse update for MCP-CAN-Boot.')
+    parser.add_argument('file', help='hex file of the application')
+    parser.add_argument('--page-size', type=int, required=True, help='flash page size of the MCU in bytes (SPM_PAGESIZE)')
+    parser.add_argument('--app-size', type=lambda x: int(x, 0), required=True, help='size of the application flash in bytes (flash size minus bootloader size)')
+    parser.add_argument('-o', '--output', help='output file (default: stdout)')
+    args = parser.parse_args()
+
+    image = to_image(read_hex(args.file))
+    try:
+        ops = make_sparse(image, args.page_size, args.app_size)
+    except ValueError as e:
+        sys.stderr.write('Error: %s\n' % e)
+        sys.exit(1)
+
+    out = open(args.output, 'w') if args.output else sys.stdout
+    for op in ops:
+        if op[0] == 'pagemap':
+            out.write('pagemap %d %s\n' % (op[1], op[2].hex()))
+        elif op[0] == 'address':
+            out.write('address 0x%08x\n' % op[1])
+        else:
+            out.write('data 0x%08x %s\n' % (op[1], op[2].hex()))
+    if out is not sys.stdout:
+        out.close()
+
+    frames = len(ops)
+    full = -(-len(image) // 4)
+    sys.stderr.write('%d frames instead of %d frames for a full update\n' % (frames, full))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,62 @@
+"""
+MCP-CAN-Boot
+
+Minimal Intel HEX reader used by the host side tools.
+
+Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+License: CC BY-NC-SA 4.0
+"""
+
+
+def read_hex(path):
+    """
+    Read an Intel HEX file.
+    Returns a dict mapping each byte address to its value.
+    """
+    data = {}
+    base = 0
+    with open(path, 'r') as f:
+        for lineno, line in enumerate(f, 1):
+            line = line.strip()
+            if not line:
+                continue
+            if not line.startswith(':'):
+                raise ValueError('%s:%d: invalid record' % (path, lineno))
+
+            rec = bytes.fromhex(line[1:])
+            if len(rec) < 5 or len(rec) != rec[0] + 5:
+                raise ValueError('%s:%d: invalid record length' % (path, lineno))
+            if sum(rec) & 0xFF != 0:
+                raise ValueError('%s:%d: checksum mismatch' % (path, lineno))
+
+            length = rec[0]
+            addr = (rec[1] << 8) | rec[2]
+            rtype = rec[3]
+            payload = rec[4:4 + length]
+
+            if rtype == 0x00:
+                for i, b in enumerate(payload):
+                    data[base + addr + i] = b
+            elif rtype == 0x01:
+                break
+            elif rtype == 0x02:
+                base = ((payload[0] << 8) | payload[1]) << 4
+            elif rtype == 0x04:
+                base = ((payload[0] << 8) | payload[1]) << 16
+            # start address records (0x03, 0x05) are not needed
+
+    return data
+
+
+def to_image(data, size=None):
+    """
+    Convert a dict from read_hex() into a bytearray starting at address 0.
+    Unused bytes are set to 0xFF like in erased flash.
+    """
+    if size is None:
+        size = (max(data) + 1) if data else 0
+    image = bytearray(b'\xff' * size)
+    for addr, b in data.items():
+        if addr < size:
+            image[addr] = b
+    return image
@@ -0,0 +1,101 @@
+"""
+MCP-CAN-Boot
+
+PlatformIO extra script to derive the bootloader section from the build
+profile of the env and to report the size of the bootloader after the build.
+
+The profile is set in the env using `custom_profile`:
+  default  2048 words (4096 bytes) bootloader section
+  compact  1024 words (2048 bytes) bootloader section, defines COMPACT
+
+The size of the bootloader section is only defined here and passed to the
+sources as BOOTLOADER_SIZE.
+
+The start of the .text section and the fixed addresses of the SPM and CAN
+service tables are set from the flash size of the MCU, so they must not be set
+in the build_flags of the env.
+
+Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+License: CC BY-NC-SA 4.0
+"""
+
+import subprocess
+
+Import('env')  # noqa: F821 (provided by PlatformIO)
+
+# flash size of the supported MCUs in bytes
+FLASH_SIZE = {
+    'atmega32': 0x8000,
+    'atmega32u4': 0x8000,
+    'atmega328p': 0x8000,
+    'atmega64': 0x10000,
+    'atmega644p': 0x10000,
+    'atmega128': 0x20000,
+    'atmega1284p': 0x20000,
+    'atmega2560': 0x40000,
+}
+
+# size of the bootloader section in bytes for each profile (BOOTLOADER_SIZE)
+PROFILES = {
+    'default': 4096,
+    'compact': 2048,
+}
+
+SPM_SERVICE_TABLE_SIZE = 6
+CAN_SERVICE_TABLE_SIZE = 20
+
+mcu = env.BoardConfig().get('build.mcu').lower()  # noqa: F821
+profile = env.GetProjectOption('custom_profile', 'default')  # noqa: F821
+
+if mcu not in FLASH_SIZE:
+    raise SystemExit('Error: unsupported MCU %s' % mcu)
+if profile not in PROFILES:
+    raise SystemExit('Error: unknown profile %s, use one of %s' % (profile, ', '.join(PROFILES)))
+
+flash_size = FLASH_SIZE[mcu]
+bootloader_size = PROFILES[profile]
+
+env.Append(CPPDEFINES=[('BOOTLOADER_SIZE', bootloader_size)])  # noqa: F821
+if profile == 'compact':
+    env.Append(CPPDEFINES=['COMPACT'])  # noqa: F821
+
+env.Append(LINKFLAGS=[  # noqa: F821
+    '-Wl,--section-start=.text=0x%X' % (flash_size - bootloader_size),
+    '-Wl,--section-start=.spm_service=0x%X' % (flash_size - SPM_SERVICE_TABLE_SIZE),
+    '-Wl,--section-start=.can_service=0x%X' % (flash_size - SPM_SERVICE_TABLE_SIZE - CAN_SERVICE_TABLE_SIZE),
+])
+
+
+def size_report(source, target, env):
+    """Print the used size of the bootloader section and the headroom."""
+    out = subprocess.check_output([env.subst('$SIZETOOL'), '-A', str(target[0])],
+                                  env=env['ENV'], universal_newlines=True)
+    sections = {}
+    for line in out.splitlines():
+        parts = line.split()
+        if len(parts) == 3 and parts[0].startswith('.') and parts[1].isdigit():
+            sections[parts[0]] = int(parts[1])
+
+    # the initial values of .data are stored in the flash behind .text
+    used = sections.get('.text', 0) + sections.get('.data', 0)
+    # the service tables are placed at the end of the bootloader section, the
+    # CAN service table in front of the (possibly unused) SPM service table
+    if '.can_service' in sections:
+        tables = SPM_SERVICE_TABLE_SIZE + CAN_SERVICE_TABLE_SIZE
+    elif '.spm_service' in sections:
+        tables = SPM_SERVICE_TABLE_SIZE
+    else:
+        tables = 0
+    free = bootloader_size - used - tables
+
+    print('Bootloader %s profile, %d words (%d bytes) section at 0x%X' % (
+        profile, bootloader_size // 2, bootloader_size, flash_size - bootloader_size))
+    print('  used     %5d bytes (.text %d, .data %d, service tables %d)' % (
+        used + tables, sections.get('.text', 0), sections.get('.data', 0), tables))
+    print('  headroom %5d bytes (%.1f %%)' % (free, 100.0 * free / bootloader_size))
+    if free < 0:
+        print('Error: the bootloader does not fit into the bootloader section!')
+        env.Exit(1)
+
+
+env.AddPostAction('$BUILD_DIR/${PROGNAME}.elf', size_report)  # noqa: F821
@@ -0,0 +1,173 @@
+#!/usr/bin/env python3
+"""
+MCP-CAN-Boot
+
+Flash an application using the UDS download services of bootloaders with
+UDS enabled. The ISO-TP socket of the Linux kernel (can-isotp) is used, so the
+segmentation and flow control is handled by the kernel.
+
+Example using a virtual CAN interface for testing:
+
+  sudo modprobe vcan can-isotp
+  sudo ip link add dev vcan0 type vcan && sudo ip link set up vcan0
+  python3 tools/uds_flash.py vcan0 firmware.hex
+
+Copyright (C) 2020-2023 Peter Müller <peter@crycode.de> (https://crycode.de)
+License: CC BY-NC-SA 4.0
+"""
+
+import argparse
+import binascii
+import socket
+import sys
+import time
+
+from ihex import read_hex
+
+CAN_EFF_FLAG = 0x80000000
+
+SID_DIAGNOSTIC_SESSION_CONTROL = 0x10
+SID_ECU_RESET = 0x11
+SID_ROUTINE_CONTROL = 0x31
+SID_REQUEST_DOWNLOAD = 0x34
+SID_TRANSFER_DATA = 0x36
+SID_REQUEST_TRANSFER_EXIT = 0x37
+SID_NEGATIVE_RESPONSE = 0x7F
+
+NRC_RESPONSE_PENDING = 0x78
+
+ROUTINE_ERASE = 0xFF00
+ROUTINE_CRC = 0x0202
+
+
+class UdsError(Exception):
+    pass
+
+
+class UdsClient:
+    def __init__(self, interface, tx_id, rx_id, extended, timeout):
+        if extended:
+            tx_id |= CAN_EFF_FLAG
+            rx_id |= CAN_EFF_FLAG
+        self.sock = socket.socket(socket.AF_CAN, socket.SOCK_DGRAM, socket.CAN_ISOTP)
+        self.sock.bind((interface, rx_id, tx_id))
+        self.timeout = timeout
+
+    def request(self, data, timeout=None, pending_timeout=10.0):
+        """Send a request and return the positive response."""
+        self.sock.settimeout(timeout or self.timeout)
+        self.sock.send(bytes(data))
+        while True:
+            try:
+                resp = self.sock.recv(4095)
+            except socket.timeout:
+                raise UdsError('no response to service 0x%02x' % data[0])
+            if len(resp) >= 3 and resp[0] == SID_NEGATIVE_RESPONSE and resp[1] == data[0]:
+                if resp[2] == NRC_RESPONSE_PENDING:
+                    self.sock.settimeout(pending_timeout)
+                    continue
+                raise UdsError('negative response 0x%02x to service 0x%02x' % (resp[2], data[0]))
+            if resp[0] == data[0] + 0x40:
+                return resp
+            # ignore unrelated responses
+
+    def enter_programming(self, wait):
+        """Repeat the session request until the bootloader responds after a reset."""
+        end = time.time() + wait
+        while True:
+            try:
+                return self.request([SID_DIAGNOSTIC_SESSION_CONTROL, 0x02], timeout=0.05)
+            except UdsError:
+                if time.time() > end:
+                    raise
+
+    def routine(self, rid):
+        return self.request([SID_ROUTINE_CONTROL, 0x01, rid >> 8, rid & 0xFF])
+
+    def download(self, addr, data, exit_record=b''):
+        resp = self.request([SID_REQUEST_DOWNLOAD, 0x00, 0x44]
+                            + list(addr.to_bytes(4, 'big'))
+                            + list(len(data).to_bytes(4, 'big')))
+        n = resp[1] >> 4
+        block = int.from_bytes(resp[2:2 + n], 'big') - 2
+
+        bsc = 1
+        for pos in range(0, len(data), block):
+            self.request(bytes([SID_TRANSFER_DATA, bsc]) + data[pos:pos + block])
+            bsc = (bsc + 1) & 0xFF
+
+        self.request(bytes([SID_REQUEST_TRANSFER_EXIT]) + exit_record)
+
+        resp = self.routine(ROUTINE_CRC)
+        crc = (resp[4] << 8) | resp[5]
+        if crc != binascii.crc_hqx(data, 0):
+            raise UdsError('CRC mismatch at 0x%08x' % addr)
+
+
+MAX_GAP = 256  # gaps smaller than the largest flash page size are filled
+
+
+def segments(data):
+    """
+    Split the data from read_hex() into contiguous segments.
+    Small gaps are filled with 0xFF, so two segments never share a flash page,
+    since the last page of each download is written by RequestTransferExit.
+    """
+    result = []
+    for addr in sorted(data):
+        if result and addr - (result[-1][0] + len(result[-1][1])) < MAX_GAP:
+            seg = result[-1][1]
+            seg.extend(b'\xff' * (addr - (result[-1][0] + len(seg))))
+            seg.append(data[addr])
+        else:
+            result.append((addr, bytearray([data[addr]])))
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Flash an application using the UDS services of MCP-CAN-Boot.')
+    parser.add_argument('interface', help='CAN interface, e.g. can0 or vcan0')
+    parser.add_argument('file', help='hex file of the application')
+    parser.add_argument('--tx-id', type=lambda x: int(x, 0), default=0x18DA42F1, help='CAN-ID of the requests (default: 0x18DA42F1)')
+    parser.add_argument('--rx-id', type=lambda x: int(x, 0), default=0x18DAF142, help='CAN-ID of the responses (default: 0x18DAF142)')
+    parser.add_argument('--sff', action='store_true', help='use standard frame format CAN-IDs')
+    parser.add_argument('--wait', type=float, default=30.0, help='seconds to wait for the bootloader (default: 30)')
+    parser.add_argument('--timeout', type=float, default=1.0, help='response timeout in seconds (default: 1)')
+    parser.add_argument('--dual-slot', type=int, metavar='PAGE_SIZE',
+                        help='request the copy of the staging slot (DUAL_SLOT) with the flash page size of the MCU (SPM_PAGESIZE)')
+    args = parser.parse_args()
+
+    client = UdsClient(args.interface, args.tx_id, args.rx_id, not args.sff, args.timeout)
+
+    try:
+        sys.stderr.write('Waiting for the bootloader...\n')
+        client.enter_programming(args.wait)
+
+        sys.stderr.write('Erasing...\n')
+        client.routine(ROUTINE_ERASE)
+
+        segs = segments(read_hex(args.file))
+        for i, (addr, data) in enumerate(segs):
+            # the last RequestTransferExit contains the number of pages and the
+            # CRC of the whole staging slot, where the gaps are erased
+            exit_record = b''
+            if args.dual_slot and i == len(segs) - 1:
+                image = bytearray(b'\xff' * (addr + len(data)))
+                for a, d in segs:
+                    image[a:a + len(d)] = d
+                image.extend(b'\xff' * (-len(image) % args.dual_slot))
+                exit_record = ((len(image) // args.dual_slot).to_bytes(2, 'big')
+                               + binascii.crc_hqx(bytes(image), 0).to_bytes(2, 'big'))
+
+            sys.stderr.write('Flashing %d bytes at 0x%08x...\n' % (len(data), addr))
+            client.download(addr, data, exit_record)
+
+        client.request([SID_ECU_RESET, 0x01])
+        sys.stderr.write('Done\n')
+    except UdsError as e:
+        sys.stderr.write('Error: %s\n' % e)
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()